@@ -0,0 +1,46 @@
+#ifndef __OFFSCREEN_H__
+#define __OFFSCREEN_H__
+
+#include <string>
+
+using namespace std;
+
+/*
+ * This header file defines the functions behind --headless mode, which draws frames into
+ * an offscreen framebuffer instead of a GLUT window, so the program can be benchmarked or
+ * run on machines without a display
+ */
+
+//////////////////////////////
+///        STRUCTS         ///
+//////////////////////////////
+
+// Settings of --headless mode given on the command line
+struct Headless_Options {
+    // Whether --headless was given at all
+    bool enabled;
+
+    // Number of frames to draw, and the prefix of the image files they are written to
+    int frames;
+    string prefix;
+};
+
+//////////////////////////////
+///       FUNCTIONS        ///
+//////////////////////////////
+
+// Looks for "--headless [frames] [prefix]" after the program's usual arguments, and removes it
+// from the command line if it is there. Draws 60 frames to frame_0000.ppm, frame_0001.ppm, ...
+// unless told otherwise.
+Headless_Options parse_headless_options(int &argc, char* argv[]);
+
+// Creates an OpenGL context that isn't tied to a window using EGL, and binds a framebuffer
+// object of the given size to draw into. Returns false if no context could be created.
+bool create_offscreen_context(int width, int height);
+
+// Calls draw_frame for each frame, timing it on the CPU and (with a timer query) on the GPU,
+// then reads the frame back and writes it to <prefix>_<frame>.ppm. Prints the timings of each
+// frame and their averages.
+void render_offscreen(const Headless_Options &options, int width, int height, void (*draw_frame)(int frame));
+
+#endif // #ifndef __OFFSCREEN_H__
@@ -1,5 +1,66 @@
 #include "../include/object.h"
 
+#include <string.h>
+#include <unordered_map>
+#include <unordered_set>
+
+// The bits of a vertex and its normal, used to find identical pairs when welding the buffers
+struct Weld_Key {
+    float values[6];
+
+    bool operator==(const Weld_Key &other) const {
+        return memcmp(values, other.values, sizeof(values)) == 0;
+    }
+};
+
+// FNV-1a hash of the bytes of a Weld_Key
+struct Weld_Key_Hash {
+    size_t operator()(const Weld_Key &key) const {
+        const unsigned char *bytes = (const unsigned char *) key.values;
+        size_t hash = 14695981039346656037ULL;
+        for (size_t i = 0; i < sizeof(key.values); i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        }
+        return hash;
+    }
+};
+
+// Parameters of the vertex cache optimization. The scores model an LRU cache of
+// FORSYTH_CACHE_SIZE vertices.
+const int FORSYTH_CACHE_SIZE = 32;
+const float FORSYTH_CACHE_DECAY_POWER = 1.5;
+const float FORSYTH_LAST_TRIANGLE_SCORE = 0.75;
+const float FORSYTH_VALENCE_BOOST_SCALE = 2.0;
+const float FORSYTH_VALENCE_BOOST_POWER = 0.5;
+
+// Size of the FIFO cache used to measure the ACMR
+const int ACMR_CACHE_SIZE = 16;
+
+// Score of a vertex given its position in the cache (-1 if it isn't in the cache) and
+// the number of triangles still to be drawn that use it
+float forsyth_vertex_score(int cache_position, int remaining) {
+    if (remaining == 0) {
+        return -1.0;
+    }
+
+    float score = 0.0;
+    if (cache_position >= 0) {
+        // The vertices of the last triangle get a fixed score, so the next triangle doesn't
+        // just depend on which of them happened to be added last
+        if (cache_position < 3) {
+            score = FORSYTH_LAST_TRIANGLE_SCORE;
+        }
+        else {
+            float scale = 1.0 / (FORSYTH_CACHE_SIZE - 3);
+            score = pow(1.0 - (cache_position - 3) * scale, FORSYTH_CACHE_DECAY_POWER);
+        }
+    }
+
+    // Boost vertices with few triangles left, to finish them off before they're evicted
+    score += FORSYTH_VALENCE_BOOST_SCALE * pow(remaining, -FORSYTH_VALENCE_BOOST_POWER);
+    return score;
+}
+
 //////////////////////////////
 ///    CLASS FUNCTIONS     ///
 //////////////////////////////
@@ -25,6 +86,218 @@ void Object::add_normal_to_buffer(Vertex vn) {
     normal_buffer.push_back(vn);
 }
 
+void Object::weld_buffers() {
+    vector<Vertex> welded_vertices;
+    vector<Vertex> welded_normals;
+
+    // Index of each distinct (vertex, normal) pair, keyed by its bits
+    unordered_map<Weld_Key, unsigned int, Weld_Key_Hash> indices;
+
+    index_buffer.clear();
+    index_buffer.reserve(vertex_buffer.size());
+
+    for (size_t i = 0; i < vertex_buffer.size(); i++) {
+        Vertex v = vertex_buffer[i];
+        Vertex vn = normal_buffer[i];
+        Weld_Key key = {{v.x, v.y, v.z, vn.x, vn.y, vn.z}};
+
+        // Reuse the index of the pair if we've seen it before, otherwise add it to the end
+        // of the welded buffers
+        pair<unordered_map<Weld_Key, unsigned int, Weld_Key_Hash>::iterator, bool> found =
+            indices.insert(make_pair(key, (unsigned int) welded_vertices.size()));
+        if (found.second) {
+            welded_vertices.push_back(v);
+            welded_normals.push_back(vn);
+        }
+
+        index_buffer.push_back(found.first->second);
+    }
+
+    vertex_buffer.swap(welded_vertices);
+    normal_buffer.swap(welded_normals);
+}
+
+void Object::optimize_vertex_cache() {
+    int vertex_count = vertex_buffer.size();
+    int triangle_count = index_buffer.size() / 3;
+
+    // Build the list of triangles using each vertex. The triangles of vertex v are stored in
+    // vertex_triangles[offsets[v]] to vertex_triangles[offsets[v] + remaining[v] - 1], and
+    // are swapped out of that range as they get drawn.
+    vector<int> offsets(vertex_count + 1, 0);
+    vector<int> remaining(vertex_count, 0);
+    for (int i = 0; i < triangle_count * 3; i++) {
+        remaining[index_buffer[i]]++;
+    }
+    for (int v = 0; v < vertex_count; v++) {
+        offsets[v + 1] = offsets[v] + remaining[v];
+    }
+
+    vector<int> vertex_triangles(triangle_count * 3);
+    vector<int> filled(vertex_count, 0);
+    for (int i = 0; i < triangle_count * 3; i++) {
+        int v = index_buffer[i];
+        vertex_triangles[offsets[v] + filled[v]++] = i / 3;
+    }
+
+    // Scores of the vertices, and the cache (most recent vertex first)
+    vector<int> cache_position(vertex_count, -1);
+    vector<float> vertex_score(vertex_count);
+    vector<bool> drawn(triangle_count, false);
+    vector<int> cache;
+
+    for (int v = 0; v < vertex_count; v++) {
+        vertex_score[v] = forsyth_vertex_score(-1, remaining[v]);
+    }
+
+    vector<unsigned int> reordered;
+    reordered.reserve(index_buffer.size());
+
+    // Next triangle to draw if none of the triangles of the cached vertices are left
+    int next_unused = 0;
+    int best = -1;
+
+    while (reordered.size() < index_buffer.size()) {
+        if (best < 0) {
+            while (drawn[next_unused]) {
+                next_unused++;
+            }
+            best = next_unused;
+        }
+
+        // Draw the best triangle, and take it out of its vertices' triangle lists
+        drawn[best] = true;
+        vector<int> new_cache;
+        for (int k = 0; k < 3; k++) {
+            int v = index_buffer[3 * best + k];
+            reordered.push_back(v);
+            new_cache.push_back(v);
+
+            int *triangles = &vertex_triangles[offsets[v]];
+            for (int t = 0; t < remaining[v]; t++) {
+                if (triangles[t] == best) {
+                    swap(triangles[t], triangles[remaining[v] - 1]);
+                    break;
+                }
+            }
+            remaining[v]--;
+        }
+
+        // Move the triangle's vertices to the front of the cache
+        for (int i = 0; i < cache.size(); i++) {
+            int v = cache[i];
+            if (v != new_cache[0] && v != new_cache[1] && v != new_cache[2]) {
+                new_cache.push_back(v);
+            }
+        }
+
+        // Rescore the vertices whose position in the cache changed, including the ones that
+        // fell out of it
+        for (int i = 0; i < new_cache.size(); i++) {
+            int v = new_cache[i];
+            cache_position[v] = (i < FORSYTH_CACHE_SIZE) ? i : -1;
+            vertex_score[v] = forsyth_vertex_score(cache_position[v], remaining[v]);
+        }
+        if (new_cache.size() > FORSYTH_CACHE_SIZE) {
+            new_cache.resize(FORSYTH_CACHE_SIZE);
+        }
+        cache.swap(new_cache);
+
+        // Rescore the triangles of the cached vertices, and draw the best one next
+        best = -1;
+        float best_score = -1.0;
+        for (int i = 0; i < cache.size(); i++) {
+            int v = cache[i];
+            for (int t = 0; t < remaining[v]; t++) {
+                int triangle = vertex_triangles[offsets[v] + t];
+                float score = vertex_score[index_buffer[3 * triangle]]
+                    + vertex_score[index_buffer[3 * triangle + 1]]
+                    + vertex_score[index_buffer[3 * triangle + 2]];
+
+                if (score > best_score) {
+                    best = triangle;
+                    best_score = score;
+                }
+            }
+        }
+    }
+
+    // Renumber the vertices in the order they are first used, so the vertex fetches also
+    // walk through memory in order
+    vector<int> new_index(vertex_count, -1);
+    vector<Vertex> reordered_vertices;
+    vector<Vertex> reordered_normals;
+    reordered_vertices.reserve(vertex_count);
+    reordered_normals.reserve(vertex_count);
+
+    for (int i = 0; i < reordered.size(); i++) {
+        int v = reordered[i];
+        if (new_index[v] < 0) {
+            new_index[v] = reordered_vertices.size();
+            reordered_vertices.push_back(vertex_buffer[v]);
+            reordered_normals.push_back(normal_buffer[v]);
+        }
+        reordered[i] = new_index[v];
+    }
+
+    // Unused vertices (if any) are dropped
+    vertex_buffer.swap(reordered_vertices);
+    normal_buffer.swap(reordered_normals);
+    index_buffer.swap(reordered);
+}
+
+float Object::average_cache_miss_ratio() {
+    if (index_buffer.size() < 3) {
+        return 0.0;
+    }
+
+    // Simulate a FIFO cache, which is how most GPUs' post-transform caches behave
+    vector<int> fifo(ACMR_CACHE_SIZE, -1);
+    int head = 0;
+    int misses = 0;
+
+    for (int i = 0; i < index_buffer.size(); i++) {
+        int v = index_buffer[i];
+        bool hit = false;
+        for (int j = 0; j < ACMR_CACHE_SIZE; j++) {
+            if (fifo[j] == v) {
+                hit = true;
+                break;
+            }
+        }
+
+        if (!hit) {
+            fifo[head] = v;
+            head = (head + 1) % ACMR_CACHE_SIZE;
+            misses++;
+        }
+    }
+
+    return (float) misses / (index_buffer.size() / 3);
+}
+
+vector<unsigned int> Object::get_edges() const {
+    vector<unsigned int> edges;
+
+    // Edges we've already added, keyed by their endpoints with the lower index first
+    unordered_set<unsigned long long> seen;
+
+    for (size_t i = 0; i + 2 < index_buffer.size(); i += 3) {
+        for (int k = 0; k < 3; k++) {
+            unsigned int a = index_buffer[i + k];
+            unsigned int b = index_buffer[i + (k + 1) % 3];
+            unsigned long long key = (unsigned long long) min(a, b) << 32 | max(a, b);
+
+            if (seen.insert(key).second) {
+                edges.push_back(a);
+                edges.push_back(b);
+            }
+        }
+    }
+
+    return edges;
+}
+
 Vertex Object::get_vertex(int i) {
     return vertex_buffer[i];
 }
@@ -54,6 +327,11 @@ void Object::print_object() {
         normal_buffer[i].print_vertex();
     }
 
+    printf("index buffer:\n");
+    for(size_t i = 0; i + 2 < index_buffer.size(); i += 3) {
+        printf("%u %u %u\n", index_buffer[i], index_buffer[i + 1], index_buffer[i + 2]);
+    }
+
     printf("transformations:\n");
     for(size_t i = 0; i < transforms.size(); i++) {
         printf("transform_set%zu:\n", i);
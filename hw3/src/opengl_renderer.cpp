@@ -4,6 +4,8 @@
 #include "../Eigen/Dense"
 #include "../include/parser.h"
 #include "../include/quaternion.h"
+#include "../include/offscreen.h"
+#include "../include/render_queue.h"
 #include <math.h>
 #define _USE_MATH_DEFINES
 
@@ -23,6 +25,7 @@ void display(void);
 
 void init_lights();
 void set_lights();
+void upload_objects();
 void draw_objects();
 
 void mouse_pressed(int button, int state, int x, int y);
@@ -50,6 +53,41 @@ bool is_pressed = false;
 // Boolean flag to indicate whether we are in wireframe mode
 bool wireframe_mode = false;
 
+// Settings of --headless mode, in which frames are drawn offscreen instead of in a window
+Headless_Options headless;
+
+// GPU-resident copy of a mesh, shared by all of the objects with the same label (which are
+// all copies of the same .obj file), so each mesh is only uploaded and bound once
+struct Mesh_Buffers {
+    // Vertex array object recording where the vertex and normal arrays and the indices come
+    // from, and the buffer objects holding the mesh's vertex, normal and index buffers
+    GLuint vao, vertex_vbo, normal_vbo, index_vbo;
+
+    // Number of triangle indices, followed in the index buffer object by the endpoints of
+    // each edge (for wireframe mode)
+    int index_count, edge_count;
+
+    // Center of the mesh's bounding box, which decides how far away its objects are drawn
+    float center[3];
+
+    // Indices in scene.objects of the objects drawn with this mesh, each of their transform
+    // sets composed into one column-major model matrix (16 floats per object), and the ids of
+    // their materials in the render queue
+    vector<int> objects;
+    vector<float> models;
+    vector<int> material_ids;
+};
+
+// GPU-resident copies of the distinct meshes in the scene
+vector<Mesh_Buffers> mesh_buffers;
+
+// Set when the objects need to be grouped by mesh and uploaded again before drawing
+bool meshes_dirty = true;
+
+// Sorts and issues the draw calls of each frame, and the counters of the last frame drawn
+Render_Queue render_queue;
+Render_Stats frame_stats;
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 //////////////////////////////
@@ -228,6 +266,37 @@ Quaternion compute_rotation_Quaternion(float curr_x, float curr_y, float start_x
     return rot2quar(u, theta);
 }
 
+// Composes all of an object's transform sets into a single model matrix. The transforms are
+// multiplied in the same order the glTranslatef/glRotatef/glScalef calls would apply them.
+Eigen::Matrix4f compose_transforms(const Object &object) {
+    Eigen::Affine3f model = Eigen::Affine3f::Identity();
+
+    for (int j = 0; j < object.transforms.size(); j++) {
+        const vector<Transform> &transform_set = object.transforms[j].transform_set;
+
+        // Have to iterate backwards since each transform post-multiplies the model matrix,
+        // just like the OpenGL calls do
+        for (int k = transform_set.size() - 1; k >= 0; k--) {
+            const Transform &transform = transform_set[k];
+            Eigen::Vector3f parameters(transform.parameters[0], transform.parameters[1], transform.parameters[2]);
+
+            switch (transform.type) {
+                case TRANSLATION:
+                    model.translate(parameters);
+                    break;
+                case ROTATION:
+                    model.rotate(Eigen::AngleAxisf(transform.angle, parameters.normalized()));
+                    break;
+                case SCALING:
+                    model.scale(parameters);
+                    break;
+            }
+        }
+    }
+
+    return model.matrix();
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*
@@ -321,7 +390,9 @@ void display(void) {
     draw_objects();
 
     // Swap the active and off-screen buffers with one another
-    glutSwapBuffers();
+    if (!headless.enabled) {
+        glutSwapBuffers();
+    }
 }
 
 // Initialize the light sources in the scene
@@ -367,66 +438,136 @@ void set_lights() {
     }
 }
 
-// Draw all the objects in the scene
-void draw_objects() {
-    vector<Labeled_Object> objects = scene.objects;
-
-    for (int i = 0; i < objects.size(); i++) {
-        Object object = objects[i].obj;
-
-        // Push a copy of the current Modelview Matrix onto the Stack
-        glPushMatrix();
-
-        for (int j = 0; j < object.transforms.size(); j++) {
-            Transform_Set transform_set = object.transforms[j];
-
-            // Have to iterate backwards since we want to make the calls to 
-            // the transformation in REVERSE order considering OpenGL uses 
-            for (int k = transform_set.transform_set.size() - 1; k >= 0; k--) {
-                Transform transform = transform_set.transform_set[k];
-
-                // Runs the correct OpenGL transformation based on the type of transformation
-                switch (transform.type) {
-                    case TRANSLATION:
-                        glTranslatef(transform.parameters[0], transform.parameters[1], transform.parameters[2]);
-                        break;
-                    case ROTATION:
-                        glRotatef(rad2deg(transform.angle), transform.parameters[0], transform.parameters[1], transform.parameters[2]);
-                        break;
-                    case SCALING:
-                        glScalef(transform.parameters[0], transform.parameters[1], transform.parameters[2]);
-                        break;
-                }
-            }
-        }
+// Creates the buffer objects of a mesh and uploads the object's vertex, normal and index buffers
+// into them. The objects drawn with the mesh are filled in by upload_objects.
+Mesh_Buffers create_mesh_buffers(const Object &object) {
+    Mesh_Buffers mesh;
+    glGenVertexArrays(1, &mesh.vao);
+    glGenBuffers(1, &mesh.vertex_vbo);
+    glGenBuffers(1, &mesh.normal_vbo);
+    glGenBuffers(1, &mesh.index_vbo);
+
+    vector<unsigned int> edges = object.get_edges();
+    mesh.index_count = object.index_buffer.size();
+    mesh.edge_count = edges.size();
+
+    Eigen::Vector3f lower = Eigen::Vector3f::Constant(INFINITY), upper = Eigen::Vector3f::Constant(-INFINITY);
+    for (int i = 0; i < object.vertex_buffer.size(); i++) {
+        Eigen::Vector3f vertex(object.vertex_buffer[i].x, object.vertex_buffer[i].y, object.vertex_buffer[i].z);
+        lower = lower.cwiseMin(vertex);
+        upper = upper.cwiseMax(vertex);
+    }
+    Eigen::Map<Eigen::Vector3f>(mesh.center) = (lower + upper) / 2;
 
-        // Set the material properties of the object being rendered
-        glMaterialfv(GL_FRONT, GL_AMBIENT, object.material.ambient);
-        glMaterialfv(GL_FRONT, GL_DIFFUSE, object.material.diffuse);
-        glMaterialfv(GL_FRONT, GL_SPECULAR, object.material.specular);
-        glMaterialf(GL_FRONT, GL_SHININESS, object.material.shininess);
+    // Record in the vertex array object that the vertex and normal arrays are read from the
+    // start of their buffer objects, and the indices from the index buffer object
+    glBindVertexArray(mesh.vao);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
 
-        // Set the pointer to the vertex buffer array of the object being rendered
-        glVertexPointer(3, GL_FLOAT, 0, &object.vertex_buffer[0]);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertex_vbo);
+    glBufferData(GL_ARRAY_BUFFER, object.vertex_buffer.size() * sizeof(Vertex),
+        object.vertex_buffer.data(), GL_STATIC_DRAW);
+    glVertexPointer(3, GL_FLOAT, 0, 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.normal_vbo);
+    glBufferData(GL_ARRAY_BUFFER, object.normal_buffer.size() * sizeof(Vertex),
+        object.normal_buffer.data(), GL_STATIC_DRAW);
+    glNormalPointer(GL_FLOAT, 0, 0);
+
+    // The edges go after the triangles in the index buffer object
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.index_vbo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (object.index_buffer.size() + edges.size()) * sizeof(GLuint),
+        NULL, GL_STATIC_DRAW);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, object.index_buffer.size() * sizeof(GLuint),
+        object.index_buffer.data());
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, object.index_buffer.size() * sizeof(GLuint),
+        edges.size() * sizeof(GLuint), edges.data());
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    return mesh;
+}
 
-        // Set the pointer to the normal buffer array of the object being rendered
-        glNormalPointer(GL_FLOAT, 0, &object.normal_buffer[0]);
+// Groups the objects in the scene by their mesh, and uploads each mesh to the GPU
+void upload_objects() {
+    if (!meshes_dirty) {
+        return;
+    }
 
-        int buffer_size = object.vertex_buffer.size();
-        // If not wireframe mode, draw the vertices using GL_TRIANGLE
-        if (!wireframe_mode) {
-            glDrawArrays(GL_TRIANGLES, 0, buffer_size);
-        }
-        else {
-            // Else, render using lines
-            for (int j = 0; j < buffer_size; j += 3) {
-                glDrawArrays(GL_LINE_LOOP, j, 3);
-            }
+    // Free the buffer objects of the last upload
+    for (int i = 0; i < mesh_buffers.size(); i++) {
+        Mesh_Buffers &mesh = mesh_buffers[i];
+        GLuint vbos[3] = {mesh.vertex_vbo, mesh.normal_vbo, mesh.index_vbo};
+        glDeleteVertexArrays(1, &mesh.vao);
+        glDeleteBuffers(3, vbos);
+    }
+    mesh_buffers.clear();
+
+    // Objects with the same label are copies of the same mesh
+    map<string, int> mesh_ids;
+    for (int i = 0; i < scene.objects.size(); i++) {
+        const Labeled_Object &labeled_object = scene.objects[i];
+        if (mesh_ids.count(labeled_object.label) == 0) {
+            mesh_ids[labeled_object.label] = mesh_buffers.size();
+            mesh_buffers.push_back(create_mesh_buffers(labeled_object.obj));
         }
 
-        // Retrieve the Modelview Matrix pretransformation of an object
-        glPopMatrix();
+        Mesh_Buffers &mesh = mesh_buffers[mesh_ids[labeled_object.label]];
+        Eigen::Matrix4f model = compose_transforms(labeled_object.obj);
+
+        mesh.objects.push_back(i);
+        mesh.models.insert(mesh.models.end(), model.data(), model.data() + 16);
+        mesh.material_ids.push_back(render_queue.material_id(labeled_object.obj.material));
     }
+
+    meshes_dirty = false;
+}
+
+// Returns how far in front of the camera the center of a mesh is, when drawn with the given
+// model matrix
+float eye_depth(const Eigen::Matrix4f &view, const float model[16], const float center[3]) {
+    Eigen::Vector4f point = view * Eigen::Map<const Eigen::Matrix4f>(model)
+        * Eigen::Vector4f(center[0], center[1], center[2], 1.0);
+    return -point.z();
+}
+
+// Draw all the objects in the scene
+void draw_objects() {
+    // Make sure the GPU copies of the meshes are up to date
+    upload_objects();
+
+    GLfloat view[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, view);
+    Eigen::Map<Eigen::Matrix4f> view_matrix(view);
+
+    for (int i = 0; i < mesh_buffers.size(); i++) {
+        const Mesh_Buffers &mesh = mesh_buffers[i];
+
+        // If not wireframe mode, draw the indexed vertices using GL_TRIANGLE, else render
+        // each edge once as a line, all in one call
+        Draw_Command command;
+        command.program = 0;
+        command.lighting = true;
+        command.vao = mesh.vao;
+        command.mode = wireframe_mode ? GL_LINES : GL_TRIANGLES;
+        command.count = wireframe_mode ? mesh.edge_count : mesh.index_count;
+        command.offset = wireframe_mode ? mesh.index_count * sizeof(GLuint) : 0;
+        command.instances = 1;
+
+        for (int k = 0; k < mesh.objects.size(); k++) {
+            float depth = eye_depth(view_matrix, &mesh.models[16 * k], mesh.center);
+
+            command.key = make_sort_key(0, mesh.material_ids[k], depth, scene.perspective, i);
+            command.model = &mesh.models[16 * k];
+            command.material = &scene.objects[mesh.objects[k]].obj.material;
+            command.material_id = mesh.material_ids[k];
+            render_queue.submit(command);
+        }
+    }
+
+    frame_stats = render_queue.flush();
 }
 
 // Handle mouse events when mouse is pressed
@@ -483,6 +624,11 @@ void key_pressed(unsigned char key, int x, int y) {
         // Re-render the scene
         glutPostRedisplay();
     }
+    // Print the draw call and state change counters of the last frame
+    else if(key == 'c')
+    {
+        frame_stats.print("last frame");
+    }
     else
     {
         float x_view_rad = deg2rad(x_view_angle);
@@ -518,10 +664,23 @@ void key_pressed(unsigned char key, int x, int y) {
     }
 }
 
+// Draws a frame of --headless mode. The arcball turns the scene one full turn about the y axis
+// over all of the frames.
+void draw_headless_frame(int frame) {
+    float y_axis[3] = {0.0, 1.0, 0.0};
+    curr_rotation = rot2quar(y_axis, 2 * M_PI * frame / headless.frames);
+    display();
+
+    char label[32];
+    snprintf(label, sizeof(label), "frame %d", frame);
+    frame_stats.print(label);
+}
+
 // Main function where the parsing is done and everything comes together
 int main(int argc, char* argv[]) {
+    headless = parse_headless_options(argc, argv);
     if (argc != 4) {
-        printf("Usage: ./opengl_renderer <scene_description_file.txt> xres yres\n");
+        printf("Usage: ./opengl_renderer <scene_description_file.txt> xres yres [--headless [frames] [prefix]]\n");
     }
     else {
         // Initialize filestream
@@ -585,24 +744,43 @@ int main(int argc, char* argv[]) {
                 }  
             }
 
-            // After the scene parsing business is done, render the scene
-            glutInit(&argc, argv);
+            if (headless.enabled) {
+                // Draw into an offscreen framebuffer instead of a window
+                if (!create_offscreen_context(width, height)) {
+                    cerr << "Error creating offscreen OpenGL context\n";
+                    return 1;
+                }
+            }
+            else {
+                // After the scene parsing business is done, render the scene
+                glutInit(&argc, argv);
+
+                // Initialize OpenGL display with double, RGB and depth buffers
+                glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
 
-            // Initialize OpenGL display with double, RGB and depth buffers
-            glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+                // Initialize window size
+                glutInitWindowSize(width, height);
 
-            // Initialize window size
-            glutInitWindowSize(width, height);
+                // Set top-left corner of window to be (0, 0)
+                glutInitWindowPosition(0, 0);
 
-            // Set top-left corner of window to be (0, 0)
-            glutInitWindowPosition(0, 0);
+                // Create window with name "Shader"
+                glutCreateWindow("Shader");
+            }
 
-            // Create window with name "Shader"
-            glutCreateWindow("Shader");
+            // Load the OpenGL functions newer than OpenGL 1.1, such as the buffer object
+            // functions, now that there is a context to load them for
+            glewInit();
 
             // Call our init function
             init();
 
+            // In --headless mode, draw the frames and exit
+            if (headless.enabled) {
+                render_offscreen(headless, width, height, draw_headless_frame);
+                return 0;
+            }
+
             // Set OpenGL display function to our display function
             glutDisplayFunc(display);
 
@@ -0,0 +1,46 @@
+#ifndef __LIGHT_CLUSTERS_H__
+#define __LIGHT_CLUSTERS_H__
+
+#include "./scene.h"
+
+/*
+ * This header file defines the Light_Clusters class, which splits the view frustum
+ * into a grid of clusters (screen tiles by depth slices) and records which light
+ * sources can reach each cluster, so the Phong fragment shader only has to loop over
+ * the lights of the cluster its fragment is in
+ */
+
+// Number of screen tiles along x and y, and of depth slices, in the cluster grid
+#define CLUSTER_TILES_X 16
+#define CLUSTER_TILES_Y 16
+#define CLUSTER_SLICES 24
+
+// Lights are cut off where their attenuation brings them below this fraction of their
+// brightest color channel (a single step of an 8-bit color)
+#define LIGHT_CUTOFF (1.0 / 256.0)
+
+//////////////////////////////
+///       CLASSES          ///
+//////////////////////////////
+
+// This class defines the lights assigned to each cluster of the view frustum. The clusters
+// are numbered x first, then y, then depth, and the depth slices are spaced exponentially
+// between the near and the far plane.
+class Light_Clusters {
+    public:
+        // Offset into light_indices and number of lights of each cluster, 2 per cluster
+        vector<unsigned int> clusters;
+
+        // Indices of the lights of each cluster, one cluster after the other
+        vector<unsigned int> light_indices;
+
+        // Default constructor
+        Light_Clusters() : clusters(2 * CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES, 0), light_indices() {}
+
+        // Assigns each light to the clusters its sphere of influence overlaps. The lights'
+        // positions must be in camera space, and the clusters are laid over the view
+        // frustum of the perspective.
+        void build(const vector<Light> &lights, const Perspective &perspective);
+};
+
+#endif // #ifndef __LIGHT_CLUSTERS_H__
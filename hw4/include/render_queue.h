@@ -0,0 +1,120 @@
+#ifndef __RENDER_QUEUE_H__
+#define __RENDER_QUEUE_H__
+
+#include <GL/gl.h>
+#include <stddef.h>
+#include <map>
+#include <vector>
+#include "./scene.h"
+
+using namespace std;
+
+/*
+ * This header file defines the Render_Queue class, which collects the draw calls of a
+ * frame, sorts them by a packed 64-bit key so draws sharing a shader and a material end up
+ * next to one another (and opaque objects are drawn front to back, so early depth testing
+ * throws away as many hidden fragments as possible), and then issues them while skipping
+ * every state change that wouldn't change anything
+ */
+
+// Number of bits of the sort key taken by each field, from the most significant down: the
+// pass (which shader and lighting the draw uses), the material, the depth bucket, and the
+// mesh (so draws of the same mesh at the same depth don't rebind their vertex array)
+#define SORT_KEY_PASS_BITS 8
+#define SORT_KEY_MATERIAL_BITS 24
+#define SORT_KEY_DEPTH_BITS 16
+#define SORT_KEY_MESH_BITS 16
+
+//////////////////////////////
+///        STRUCTS         ///
+//////////////////////////////
+
+// A draw call submitted to the render queue, along with the state it has to be drawn with
+struct Draw_Command {
+    // Packed sort key made by make_sort_key
+    unsigned long long key;
+
+    // Shader program to draw with (0 for the fixed-function pipeline), and whether lighting
+    // is enabled
+    GLuint program;
+    bool lighting;
+
+    // Vertex array object to draw from, and the arguments of glDrawElements(Instanced)
+    GLuint vao;
+    GLenum mode;
+    int count;
+    size_t offset;
+    int instances;
+
+    // Column-major model matrix multiplied onto the view matrix, or NULL if the shader
+    // places the instances itself
+    const float *model;
+
+    // Material of the object (and its id from Render_Queue::material_id), or NULL (and -1)
+    // to leave the material as it is
+    const Material *material;
+    int material_id;
+};
+
+// Number of draw calls made and state changes issued by Render_Queue::flush. Counts only
+// the changes that were actually issued, not the ones that were skipped.
+struct Render_Stats {
+    int draw_calls;
+    int program_changes;
+    int lighting_changes;
+    int vao_binds;
+    int material_changes;
+
+    // Default constructor
+    Render_Stats() : draw_calls(0), program_changes(0), lighting_changes(0), vao_binds(0), material_changes(0) {}
+
+    // Total number of state changes
+    int state_changes() const {
+        return program_changes + lighting_changes + vao_binds + material_changes;
+    }
+
+    // Prints the counters on one line, following the given label
+    void print(const char *label) const;
+};
+
+//////////////////////////////
+///       CLASSES          ///
+//////////////////////////////
+
+// This class defines the queue of draw calls of a frame
+class Render_Queue {
+    public:
+        // Draw calls submitted since the last flush
+        vector<Draw_Command> commands;
+
+        // Ids given to the distinct materials seen so far, by their ambient, diffuse and
+        // specular reflectances and shininess
+        map<vector<float>, int> material_ids;
+
+        // Default constructor
+        Render_Queue() : commands(), material_ids() {}
+
+        // Returns the id of the material, which is the same for every material with the
+        // same values. Ids are handed out in the order materials are first seen.
+        int material_id(const Material &material);
+
+        // Adds a draw call to the queue
+        void submit(const Draw_Command &command);
+
+        // Sorts the draw calls by their keys and issues them, then empties the queue. Each
+        // program, lighting, vertex array and material change is only made if it differs
+        // from what the last draw call used. The view matrix must be the current Modelview
+        // Matrix, and the program and lighting are put back the way they were afterwards.
+        Render_Stats flush();
+};
+
+//////////////////////////////
+///       FUNCTIONS        ///
+//////////////////////////////
+
+// Packs the fields of a draw call into a sort key. depth is the distance of the object in
+// front of the camera, bucketed between the near and far planes of the perspective, so
+// nearer objects are drawn first within the same pass and material.
+unsigned long long make_sort_key(int pass, int material_id, float depth, const Perspective &perspective, int mesh);
+
+#endif // #ifndef __RENDER_QUEUE_H__
@@ -0,0 +1,87 @@
+#ifndef __TEXTURE_CACHE_H__
+#define __TEXTURE_CACHE_H__
+
+#include <GL/gl.h>
+#include <future>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ * This header file defines the Texture_Image struct and the Texture_Cache class, which
+ * loads PNG textures on background threads. Each texture is decoded and given a full chain
+ * of mipmaps on the CPU, and the decoded levels are saved to a cache directory under a hash
+ * of the PNG file, so later runs (or other files with the same contents) read the levels
+ * back instead of decoding the PNG again. The textures are sampled trilinearly, and
+ * anisotropically where the driver supports it.
+ */
+
+// Directory, relative to where the program is run, that the decoded textures are saved in
+#define TEXTURE_CACHE_DIR "texture_cache"
+
+// Largest degree of anisotropic filtering asked for, if the driver supports it at all. Each
+// degree is another trilinear sample where the texture is squashed on screen; 1 leaves
+// plain trilinear filtering.
+#define TEXTURE_MAX_ANISOTROPY 4.0
+
+//////////////////////////////
+///        STRUCTS         ///
+//////////////////////////////
+
+// A decoded texture and its mipmaps, with rows ordered from the bottom of the image up as
+// OpenGL expects them
+struct Texture_Image {
+    // Size of the full-resolution level, and the number of 8-bit channels (3 for RGB, 4 for
+    // RGBA) of every texel
+    int width, height, channels;
+
+    // Texels of each level, from the full-resolution image down to 1x1. Empty if the image
+    // couldn't be loaded.
+    vector<vector<unsigned char> > levels;
+
+    // Set when the levels were read from the cache directory rather than decoded
+    bool cached;
+
+    // Default constructor
+    Texture_Image() : width(0), height(0), channels(0), levels(), cached(false) {}
+};
+
+//////////////////////////////
+///       CLASSES          ///
+//////////////////////////////
+
+// This class defines the textures loaded by the program, by filename
+class Texture_Cache {
+    public:
+        // Images still being loaded on background threads
+        map<string, future<Texture_Image> > loads;
+
+        // Names of the textures uploaded so far, or 0 for the files that failed to load
+        map<string, GLuint> textures;
+
+        // Default constructor
+        Texture_Cache() : loads(), textures() {}
+
+        // Starts loading the PNG file on a background thread, unless it was already
+        // requested. Doesn't need an OpenGL context, so every texture can be requested
+        // before the window is even created.
+        void request(const string &filename);
+
+        // Returns the name of the texture loaded from the PNG file, waiting for it to finish
+        // loading and uploading it first if needed. Returns 0, having printed why, if the file
+        // can't be loaded.
+        GLuint get(const string &filename);
+};
+
+//////////////////////////////
+///       FUNCTIONS        ///
+//////////////////////////////
+
+// Decodes the full-resolution level of an image from the contents of a PNG file, which has
+// to be 8 bits per channel RGB or RGBA. Defined in readpng.cpp. Returns false, printing why,
+// if it can't be decoded.
+bool decode_png(const vector<unsigned char> &contents, const string &filename, Texture_Image &image);
+
+#endif // #ifndef __TEXTURE_CACHE_H__
@@ -1,12 +1,43 @@
+#version 430 compatibility
+
 // Variables passed from the vertex shader to fragment shader
 varying vec3 normal, vertex;
 
+// Material of the instance being drawn
+varying vec3 ambient, diffuse, specular;
+varying float shininess;
+
 // uniform - shared between both shaders
 // attribute - only in vertex shader
 // varying - from vertex shader to fragment shader
 
-// Max number of light sources is 8
-#define MAX_LIGHTS 8
+// A light source in camera space
+struct Light {
+    vec4 position;
+    vec3 color;
+    float attenuation_k;
+};
+
+// All of the light sources in the scene
+layout(std430, binding = 0) readonly buffer Lights {
+    Light lights[];
+};
+
+// The view frustum is split into a grid of clusters, cluster_grid.x by cluster_grid.y screen
+// tiles by cluster_grid.z depth slices spaced exponentially between the near and far planes
+// (cluster_depth). Each cluster has an offset into cluster_lights and a number of lights.
+uniform ivec3 cluster_grid;
+uniform vec2 cluster_depth;
+uniform vec2 viewport_size;
+
+layout(std430, binding = 1) readonly buffer Clusters {
+    uvec2 clusters[];
+};
+
+// Indices of the lights reaching each cluster, one cluster after the other
+layout(std430, binding = 2) readonly buffer Cluster_Lights {
+    uint cluster_lights[];
+};
 
 // The fragment shader follows closely the lighting algorithm from Assignment 2, but is adapted to handle
 // GLSL values instead
@@ -23,21 +54,29 @@ void main()
     // Equivalent to normalize(e - P) in the lighting algorithm
     vec3 e_dir = normalize(-vertex);
 
-    // Iterate through each light source
-    for (int i = 0; i < MAX_LIGHTS; i++) {
+    // Find the cluster this fragment is in
+    ivec2 tile = ivec2(gl_FragCoord.xy / viewport_size * vec2(cluster_grid.xy));
+    int slice = int(log(-vertex.z / cluster_depth.x) / log(cluster_depth.y / cluster_depth.x) * float(cluster_grid.z));
+    tile = clamp(tile, ivec2(0), cluster_grid.xy - 1);
+    slice = clamp(slice, 0, cluster_grid.z - 1);
+    uvec2 cluster = clusters[(slice * cluster_grid.y + tile.y) * cluster_grid.x + tile.x];
+
+    // Iterate through each light source reaching the cluster
+    for (uint j = 0u; j < cluster.y; j++) {
+        Light light = lights[cluster_lights[cluster.x + j]];
+
         // Calculate the light direction. Equivalent to normalize(l_p - P) in lighting algorithm
-        vec3 l_dir = normalize(vec3(gl_LightSource[i].position) - vertex);
+        vec3 l_dir = normalize(vec3(light.position) - vertex);
 
         // Retrieves the diffuse and specular color values of the light source
-        vec4 l_diff = gl_LightSource[i].diffuse;
-        vec4 l_spec = gl_LightSource[i].specular;
-        vec4 l_amb = gl_LightSource[i].ambient;
+        vec4 l_diff = vec4(light.color, 1.0);
+        vec4 l_spec = vec4(light.color, 1.0);
         
         // Compute the distance between the point P and the light source position (in camera space)
-        float dist = distance(vec3(gl_LightSource[i].position), vertex);
+        float dist = distance(vec3(light.position), vertex);
 
         // Compute the attenuation factor
-        float k2 = gl_LightSource[i].quadraticAttenuation;
+        float k2 = light.attenuation_k;
         float attenuation = 1.0 / (1.0 + k2 * dist * dist);
 
         // Attenuates the diffuse and specular lighting color values
@@ -55,7 +94,7 @@ void main()
         vec3 h = normalize(e_dir + l_dir);
 
         // Calculate the dot product of the e_dir and r_dir exponentiated to the shininess
-        float n_dot_h = pow(max(dot(normal, h), 0.0), gl_FrontMaterial.shininess);
+        float n_dot_h = pow(max(dot(normal, h), 0.0), shininess);
 
         // Adds the diffuse factor of the current light to the current diffuse sum
         vec4 specular_factor = l_spec * n_dot_h;
@@ -63,7 +102,7 @@ void main()
     }
 
     // Specify the final color  
-    vec4 color = gl_FrontMaterial.ambient + gl_FrontMaterial.diffuse * diffuse_sum + gl_FrontMaterial.specular * specular_sum;
+    vec4 color = vec4(ambient, 1.0) + vec4(diffuse, 1.0) * diffuse_sum + vec4(specular, 1.0) * specular_sum;
 
     // Constrain the color value to 0.0 and 1.0
     color = clamp(color, 0.0, 1.0);
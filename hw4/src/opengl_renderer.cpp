@@ -8,6 +8,10 @@
 #include "../Eigen/Dense"
 #include "../include/parser.h"
 #include "../include/quaternion.h"
+#include "../include/light_clusters.h"
+#include "../include/offscreen.h"
+#include "../include/render_queue.h"
+#include "../include/shader_cache.h"
 
 // Includes for standard c library
 #include <math.h>
@@ -18,6 +22,8 @@
 // C++ data structures
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <cstddef>
 
 using namespace std;
 
@@ -31,6 +37,10 @@ void display(void);
 
 void init_lights();
 void set_lights();
+void init_light_buffers();
+void set_shader_uniforms();
+void upload_lights();
+void upload_objects();
 void draw_objects();
 
 void mouse_pressed(int button, int state, int x, int y);
@@ -59,10 +69,97 @@ bool is_pressed = false;
 // Boolean flag to indicate whether we are in wireframe mode
 bool wireframe_mode = false;
 
-// Name of the shader program and the vertex shader program filename and the fragment
-// shader program filename
-static GLenum shader;
-static string vert_filename, frag_filename;
+// Boolean flag to indicate whether the edges are drawn on top of the shaded objects
+bool overlay_mode = false;
+
+// Settings of --headless mode, in which frames are drawn offscreen instead of in a window
+Headless_Options headless;
+
+// Per-instance data read by the Phong shaders: the instance's model matrix and the inverse
+// transpose of its upper 3x3 (for transforming normals), both column-major, and its material
+struct Instance_Data {
+    float model[16];
+    float normal_matrix[9];
+    float ambient[3];
+    float diffuse[3];
+    float specular[3];
+    float shininess;
+};
+
+// Attribute locations of the fields of Instance_Data in the shaders. The model matrix takes up
+// 4 locations and the normal matrix 3.
+enum instance_attribute {
+    INSTANCE_MODEL = 4,
+    INSTANCE_NORMAL_MATRIX = 8,
+    INSTANCE_AMBIENT = 11,
+    INSTANCE_DIFFUSE = 12,
+    INSTANCE_SPECULAR = 13,
+    INSTANCE_SHININESS = 14,
+};
+
+// GPU-resident copy of a mesh, shared by all of the objects with the same label (which are
+// all copies of the same .obj file), so each mesh is only uploaded and bound once
+struct Mesh_Buffers {
+    // Vertex array object recording where the vertex and normal arrays, the indices and the
+    // instance attributes come from, and the buffer objects holding them
+    GLuint vao, vertex_vbo, normal_vbo, index_vbo, instance_vbo;
+
+    // Number of triangle indices, followed in the index buffer object by the endpoints of
+    // each edge (for wireframe mode)
+    int index_count, edge_count;
+
+    // Center of the mesh's bounding box, which decides how far away its objects are drawn
+    float center[3];
+
+    // Indices in scene.objects of the objects drawn with this mesh, each of their transform
+    // sets composed into one column-major model matrix (16 floats per object), and the ids of
+    // their materials in the render queue
+    vector<int> objects;
+    vector<float> models;
+    vector<int> material_ids;
+};
+
+// GPU-resident copies of the distinct meshes in the scene
+vector<Mesh_Buffers> mesh_buffers;
+
+// Set when the objects need to be grouped by mesh and uploaded again before drawing
+bool meshes_dirty = true;
+
+// Passes of the render queue's sort keys: the shaded triangles (or the wireframe), and then
+// the black edges of the wireframe overlay
+enum render_pass {
+    SHADED_PASS = 0,
+    OVERLAY_PASS = 1,
+};
+
+// Sorts and issues the draw calls of each frame, and the counters of the last frame drawn
+Render_Queue render_queue;
+Render_Stats frame_stats;
+
+// The Phong shader program, which is rebuilt whenever its shader files are edited
+static Shader_Program phong;
+
+// Whether the shaders were loaded, in which case every instance of a mesh is drawn in one call
+static bool instanced = false;
+
+// Binding points of the shader storage buffer objects read by the Phong fragment shader
+enum light_binding {
+    LIGHTS_BINDING = 0,
+    CLUSTERS_BINDING = 1,
+    CLUSTER_LIGHTS_BINDING = 2,
+};
+
+// Shader storage buffer objects holding the lights in camera space, the offset and number of
+// lights of each cluster, and the clusters' light lists
+GLuint light_buffer, cluster_buffer, cluster_light_buffer;
+
+// The lights in camera space as last uploaded, and the lights reaching each cluster of the
+// view frustum
+vector<Light> eye_lights;
+Light_Clusters light_clusters;
+
+// Set when the lights need to be uploaded again even if they haven't moved
+bool lights_dirty = true;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -190,134 +287,39 @@ Quaternion get_current_rotation() {
     return curr_rotation.dot(last_rotation);
 }
 
-// Load our shader programs
+// Load our shader programs, from the program binary cache if they were built before
 void read_shaders() {
-    /* Reading in source code files */
-
-    // Specifies the strings that serves as the vertical shader and the fragment
-    // shader program source code (in this case, the string is basically the
-    // contents of the whole file)
-   string vert_program_source, frag_program_source;
-   
-   // Opens the vertex shader program file
-   ifstream vert_file(vert_filename.c_str());
-   if (!vert_file) {
-       cerr << "Error opening vertex shader program\n";
-       exit(0);
-   }
-
-   // Opens the fragment shader program file
-   ifstream frag_file(frag_filename.c_str());
-   if (!frag_file) {
-       cerr << "Error opening fragment shader program\n";
-       exit(0);
-   }
-   // Get the contents/source code from the file into the program source strings
-   getline(vert_file, vert_program_source, '\0');
-
-   // This is the array of strings of source code for the vertex shader program
-   const char* vert_shader_source = vert_program_source.c_str();
-
-   // Similar to above, but is done with the fragment shader program instead
-   getline(frag_file, frag_program_source, '\0');
-   const char* frag_shader_source = frag_program_source.c_str();
-
-   /* Creating our vertex shader */
-
-   // Initialize our vertex shader
-   GLenum vert_shader;
-
-   // Initialize general shader program
-   shader = glCreateProgram();
-
-   // Create vertex shader
-   vert_shader = glCreateShader(GL_VERTEX_SHADER);
-
-   // glShaderSource takes in the shader object to whose source code is
-   // to be replaced and takes in the pointer to our source code. The fourth
-   // argument is an array of string lengths, which we specify to be NULL
-   // because there's only a single string of source code
-   glShaderSource(vert_shader, 1, &vert_shader_source, NULL);
-
-   // Compiles the vertex shader
-   glCompileShader(vert_shader);
-   
-   // Flag to check if compilation is complete
-   GLint is_compiled = 0;
-
-   // Get the final shader after compiling the code. The 2nd argument specifies
-   // the compilation status of the shader, and writes it to the 3rd argument,
-   // which is the flag variable above.
-   glGetShaderiv(vert_shader, GL_COMPILE_STATUS, &is_compiled);
-
-   // If compilation fails, output error information log
-   if(is_compiled == GL_FALSE)
-   {
-      GLint max_length = 0;
-      glGetShaderiv(vert_shader, GL_INFO_LOG_LENGTH, &max_length);
-    
-      // The max_length includes the NULL character
-      vector<GLchar> error_log(max_length);
-      glGetShaderInfoLog(vert_shader, max_length, &max_length, &error_log[0]);
-    
-      // Provide the infolog in whatever manor you deem best.
-      // Exit with failure.
-      for (int i = 0; i < error_log.size(); i++)
-         cout << error_log[i];
-      glDeleteShader(vert_shader); // Don't leak the shader.
-      return;
-   }
-
-   cerr << "making fragment shader\n";
-   /* Creating our fragment shader */
-
-   // Initialize our fragment shader
-   GLenum frag_shader;
-
-   // Similar to the above, but with fragment shader instead
-   frag_shader = glCreateShader(GL_FRAGMENT_SHADER);
-   glShaderSource(frag_shader, 1, &frag_shader_source, NULL);
-   glCompileShader(frag_shader);
-
-   is_compiled = 0;
-   glGetShaderiv(frag_shader, GL_COMPILE_STATUS, &is_compiled);
-
-   // If compilation fails, output error information log
-   if(is_compiled == GL_FALSE)
-   {
-      GLint max_length = 0;
-      glGetShaderiv(frag_shader, GL_INFO_LOG_LENGTH, &max_length);
-    
-      // The max_length includes the NULL character
-      std::vector<GLchar> error_log(max_length);
-      glGetShaderInfoLog(frag_shader, max_length, &max_length, &error_log[0]);
-    
-      // Provide the infolog in whatever manor you deem best.
-      // Exit with failure.
-      for (int i = 0; i < error_log.size(); i++)
-         cout << error_log[i];
-      glDeleteShader(frag_shader); // Don't leak the shader.
-      return;
-   }
-
-   // Initialize buffer for program info log in case shader program fails
-   char buf[1024];
-   GLsizei blah;
+    // Put the instance attributes of the vertex shader where the mesh vertex arrays expect them
+    phong.attributes["instance_model"] = INSTANCE_MODEL;
+    phong.attributes["instance_normal_matrix"] = INSTANCE_NORMAL_MATRIX;
+    phong.attributes["instance_ambient"] = INSTANCE_AMBIENT;
+    phong.attributes["instance_diffuse"] = INSTANCE_DIFFUSE;
+    phong.attributes["instance_specular"] = INSTANCE_SPECULAR;
+    phong.attributes["instance_shininess"] = INSTANCE_SHININESS;
+
+    if (!load_shader_program(phong)) {
+        return;
+    }
 
-   // Attach the newly created vertex and fragment shader to our shader programs
-   glAttachShader(shader, vert_shader);
-   glAttachShader(shader, frag_shader);
+    // Use our newly made shader program
+    glUseProgram(phong.program);
+    instanced = true;
+}
 
-   // Link the new shader program to OpenGL
-   glLinkProgram(shader);
-   cerr << "Enabling fragment program: " << gluErrorString(glGetError()) << endl;
-   glGetProgramInfoLog(shader, 1024, &blah, buf);
-   cerr << buf;
+// Checks twice a second whether the shader files were edited, and if so switches to the
+// rebuilt program. A program that doesn't build is reported, and the old one is kept.
+void reload_shaders(int value) {
+    if (reload_changed_shaders(phong)) {
+        glUseProgram(phong.program);
+        set_shader_uniforms();
+        instanced = true;
 
-   cerr << "Enabling program object" << endl;
+        // Upload the lights to the buffers, in case the first program never built
+        lights_dirty = true;
+        glutPostRedisplay();
+    }
 
-   // Use our newly made shader program
-   glUseProgram(shader);
+    glutTimerFunc(500, reload_shaders, 0);
 }
 
 // Converts a Quaternion to a rotation matrix. The details are outlined in Lecture Notes for Assignment 3
@@ -372,6 +374,37 @@ Quaternion compute_rotation_Quaternion(float curr_x, float curr_y, float start_x
     return rot2quar(u, theta);
 }
 
+// Composes all of an object's transform sets into a single model matrix. The transforms are
+// multiplied in the same order the glTranslatef/glRotatef/glScalef calls would apply them.
+Eigen::Matrix4f compose_transforms(const Object &object) {
+    Eigen::Affine3f model = Eigen::Affine3f::Identity();
+
+    for (int j = 0; j < object.transforms.size(); j++) {
+        const vector<Transform> &transform_set = object.transforms[j].transform_set;
+
+        // Have to iterate backwards since each transform post-multiplies the model matrix,
+        // just like the OpenGL calls do
+        for (int k = transform_set.size() - 1; k >= 0; k--) {
+            const Transform &transform = transform_set[k];
+            Eigen::Vector3f parameters(transform.parameters[0], transform.parameters[1], transform.parameters[2]);
+
+            switch (transform.type) {
+                case TRANSLATION:
+                    model.translate(parameters);
+                    break;
+                case ROTATION:
+                    model.rotate(Eigen::AngleAxisf(transform.angle, parameters.normalized()));
+                    break;
+                case SCALING:
+                    model.scale(parameters);
+                    break;
+            }
+        }
+    }
+
+    return model.matrix();
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*
@@ -393,6 +426,11 @@ void init(void) {
 
     // Enables auto-normalization of vectors
     glEnable(GL_NORMALIZE);
+
+    // Pushes the triangles slightly back in depth, so the edges drawn by the wireframe
+    // overlay aren't hidden by the triangles they lie on
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(1.0, 1.0);
     
     // Enables vertex buffer array and normal buffer array
     glEnableClientState(GL_VERTEX_ARRAY);
@@ -430,6 +468,11 @@ void reshape(int width, int height) {
     // Sets up Viewport to convert NDC to screen coordinates
     glViewport(0, 0, width, height);
 
+    // The Phong shaders need the size of the screen to find the tile a fragment is in
+    if (instanced) {
+        glUniform2f(glGetUniformLocation(phong.program, "viewport_size"), width, height);
+    }
+
     // Re-renders the scene after resizing
     glutPostRedisplay();
 }
@@ -465,7 +508,9 @@ void display(void) {
     draw_objects();
 
     // Swap the active and off-screen buffers with one another
-    glutSwapBuffers();
+    if (!headless.enabled) {
+        glutSwapBuffers();
+    }
 }
 
 // Initialize the light sources in the scene
@@ -476,8 +521,13 @@ void init_lights() {
     // Retrieves all light sources
     vector<Light> light_sources = scene.light_sources;
 
+    // The fixed-function pipeline only has a handful of lights, so Gouraud shading only uses
+    // the first few light sources
+    GLint max_lights;
+    glGetIntegerv(GL_MAX_LIGHTS, &max_lights);
+
     // Iterate through all light sources in OpenGL
-    for (int i = 0; i < light_sources.size(); i++) {
+    for (int i = 0; i < light_sources.size() && i < max_lights; i++) {
         Light curr = light_sources[i];
 
         // Set up the current light ID in the OpenGL
@@ -496,11 +546,16 @@ void init_lights() {
         // Set the attenuation constant of the light
         glLightf(light_id, GL_QUADRATIC_ATTENUATION, curr.attenuation_k);
     }
+
+    lights_dirty = true;
 }
 
 // Sets the light sources position in the scene
 void set_lights() {
-    for (int i = 0; i < scene.light_sources.size(); i++) {
+    GLint max_lights;
+    glGetIntegerv(GL_MAX_LIGHTS, &max_lights);
+
+    for (int i = 0; i < scene.light_sources.size() && i < max_lights; i++) {
         Light curr = scene.light_sources[i];
 
         // Set the current light id
@@ -509,68 +564,291 @@ void set_lights() {
         // Set the current light position
         glLightfv(light_id, GL_POSITION, curr.position);
     }
+
+    // The Phong shaders read all of the lights from the light buffer objects instead
+    if (instanced) {
+        upload_lights();
+    }
 }
 
-// Draw all the objects in the scene
-void draw_objects() {
-    vector<Labeled_Object> objects = scene.objects;
-
-    for (int i = 0; i < objects.size(); i++) {
-        Object object = objects[i].obj;
-
-        // Push a copy of the current Modelview Matrix onto the Stack
-        glPushMatrix();
-
-        for (int j = 0; j < object.transforms.size(); j++) {
-            Transform_Set transform_set = object.transforms[j];
-
-            // Have to iterate backwards since we want to make the calls to 
-            // the transformation in REVERSE order considering OpenGL uses 
-            for (int k = transform_set.transform_set.size() - 1; k >= 0; k--) {
-                Transform transform = transform_set.transform_set[k];
-
-                // Runs the correct OpenGL transformation based on the type of transformation
-                switch (transform.type) {
-                    case TRANSLATION:
-                        glTranslatef(transform.parameters[0], transform.parameters[1], transform.parameters[2]);
-                        break;
-                    case ROTATION:
-                        glRotatef(rad2deg(transform.angle), transform.parameters[0], transform.parameters[1], transform.parameters[2]);
-                        break;
-                    case SCALING:
-                        glScalef(transform.parameters[0], transform.parameters[1], transform.parameters[2]);
-                        break;
-                }
-            }
+// Creates the buffer objects the Phong shaders read the lights from, and tells the shaders
+// the shape of the cluster grid
+void init_light_buffers() {
+    glGenBuffers(1, &light_buffer);
+    glGenBuffers(1, &cluster_buffer);
+    glGenBuffers(1, &cluster_light_buffer);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHTS_BINDING, light_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTERS_BINDING, cluster_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHTS_BINDING, cluster_light_buffer);
+
+    set_shader_uniforms();
+}
+
+// Tells the Phong shaders the shape of the cluster grid and the size of the screen. Needed
+// again whenever the program is rebuilt, since linking resets its uniforms.
+void set_shader_uniforms() {
+    Perspective perspective = scene.perspective;
+    glUniform3i(glGetUniformLocation(phong.program, "cluster_grid"), CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES);
+    glUniform2f(glGetUniformLocation(phong.program, "cluster_depth"), perspective.near, perspective.far);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glUniform2f(glGetUniformLocation(phong.program, "viewport_size"), viewport[2], viewport[3]);
+}
+
+// Uploads the lights in camera space, and the lights reaching each cluster, to the light buffer
+// objects. Only done when the lights have moved relative to the camera.
+void upload_lights() {
+    // Like the fixed-function lights, the light positions are transformed by the current
+    // Modelview Matrix
+    GLfloat modelview[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+    Eigen::Map<Eigen::Matrix4f> modelview_matrix(modelview);
+
+    vector<Light> lights = scene.light_sources;
+    bool moved = lights_dirty || lights.size() != eye_lights.size();
+    for (int i = 0; i < lights.size(); i++) {
+        Eigen::Map<Eigen::Vector4f> position(lights[i].position);
+        position = modelview_matrix * position;
+        moved = moved || !equal(position.data(), position.data() + 4, eye_lights[i].position);
+    }
+
+    if (!moved) {
+        return;
+    }
+    eye_lights = lights;
+    light_clusters.build(eye_lights, scene.perspective);
+
+    // A Light is laid out the same as a light in the fragment shader: a vec4 position, then
+    // a vec3 color and the attenuation constant
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, light_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, eye_lights.size() * sizeof(Light), eye_lights.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cluster_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, light_clusters.clusters.size() * sizeof(GLuint),
+        light_clusters.clusters.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, cluster_light_buffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, light_clusters.light_indices.size() * sizeof(GLuint),
+        light_clusters.light_indices.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    lights_dirty = false;
+}
+
+// Points a shader attribute at a field of the Instance_Data in the bound instance buffer,
+// advancing to the next Instance_Data once per instance
+void set_instance_attribute(GLuint location, int size, size_t offset) {
+    glVertexAttribPointer(location, size, GL_FLOAT, GL_FALSE, sizeof(Instance_Data), (GLvoid *) offset);
+    glVertexAttribDivisor(location, 1);
+    glEnableVertexAttribArray(location);
+}
+
+// Creates the buffer objects of a mesh and uploads the object's vertex, normal and index buffers
+// into them. The instances are filled in by upload_objects.
+Mesh_Buffers create_mesh_buffers(const Object &object) {
+    Mesh_Buffers mesh;
+    glGenVertexArrays(1, &mesh.vao);
+    glGenBuffers(1, &mesh.vertex_vbo);
+    glGenBuffers(1, &mesh.normal_vbo);
+    glGenBuffers(1, &mesh.index_vbo);
+    glGenBuffers(1, &mesh.instance_vbo);
+
+    vector<unsigned int> edges = object.get_edges();
+    mesh.index_count = object.index_buffer.size();
+    mesh.edge_count = edges.size();
+
+    Eigen::Vector3f lower = Eigen::Vector3f::Constant(INFINITY), upper = Eigen::Vector3f::Constant(-INFINITY);
+    for (int i = 0; i < object.vertex_buffer.size(); i++) {
+        Eigen::Vector3f vertex(object.vertex_buffer[i].x, object.vertex_buffer[i].y, object.vertex_buffer[i].z);
+        lower = lower.cwiseMin(vertex);
+        upper = upper.cwiseMax(vertex);
+    }
+    Eigen::Map<Eigen::Vector3f>(mesh.center) = (lower + upper) / 2;
+
+    // Record in the vertex array object that the vertex and normal arrays are read from the
+    // start of their buffer objects, and the indices from the index buffer object
+    glBindVertexArray(mesh.vao);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vertex_vbo);
+    glBufferData(GL_ARRAY_BUFFER, object.vertex_buffer.size() * sizeof(Vertex),
+        object.vertex_buffer.data(), GL_STATIC_DRAW);
+    glVertexPointer(3, GL_FLOAT, 0, 0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.normal_vbo);
+    glBufferData(GL_ARRAY_BUFFER, object.normal_buffer.size() * sizeof(Vertex),
+        object.normal_buffer.data(), GL_STATIC_DRAW);
+    glNormalPointer(GL_FLOAT, 0, 0);
+
+    // The edges go after the triangles in the index buffer object
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.index_vbo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (object.index_buffer.size() + edges.size()) * sizeof(GLuint),
+        NULL, GL_STATIC_DRAW);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, object.index_buffer.size() * sizeof(GLuint),
+        object.index_buffer.data());
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, object.index_buffer.size() * sizeof(GLuint),
+        edges.size() * sizeof(GLuint), edges.data());
+
+    // The instance attributes are read from the instance buffer object
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.instance_vbo);
+    for (int c = 0; c < 4; c++) {
+        set_instance_attribute(INSTANCE_MODEL + c, 4, offsetof(Instance_Data, model) + 4 * c * sizeof(float));
+    }
+    for (int c = 0; c < 3; c++) {
+        set_instance_attribute(INSTANCE_NORMAL_MATRIX + c, 3,
+            offsetof(Instance_Data, normal_matrix) + 3 * c * sizeof(float));
+    }
+    set_instance_attribute(INSTANCE_AMBIENT, 3, offsetof(Instance_Data, ambient));
+    set_instance_attribute(INSTANCE_DIFFUSE, 3, offsetof(Instance_Data, diffuse));
+    set_instance_attribute(INSTANCE_SPECULAR, 3, offsetof(Instance_Data, specular));
+    set_instance_attribute(INSTANCE_SHININESS, 1, offsetof(Instance_Data, shininess));
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    return mesh;
+}
+
+// Groups the objects in the scene by their mesh, and uploads each mesh and the model matrices
+// and materials of its objects to the GPU
+void upload_objects() {
+    if (!meshes_dirty) {
+        return;
+    }
+
+    // Free the buffer objects of the last upload
+    for (int i = 0; i < mesh_buffers.size(); i++) {
+        Mesh_Buffers &mesh = mesh_buffers[i];
+        GLuint vbos[4] = {mesh.vertex_vbo, mesh.normal_vbo, mesh.index_vbo, mesh.instance_vbo};
+        glDeleteVertexArrays(1, &mesh.vao);
+        glDeleteBuffers(4, vbos);
+    }
+    mesh_buffers.clear();
+
+    // Objects with the same label are copies of the same mesh
+    map<string, int> mesh_ids;
+    for (int i = 0; i < scene.objects.size(); i++) {
+        const Labeled_Object &labeled_object = scene.objects[i];
+        if (mesh_ids.count(labeled_object.label) == 0) {
+            mesh_ids[labeled_object.label] = mesh_buffers.size();
+            mesh_buffers.push_back(create_mesh_buffers(labeled_object.obj));
         }
 
-        // Set the material properties of the object being rendered
-        glMaterialfv(GL_FRONT, GL_AMBIENT, object.material.ambient);
-        glMaterialfv(GL_FRONT, GL_DIFFUSE, object.material.diffuse);
-        glMaterialfv(GL_FRONT, GL_SPECULAR, object.material.specular);
-        glMaterialf(GL_FRONT, GL_SHININESS, object.material.shininess);
+        Mesh_Buffers &mesh = mesh_buffers[mesh_ids[labeled_object.label]];
+        Eigen::Matrix4f model = compose_transforms(labeled_object.obj);
+
+        mesh.objects.push_back(i);
+        mesh.models.insert(mesh.models.end(), model.data(), model.data() + 16);
+        mesh.material_ids.push_back(render_queue.material_id(labeled_object.obj.material));
+    }
+
+    // Fill in the instance buffer object of each mesh
+    for (int i = 0; i < mesh_buffers.size(); i++) {
+        const Mesh_Buffers &mesh = mesh_buffers[i];
+        vector<Instance_Data> instances(mesh.objects.size());
 
-        // Set the pointer to the vertex buffer array of the object being rendered
-        glVertexPointer(3, GL_FLOAT, 0, &object.vertex_buffer[0]);
+        for (int k = 0; k < instances.size(); k++) {
+            Instance_Data &instance = instances[k];
+            const Material &material = scene.objects[mesh.objects[k]].obj.material;
+            Eigen::Map<const Eigen::Matrix4f> model(&mesh.models[16 * k]);
 
-        // Set the pointer to the normal buffer array of the object being rendered
-        glNormalPointer(GL_FLOAT, 0, &object.normal_buffer[0]);
+            Eigen::Map<Eigen::Matrix4f>(instance.model) = model;
+            Eigen::Map<Eigen::Matrix3f>(instance.normal_matrix) =
+                model.topLeftCorner<3, 3>().inverse().transpose();
 
-        int buffer_size = object.vertex_buffer.size();
-        // If not wireframe mode, draw the vertices using GL_TRIANGLE
-        if (!wireframe_mode) {
-            glDrawArrays(GL_TRIANGLES, 0, buffer_size);
+            copy(material.ambient, material.ambient + 3, instance.ambient);
+            copy(material.diffuse, material.diffuse + 3, instance.diffuse);
+            copy(material.specular, material.specular + 3, instance.specular);
+            instance.shininess = material.shininess;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.instance_vbo);
+        glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(Instance_Data), instances.data(), GL_STATIC_DRAW);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    meshes_dirty = false;
+}
+
+// Returns how far in front of the camera the center of a mesh is, when drawn with the given
+// model matrix
+float eye_depth(const Eigen::Matrix4f &view, const float model[16], const float center[3]) {
+    Eigen::Vector4f point = view * Eigen::Map<const Eigen::Matrix4f>(model)
+        * Eigen::Vector4f(center[0], center[1], center[2], 1.0);
+    return -point.z();
+}
+
+// Draw all the objects in the scene
+void draw_objects() {
+    // Make sure the GPU copies of the meshes are up to date
+    upload_objects();
+
+    GLfloat view[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, view);
+    Eigen::Map<Eigen::Matrix4f> view_matrix(view);
+
+    for (int i = 0; i < mesh_buffers.size(); i++) {
+        const Mesh_Buffers &mesh = mesh_buffers[i];
+        size_t edges = mesh.index_count * sizeof(GLuint);
+
+        // If not wireframe mode, draw the indexed vertices using GL_TRIANGLE, else render
+        // each edge once as a line
+        Draw_Command command;
+        command.program = instanced ? phong.program : 0;
+        command.lighting = true;
+        command.vao = mesh.vao;
+        command.mode = wireframe_mode ? GL_LINES : GL_TRIANGLES;
+        command.count = wireframe_mode ? mesh.edge_count : mesh.index_count;
+        command.offset = wireframe_mode ? edges : 0;
+
+        // The shaders read each object's model matrix and material from the instance buffer,
+        // so all of the mesh's objects can be drawn in one call, placed as near as the
+        // nearest of them
+        if (instanced) {
+            float depth = INFINITY;
+            for (int k = 0; k < mesh.objects.size(); k++) {
+                depth = min(depth, eye_depth(view_matrix, &mesh.models[16 * k], mesh.center));
+            }
+
+            command.key = make_sort_key(SHADED_PASS, 0, depth, scene.perspective, i);
+            command.instances = mesh.objects.size();
+            command.model = NULL;
+            command.material = NULL;
+            command.material_id = -1;
+            render_queue.submit(command);
         }
         else {
-            // Else, render using lines
-            for (int j = 0; j < buffer_size; j += 3) {
-                glDrawArrays(GL_LINE_LOOP, j, 3);
+            // Otherwise each object is drawn through the fixed-function matrix and material
+            for (int k = 0; k < mesh.objects.size(); k++) {
+                float depth = eye_depth(view_matrix, &mesh.models[16 * k], mesh.center);
+
+                command.key = make_sort_key(SHADED_PASS, mesh.material_ids[k], depth, scene.perspective, i);
+                command.instances = 1;
+                command.model = &mesh.models[16 * k];
+                command.material = &scene.objects[mesh.objects[k]].obj.material;
+                command.material_id = mesh.material_ids[k];
+                render_queue.submit(command);
+            }
+        }
+
+        // Draw the edges in black on top of the shaded triangles if the overlay is on
+        if (overlay_mode && !wireframe_mode) {
+            for (int k = 0; k < mesh.objects.size(); k++) {
+                float depth = eye_depth(view_matrix, &mesh.models[16 * k], mesh.center);
+
+                Draw_Command overlay = {make_sort_key(OVERLAY_PASS, 0, depth, scene.perspective, i), 0, false,
+                    mesh.vao, GL_LINES, mesh.edge_count, edges, 1, &mesh.models[16 * k], NULL, -1};
+                render_queue.submit(overlay);
             }
         }
+    }
 
-        // Retrieve the Modelview Matrix pretransformation of an object
-        glPopMatrix();
+    // The overlay's edges are drawn unlit, in the current color
+    if (overlay_mode && !wireframe_mode) {
+        glColor3f(0.0, 0.0, 0.0);
     }
+    frame_stats = render_queue.flush();
 }
 
 // Handle mouse events when mouse is pressed
@@ -627,12 +905,37 @@ void key_pressed(unsigned char key, int x, int y) {
         // Re-render the scene
         glutPostRedisplay();
     }
+    // Toggle the wireframe overlay
+    else if(key == 'o')
+    {
+        overlay_mode = !overlay_mode;
+        // Re-render the scene
+        glutPostRedisplay();
+    }
+    // Print the draw call and state change counters of the last frame
+    else if(key == 'c')
+    {
+        frame_stats.print("last frame");
+    }
+}
+
+// Draws a frame of --headless mode. The arcball turns the scene one full turn about the y axis
+// over all of the frames.
+void draw_headless_frame(int frame) {
+    float y_axis[3] = {0.0, 1.0, 0.0};
+    curr_rotation = rot2quar(y_axis, 2 * M_PI * frame / headless.frames);
+    display();
+
+    char label[32];
+    snprintf(label, sizeof(label), "frame %d", frame);
+    frame_stats.print(label);
 }
 
 // Main function where the parsing is done and everything comes together
 int main(int argc, char* argv[]) {
+    headless = parse_headless_options(argc, argv);
     if (argc != 5) {
-        printf("Usage: ./opengl_renderer <scene_description_file.txt> xres yres mode\n");
+        printf("Usage: ./opengl_renderer <scene_description_file.txt> xres yres mode [--headless [frames] [prefix]]\n");
     }
     else {
         // Initialize filestream
@@ -700,29 +1003,45 @@ int main(int argc, char* argv[]) {
                 }  
             }
 
-            // After the scene parsing business is done, render the scene
-            glutInit(&argc, argv);
+            if (headless.enabled) {
+                // Draw into an offscreen framebuffer instead of a window
+                if (!create_offscreen_context(width, height)) {
+                    cerr << "Error creating offscreen OpenGL context\n";
+                    return 1;
+                }
+            }
+            else {
+                // After the scene parsing business is done, render the scene
+                glutInit(&argc, argv);
 
-            // Initialize OpenGL display with double, RGB and depth buffers
-            glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+                // Initialize OpenGL display with double, RGB and depth buffers
+                glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
 
-            // Initialize window size
-            glutInitWindowSize(width, height);
+                // Initialize window size
+                glutInitWindowSize(width, height);
 
-            // Set top-left corner of window to be (0, 0)
-            glutInitWindowPosition(0, 0);
+                // Set top-left corner of window to be (0, 0)
+                glutInitWindowPosition(0, 0);
 
-            // Create window with name "Shader"
-            glutCreateWindow("Shader");
+                // Create window with name "Shader"
+                glutCreateWindow("Shader");
+            }
 
             // Call our init function
             init();
 
             if (mode == 1) {
                 // Load in our shader programs
-                vert_filename = "src/vertex_phong.glsl";
-                frag_filename = "src/fragment_phong.glsl";
+                phong.vert_filename = "src/vertex_phong.glsl";
+                phong.frag_filename = "src/fragment_phong.glsl";
                 read_shaders();
+                init_light_buffers();
+            }
+
+            // In --headless mode, draw the frames and exit
+            if (headless.enabled) {
+                render_offscreen(headless, width, height, draw_headless_frame);
+                return 0;
             }
             
             // Set OpenGL display function to our display function
@@ -740,6 +1059,11 @@ int main(int argc, char* argv[]) {
             // Set OpenGL keyboard handler to be our key_pressed function
             glutKeyboardFunc(key_pressed);
 
+            // Rebuild the shaders when their files are edited
+            if (mode == 1) {
+                glutTimerFunc(500, reload_shaders, 0);
+            }
+
             // Run our event processing loop
             glutMainLoop();
         }       
@@ -1,13 +1,34 @@
+#version 430 compatibility
+
+// Per-instance model matrix, the inverse transpose of its upper 3x3 (for transforming normals)
+// and material, read from the instance buffer of the mesh being drawn
+attribute mat4 instance_model;
+attribute mat3 instance_normal_matrix;
+attribute vec3 instance_ambient, instance_diffuse, instance_specular;
+attribute float instance_shininess;
+
 // Variables to be passed into the fragment shader
 varying vec3 normal, vertex;
+varying vec3 ambient, diffuse, specular;
+varying float shininess;
 
 // Simple vertex shader for the Phong shading algorithm
 void main()
 {
-    // Converts the normal vertex and the vertex position from object space to world
-    normal = normalize(gl_NormalMatrix * gl_Normal);
-    vertex = vec3(gl_ModelViewMatrix * gl_Vertex);
+    // Applies the instance's transforms to go from object space to world space
+    vec4 world_vertex = instance_model * gl_Vertex;
+    vec3 world_normal = instance_normal_matrix * gl_Normal;
+
+    // Converts the normal vertex and the vertex position from world space to camera space
+    normal = normalize(gl_NormalMatrix * world_normal);
+    vertex = vec3(gl_ModelViewMatrix * world_vertex);
+
+    // Passes the instance's material on to the fragment shader
+    ambient = instance_ambient;
+    diffuse = instance_diffuse;
+    specular = instance_specular;
+    shininess = instance_shininess;
 
     // Applies the perspective transformation to convert from world space to NDC
-    gl_Position = ftransform();
-}
\ No newline at end of file
+    gl_Position = gl_ModelViewProjectionMatrix * world_vertex;
+}
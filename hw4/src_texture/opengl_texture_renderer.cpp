@@ -8,6 +8,7 @@
 #include "../Eigen/Dense"
 #include "../include/parser.h"
 #include "../include/quaternion.h"
+#include "../include/texture_cache.h"
 
 // Includes for standard c library
 #include <math.h>
@@ -24,9 +25,6 @@ using namespace std;
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-// Reading the PNG texture files in
-extern GLenum readpng(const char *filename);
-
 /* Defining prototype functions we want to write for OpenGL */
 
 void init(void);
@@ -57,6 +55,9 @@ bool is_pressed = false;
 static GLenum shader;
 static string vert_filename, frag_filename;
 
+// Loads the PNG texture files in on background threads
+static Texture_Cache texture_cache;
+
 // Name of the texture map and normal map to be loaded
 static GLenum texture_map, normal_map;
 static GLint texture_uniform_pos, normal_uniform_pos;
@@ -531,6 +532,10 @@ int main(int argc, char* argv[]) {
         const char* color_texture_filename = argv[1];
         const char* normal_map_filename = argv[2];
 
+        // Start decoding both textures while the window and shaders are being set up
+        texture_cache.request(color_texture_filename);
+        texture_cache.request(normal_map_filename);
+
         // Renders the scene
         glutInit(&argc, argv);
 
@@ -550,13 +555,13 @@ int main(int argc, char* argv[]) {
         init();
 
         cerr << "Loading textures\n" << endl;
-        // Load the textures, if loading fails then exit program
-        if (!(texture_map = readpng(color_texture_filename))) {
+        // Wait for the textures to load, if loading fails then exit program
+        if (!(texture_map = texture_cache.get(color_texture_filename))) {
             cerr << "Failed to load texture map\n";
             exit(1);
         }
             
-        if (!(normal_map = readpng(normal_map_filename))) {
+        if (!(normal_map = texture_cache.get(normal_map_filename))) {
             cerr << "Failed to load normal map\n";
             exit(1);
         }
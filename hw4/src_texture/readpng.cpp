@@ -1,86 +1,88 @@
 #include <stdlib.h>
 #include <png.h>
-#include <GL/gl.h>
-#include <GL/glu.h>
 #include <string.h>
 
+#include "../include/texture_cache.h"
+
+/* Reads the PNG out of the file's contents, which have already been read into memory */
+struct png_source {
+   const vector<unsigned char> *contents;
+   size_t offset;
+};
+
+static void read_png_source(png_structp png_ptr, png_bytep data, png_size_t length) {
+   png_source *source = (png_source*) png_get_io_ptr(png_ptr);
+   if (source->offset + length > source->contents->size())
+      png_error(png_ptr, "unexpected end of file");
+   memcpy(data, source->contents->data() + source->offset, length);
+   source->offset += length;
+}
+
 /* Ripped from the libpng manual */
-GLenum readpng(const char *filename) {
-   FILE *fp = fopen(filename, "rb");
-   png_byte header[8];
+bool decode_png(const vector<unsigned char> &contents, const string &filename, Texture_Image &image) {
    png_structp png_ptr;
    png_infop info_ptr, end_info;
 
-   if (!fp) {
-      fprintf(stderr, "%s ", filename);
-      perror("fopen");
-      return 0;
-   }
-   fread(header, 1, 8, fp);
-   if(png_sig_cmp(header, 0, 8))
+   if(contents.size() < 8 || png_sig_cmp(contents.data(), 0, 8))
    {
-      fprintf(stderr, "%s: Not a PNG image!\n", filename);
-      return 0;
+      fprintf(stderr, "%s: Not a PNG image!\n", filename.c_str());
+      return false;
    }
 
    png_ptr = png_create_read_struct(
       PNG_LIBPNG_VER_STRING,
       NULL, NULL, NULL);
    if(!png_ptr)
-      return 0;
+      return false;
 
    info_ptr = png_create_info_struct(png_ptr);
    if(!info_ptr) {
       png_destroy_read_struct(&png_ptr, NULL, NULL);
-      return 0;
+      return false;
    }
 
    end_info = png_create_info_struct(png_ptr);
    if(!end_info) {
-      png_destroy_read_struct(&png_ptr, NULL, NULL);
-      return 0;
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      return false;
    }
 
    /* Set up jump target for libpng errors */
    if (setjmp(png_jmpbuf(png_ptr)))
    {
       png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-      fprintf(stderr, "libpng error!\n");
-      fclose(fp);
-      return 0;
+      fprintf(stderr, "%s: libpng error!\n", filename.c_str());
+      return false;
    }
 
-   png_init_io(png_ptr, fp);
+   png_source source = {&contents, 8};
+   png_set_read_fn(png_ptr, &source, read_png_source);
    png_set_sig_bytes(png_ptr, 8);
    png_read_png(png_ptr, info_ptr, 0, NULL);
 
    /* Make sure the image is in the format we want */
    int width = png_get_image_width(png_ptr, info_ptr);
    int height = png_get_image_height(png_ptr, info_ptr);
-   if(png_get_bit_depth(png_ptr, info_ptr) != 8)
-      fprintf(stderr, "Need an 8 bit/color image!\n");
    int type = png_get_color_type(png_ptr, info_ptr);
-   if(type != PNG_COLOR_TYPE_RGB &&
-      type != PNG_COLOR_TYPE_RGBA)
-      fprintf(stderr, "Need an RGB or RGBA image!\n");
+   if(png_get_bit_depth(png_ptr, info_ptr) != 8 ||
+      (type != PNG_COLOR_TYPE_RGB && type != PNG_COLOR_TYPE_RGBA))
+   {
+      png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+      fprintf(stderr, "%s: Need an 8 bit/color RGB or RGBA image!\n", filename.c_str());
+      return false;
+   }
    int Bpp = (type==PNG_COLOR_TYPE_RGB)?3:4;
 
+   /* OpenGL wants the bottom row first */
    png_bytepp rows = png_get_rows(png_ptr, info_ptr);
-   char *tmp = (char*)malloc(width*height*Bpp);
+   image.width = width;
+   image.height = height;
+   image.channels = Bpp;
+   image.levels.assign(1, vector<unsigned char>((size_t) width*height*Bpp));
    for(int y=0; y < height; y++)
-      memcpy(tmp+width*y*Bpp, rows[height-y-1], width*Bpp);
-
-   GLenum texnum;
-   glGenTextures(1, &texnum);
-   glEnable(GL_TEXTURE_2D);
-   glBindTexture(GL_TEXTURE_2D, texnum);
-   glTexImage2D(GL_TEXTURE_2D, 0, Bpp, width, height, 0,
-      (type==PNG_COLOR_TYPE_RGB)?GL_RGB:GL_RGBA, GL_UNSIGNED_BYTE, tmp);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      memcpy(&image.levels[0][(size_t) width*y*Bpp], rows[height-y-1], width*Bpp);
 
-   //png_read_end(png_ptr, NULL);
    png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
 
-   return texnum;
+   return true;
 }
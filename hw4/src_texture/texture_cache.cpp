@@ -0,0 +1,234 @@
+// Includes for OpenGL
+#define GL_GLEXT_PROTOTYPES 1
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "../include/texture_cache.h"
+
+// Includes for standard c library
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+// Written at the start of every cached texture, so files in an older layout are decoded
+// again rather than misread
+static const char TEXTURE_CACHE_MAGIC[8] = {'T', 'E', 'X', 'M', 'I', 'P', '0', '1'};
+
+//////////////////////////////
+///    HELPER FUNCTIONS    ///
+//////////////////////////////
+
+// Reads the whole file into contents. Returns false if it can't be read.
+static bool read_file(const string &filename, vector<unsigned char> &contents) {
+    ifstream file(filename.c_str(), ios::binary | ios::ate);
+    if (!file) {
+        return false;
+    }
+    contents.resize(file.tellg());
+    file.seekg(0);
+    return (bool) file.read((char*) contents.data(), contents.size());
+}
+
+// Mixes the bytes into a 64-bit FNV-1a hash
+static unsigned long long hash_bytes(unsigned long long hash, const unsigned char *bytes, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Appends the mipmaps of the image's full-resolution level, each half the size of the one
+// before (rounded down, but at least 1), down to 1x1. Each texel is the average of the 2x2
+// block of texels it covers in the level before (clamped to the edge of odd-sized levels).
+static void build_mipmaps(Texture_Image &image) {
+    int width = image.width, height = image.height, channels = image.channels;
+    while (width > 1 || height > 1) {
+        int next_width = max(width / 2, 1), next_height = max(height / 2, 1);
+        const vector<unsigned char> &level = image.levels.back();
+        vector<unsigned char> next((size_t) next_width * next_height * channels);
+
+        for (int y = 0; y < next_height; y++) {
+            int y0 = 2 * y, y1 = min(2 * y + 1, height - 1);
+            for (int x = 0; x < next_width; x++) {
+                int x0 = 2 * x, x1 = min(2 * x + 1, width - 1);
+                for (int c = 0; c < channels; c++) {
+                    int sum = level[((size_t) y0 * width + x0) * channels + c]
+                        + level[((size_t) y0 * width + x1) * channels + c]
+                        + level[((size_t) y1 * width + x0) * channels + c]
+                        + level[((size_t) y1 * width + x1) * channels + c];
+                    next[((size_t) y * next_width + x) * channels + c] = (sum + 2) / 4;
+                }
+            }
+        }
+
+        image.levels.push_back(move(next));
+        width = next_width;
+        height = next_height;
+    }
+}
+
+// Reads the levels of a texture saved by save_cached_image. Returns false if there is no
+// such file, or it's truncated or in another layout.
+static bool load_cached_image(const string &filename, Texture_Image &image) {
+    ifstream file(filename.c_str(), ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    char magic[sizeof(TEXTURE_CACHE_MAGIC)];
+    int header[3];
+    if (!file.read(magic, sizeof(magic)) || memcmp(magic, TEXTURE_CACHE_MAGIC, sizeof(magic)) != 0
+            || !file.read((char*) header, sizeof(header))) {
+        return false;
+    }
+    image.width = header[0];
+    image.height = header[1];
+    image.channels = header[2];
+    if (image.width < 1 || image.height < 1 || (image.channels != 3 && image.channels != 4)) {
+        return false;
+    }
+
+    // The size of every level follows from the size of the first
+    int width = image.width, height = image.height;
+    image.levels.clear();
+    while (true) {
+        image.levels.push_back(vector<unsigned char>((size_t) width * height * image.channels));
+        if (!file.read((char*) image.levels.back().data(), image.levels.back().size())) {
+            image.levels.clear();
+            return false;
+        }
+
+        if (width == 1 && height == 1) {
+            break;
+        }
+        width = max(width / 2, 1);
+        height = max(height / 2, 1);
+    }
+
+    image.cached = true;
+    return true;
+}
+
+// Saves the levels of the texture. The file is written under a temporary name and then
+// renamed, so another thread or run never reads a partly written file.
+static void save_cached_image(const string &filename, const string &temporary_filename, const Texture_Image &image) {
+    mkdir(TEXTURE_CACHE_DIR, 0755);
+
+    int header[3] = {image.width, image.height, image.channels};
+    ofstream file(temporary_filename.c_str(), ios::binary);
+    file.write(TEXTURE_CACHE_MAGIC, sizeof(TEXTURE_CACHE_MAGIC));
+    file.write((const char*) header, sizeof(header));
+    for (int i = 0; i < image.levels.size(); i++) {
+        file.write((const char*) image.levels[i].data(), image.levels[i].size());
+    }
+    file.close();
+
+    if (!file || rename(temporary_filename.c_str(), filename.c_str()) != 0) {
+        remove(temporary_filename.c_str());
+    }
+}
+
+// Loads the PNG file and its mipmaps, from the cache if the same contents were decoded
+// before. Runs on a background thread, so it mustn't touch OpenGL.
+static Texture_Image load_image(string filename) {
+    Texture_Image image;
+
+    vector<unsigned char> contents;
+    if (!read_file(filename, contents)) {
+        cerr << "Error opening texture " << filename << "\n";
+        return image;
+    }
+
+    unsigned long long hash = hash_bytes(14695981039346656037ULL, contents.data(), contents.size());
+    char cache_filename[64];
+    snprintf(cache_filename, sizeof(cache_filename), "%s/%016llx.tex", TEXTURE_CACHE_DIR, hash);
+    if (load_cached_image(cache_filename, image)) {
+        return image;
+    }
+
+    if (!decode_png(contents, filename, image)) {
+        image.levels.clear();
+        return image;
+    }
+    build_mipmaps(image);
+
+    // Two files with the same contents may be decoded at once, so each writes its own
+    // temporary file
+    unsigned long long name_hash = hash_bytes(hash, (const unsigned char*) filename.c_str(), filename.size());
+    char temporary_filename[64];
+    snprintf(temporary_filename, sizeof(temporary_filename), "%s.%016llx", cache_filename, name_hash);
+    save_cached_image(cache_filename, temporary_filename, image);
+
+    return image;
+}
+
+// Uploads every level of the image into a new texture, sampled trilinearly and as
+// anisotropically as the driver allows. Returns the name of the texture.
+static GLuint upload_image(const Texture_Image &image) {
+    GLenum format = (image.channels == 3) ? GL_RGB : GL_RGBA;
+    GLenum internal_format = (image.channels == 3) ? GL_RGB8 : GL_RGBA8;
+
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glEnable(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, texture);
+
+    // Rows of RGB levels aren't always a multiple of 4 bytes long
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    int width = image.width, height = image.height;
+    for (int i = 0; i < image.levels.size(); i++) {
+        glTexImage2D(GL_TEXTURE_2D, i, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE,
+            image.levels[i].data());
+        width = max(width / 2, 1);
+        height = max(height / 2, 1);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, image.levels.size() - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    const char* extensions = (const char*) glGetString(GL_EXTENSIONS);
+    if (extensions && strstr(extensions, "GL_EXT_texture_filter_anisotropic")) {
+        GLfloat max_anisotropy = 1.0;
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &max_anisotropy);
+        glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, min(max_anisotropy, (GLfloat) TEXTURE_MAX_ANISOTROPY));
+    }
+
+    return texture;
+}
+
+//////////////////////////////
+///       FUNCTIONS        ///
+//////////////////////////////
+
+void Texture_Cache::request(const string &filename) {
+    if (textures.count(filename) || loads.count(filename)) {
+        return;
+    }
+    loads[filename] = async(launch::async, load_image, filename);
+}
+
+GLuint Texture_Cache::get(const string &filename) {
+    map<string, GLuint>::iterator it = textures.find(filename);
+    if (it != textures.end()) {
+        return it->second;
+    }
+
+    request(filename);
+    Texture_Image image = loads[filename].get();
+    loads.erase(filename);
+
+    GLuint texture = 0;
+    if (!image.levels.empty()) {
+        texture = upload_image(image);
+        cerr << (image.cached ? "Read " : "Decoded ") << filename << " (" << image.width << "x" << image.height
+            << ", " << image.levels.size() << " levels)\n";
+    }
+    textures[filename] = texture;
+    return texture;
+}
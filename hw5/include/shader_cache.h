@@ -0,0 +1,58 @@
+#ifndef __SHADER_CACHE_H__
+#define __SHADER_CACHE_H__
+
+#include <GL/gl.h>
+#include <time.h>
+#include <map>
+#include <string>
+
+using namespace std;
+
+/*
+ * This header file defines the Shader_Program struct and the functions that build it
+ * from a vertex and a fragment shader file. Linked programs are saved as program
+ * binaries in a cache directory, so later runs (with the same shader sources and the
+ * same driver) can skip compiling and linking altogether. Programs can also be rebuilt
+ * whenever their shader files are edited, without restarting the program.
+ */
+
+// Directory, relative to where the program is run, that the program binaries are saved in
+#define SHADER_CACHE_DIR "shader_cache"
+
+//////////////////////////////
+///        STRUCTS         ///
+//////////////////////////////
+
+// A GLSL program made of a vertex and a fragment shader read from files
+struct Shader_Program {
+    // Name of the linked program, or 0 if it hasn't been built yet
+    GLuint program;
+
+    // Filenames of the vertex and fragment shaders
+    string vert_filename, frag_filename;
+
+    // Locations of vertex attributes to bind before linking, by attribute name
+    map<string, GLuint> attributes;
+
+    // Modification times of the shader files when the program was last built
+    time_t vert_time, frag_time;
+
+    // Default constructor
+    Shader_Program() : program(0), vert_filename(), frag_filename(), attributes(), vert_time(0), frag_time(0) {}
+};
+
+//////////////////////////////
+///       FUNCTIONS        ///
+//////////////////////////////
+
+// Builds the program from its shader files, loading it from the cache if it was linked
+// before and compiling and linking it (and saving it to the cache) otherwise. Replaces the
+// program built before, if any. Returns false, printing why and keeping the old program,
+// if the shaders can't be read, compiled or linked.
+bool load_shader_program(Shader_Program &shader_program);
+
+// Builds the program again if either shader file was modified since it was last built.
+// Returns true if a new program replaced the old one.
+bool reload_changed_shaders(Shader_Program &shader_program);
+
+#endif // #ifndef __SHADER_CACHE_H__
@@ -1,3 +1,5 @@
+#version 430 compatibility
+
 // Variables passed from the vertex shader to fragment shader
 varying vec3 normal, vertex;
 
@@ -5,8 +7,33 @@ varying vec3 normal, vertex;
 // attribute - only in vertex shader
 // varying - from vertex shader to fragment shader
 
-// Max number of light sources is 8
-#define MAX_LIGHTS 8
+// A light source in camera space
+struct Light {
+    vec4 position;
+    vec3 color;
+    float attenuation_k;
+};
+
+// All of the light sources in the scene
+layout(std430, binding = 0) readonly buffer Lights {
+    Light lights[];
+};
+
+// The view frustum is split into a grid of clusters, cluster_grid.x by cluster_grid.y screen
+// tiles by cluster_grid.z depth slices spaced exponentially between the near and far planes
+// (cluster_depth). Each cluster has an offset into cluster_lights and a number of lights.
+uniform ivec3 cluster_grid;
+uniform vec2 cluster_depth;
+uniform vec2 viewport_size;
+
+layout(std430, binding = 1) readonly buffer Clusters {
+    uvec2 clusters[];
+};
+
+// Indices of the lights reaching each cluster, one cluster after the other
+layout(std430, binding = 2) readonly buffer Cluster_Lights {
+    uint cluster_lights[];
+};
 
 // The fragment shader follows closely the lighting algorithm from Assignment 2, but is adapted to handle
 // GLSL values instead
@@ -23,21 +50,29 @@ void main()
     // Equivalent to normalize(e - P) in the lighting algorithm
     vec3 e_dir = normalize(-vertex);
 
-    // Iterate through each light source
-    for (int i = 0; i < MAX_LIGHTS; i++) {
+    // Find the cluster this fragment is in
+    ivec2 tile = ivec2(gl_FragCoord.xy / viewport_size * vec2(cluster_grid.xy));
+    int slice = int(log(-vertex.z / cluster_depth.x) / log(cluster_depth.y / cluster_depth.x) * float(cluster_grid.z));
+    tile = clamp(tile, ivec2(0), cluster_grid.xy - 1);
+    slice = clamp(slice, 0, cluster_grid.z - 1);
+    uvec2 cluster = clusters[(slice * cluster_grid.y + tile.y) * cluster_grid.x + tile.x];
+
+    // Iterate through each light source reaching the cluster
+    for (uint j = 0u; j < cluster.y; j++) {
+        Light light = lights[cluster_lights[cluster.x + j]];
+
         // Calculate the light direction. Equivalent to normalize(l_p - P) in lighting algorithm
-        vec3 l_dir = normalize(vec3(gl_LightSource[i].position) - vertex);
+        vec3 l_dir = normalize(vec3(light.position) - vertex);
 
         // Retrieves the diffuse and specular color values of the light source
-        vec4 l_diff = gl_LightSource[i].diffuse;
-        vec4 l_spec = gl_LightSource[i].specular;
-        vec4 l_amb = gl_LightSource[i].ambient;
+        vec4 l_diff = vec4(light.color, 1.0);
+        vec4 l_spec = vec4(light.color, 1.0);
         
         // Compute the distance between the point P and the light source position (in camera space)
-        float dist = distance(vec3(gl_LightSource[i].position), vertex);
+        float dist = distance(vec3(light.position), vertex);
 
         // Compute the attenuation factor
-        float k2 = gl_LightSource[i].quadraticAttenuation;
+        float k2 = light.attenuation_k;
         float attenuation = 1.0 / (1.0 + k2 * dist * dist);
 
         // Attenuates the diffuse and specular lighting color values
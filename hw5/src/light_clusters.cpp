@@ -0,0 +1,125 @@
+#include "../include/light_clusters.h"
+#include <math.h>
+#include <algorithm>
+
+//////////////////////////////
+///    HELPER FUNCTIONS    ///
+//////////////////////////////
+
+// Returns the depth slice containing the points at the given distance in front of the camera
+static int depth_slice(float depth, const Perspective &perspective) {
+    int slice = (int) floor(log(depth / perspective.near) / log(perspective.far / perspective.near) * CLUSTER_SLICES);
+    return min(max(slice, 0), CLUSTER_SLICES - 1);
+}
+
+// Finds the first and last tiles along one screen axis covered by the camera space coordinates
+// between low and high, at distances between near_depth and far_depth in front of the camera.
+// side_min and side_max are the sides of the frustum on the near plane along that axis. Returns
+// false if the coordinates are off screen.
+static bool tile_range(float low, float high, float near_depth, float far_depth, const Perspective &perspective,
+        float side_min, float side_max, int tiles, int &first, int &last) {
+    // A point projects onto the near plane at near * coordinate / depth, so the coordinates
+    // reach furthest out at the nearest or furthest depth
+    float projected_low = perspective.near * min(low / near_depth, low / far_depth);
+    float projected_high = perspective.near * max(high / near_depth, high / far_depth);
+
+    // Convert to fractions of the way across the screen
+    float screen_low = (projected_low - side_min) / (side_max - side_min);
+    float screen_high = (projected_high - side_min) / (side_max - side_min);
+    if (screen_high < 0.0 || screen_low > 1.0) {
+        return false;
+    }
+
+    first = max((int) floor(screen_low * tiles), 0);
+    last = min((int) floor(screen_high * tiles), tiles - 1);
+    return true;
+}
+
+//////////////////////////////
+///     CLASS FUNCTIONS    ///
+//////////////////////////////
+
+void Light_Clusters::build(const vector<Light> &lights, const Perspective &perspective) {
+    // First and last tile along x and y and first and last depth slice reached by each light
+    vector<int> ranges(6 * lights.size());
+    vector<bool> reaches_frustum(lights.size(), false);
+
+    // Number of lights of each cluster
+    vector<unsigned int> counts(CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES, 0);
+
+    for (int i = 0; i < lights.size(); i++) {
+        const Light &light = lights[i];
+        int *range = &ranges[6 * i];
+
+        float brightness = max(max(light.color[0], light.color[1]), light.color[2]);
+        if (brightness <= 0.0) {
+            continue;
+        }
+
+        if (light.attenuation_k > 0.0) {
+            // The light is attenuated by 1 / (1 + k * d^2), so it only reaches the cutoff
+            // within this distance of its position
+            float radius = sqrt(max(brightness / LIGHT_CUTOFF - 1.0, 0.0) / light.attenuation_k);
+            const float *p = light.position;
+
+            // Clip the light's sphere of influence to the near and far planes
+            float near_depth = max(-p[2] - radius, perspective.near);
+            float far_depth = min(-p[2] + radius, perspective.far);
+            if (near_depth > far_depth) {
+                continue;
+            }
+
+            if (!tile_range(p[0] - radius, p[0] + radius, near_depth, far_depth, perspective,
+                    perspective.left, perspective.right, CLUSTER_TILES_X, range[0], range[1])) {
+                continue;
+            }
+            if (!tile_range(p[1] - radius, p[1] + radius, near_depth, far_depth, perspective,
+                    perspective.bottom, perspective.top, CLUSTER_TILES_Y, range[2], range[3])) {
+                continue;
+            }
+            range[4] = depth_slice(near_depth, perspective);
+            range[5] = depth_slice(far_depth, perspective);
+        }
+        else {
+            // Unattenuated lights reach every cluster
+            range[0] = 0, range[1] = CLUSTER_TILES_X - 1;
+            range[2] = 0, range[3] = CLUSTER_TILES_Y - 1;
+            range[4] = 0, range[5] = CLUSTER_SLICES - 1;
+        }
+
+        reaches_frustum[i] = true;
+        for (int z = range[4]; z <= range[5]; z++) {
+            for (int y = range[2]; y <= range[3]; y++) {
+                for (int x = range[0]; x <= range[1]; x++) {
+                    counts[(z * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x]++;
+                }
+            }
+        }
+    }
+
+    // Lay out the clusters' light lists one after the other
+    unsigned int offset = 0;
+    for (int c = 0; c < counts.size(); c++) {
+        clusters[2 * c] = offset;
+        clusters[2 * c + 1] = 0;
+        offset += counts[c];
+    }
+    light_indices.resize(offset);
+
+    // Fill in the light lists, counting the lights of each cluster back up as we go
+    for (int i = 0; i < lights.size(); i++) {
+        if (!reaches_frustum[i]) {
+            continue;
+        }
+
+        const int *range = &ranges[6 * i];
+        for (int z = range[4]; z <= range[5]; z++) {
+            for (int y = range[2]; y <= range[3]; y++) {
+                for (int x = range[0]; x <= range[1]; x++) {
+                    int c = (z * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x;
+                    light_indices[clusters[2 * c] + clusters[2 * c + 1]++] = i;
+                }
+            }
+        }
+    }
+}
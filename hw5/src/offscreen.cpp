@@ -0,0 +1,169 @@
+// Includes for EGL and OpenGL
+#define GL_GLEXT_PROTOTYPES 1
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "../include/offscreen.h"
+
+// Includes for standard c library
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+//////////////////////////////
+///    HELPER FUNCTIONS    ///
+//////////////////////////////
+
+// Writes the pixels read back from the framebuffer (bottom row first) to a binary PPM file
+static bool write_ppm(const char* filename, int width, int height, const vector<unsigned char> &pixels) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        return false;
+    }
+
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    for (int y = height - 1; y >= 0; y--) {
+        fwrite(&pixels[3 * width * y], 1, 3 * width, fp);
+    }
+
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+//////////////////////////////
+///       FUNCTIONS        ///
+//////////////////////////////
+
+Headless_Options parse_headless_options(int &argc, char* argv[]) {
+    Headless_Options options;
+    options.enabled = false;
+    options.frames = 60;
+    options.prefix = "frame";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            options.enabled = true;
+            if (i + 1 < argc) {
+                options.frames = atoi(argv[i + 1]);
+            }
+            if (i + 2 < argc) {
+                options.prefix = argv[i + 2];
+            }
+
+            // Everything from --headless on belongs to it
+            argc = i;
+            break;
+        }
+    }
+
+    return options;
+}
+
+bool create_offscreen_context(int width, int height) {
+    // Use Mesa's surfaceless platform if it is there, since it doesn't need a display server
+    // at all, and the default display otherwise
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display) {
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+        return false;
+    }
+
+    EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint config_count;
+    if (!eglChooseConfig(display, config_attributes, &config, 1, &config_count) || config_count == 0) {
+        return false;
+    }
+
+    // The context needs a surface on drivers without surfaceless contexts, but everything is
+    // drawn into the framebuffer object, so a 1 x 1 pixel buffer is enough
+    EGLint surface_attributes[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    EGLSurface surface = eglCreatePbufferSurface(display, config, surface_attributes);
+
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context)) {
+        return false;
+    }
+
+    // Create a framebuffer object with color and depth buffers of the given size, and draw
+    // into it from now on
+    GLuint framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        return false;
+    }
+
+    glViewport(0, 0, width, height);
+    return true;
+}
+
+void render_offscreen(const Headless_Options &options, int width, int height, void (*draw_frame)(int frame)) {
+    // Timestamps taken by the GPU before and after each frame
+    GLuint timestamps[2];
+    glGenQueries(2, timestamps);
+
+    vector<unsigned char> pixels(3 * width * height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    double total_cpu_ms = 0.0, total_gpu_ms = 0.0;
+    for (int frame = 0; frame < options.frames; frame++) {
+        // Time how long the CPU takes to issue the frame, and how long the GPU takes to draw it
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        glQueryCounter(timestamps[0], GL_TIMESTAMP);
+        draw_frame(frame);
+        glQueryCounter(timestamps[1], GL_TIMESTAMP);
+        double cpu_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        // Reading the frame back waits for it to be drawn
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+        GLuint64 gpu_start, gpu_end;
+        glGetQueryObjectui64v(timestamps[0], GL_QUERY_RESULT, &gpu_start);
+        glGetQueryObjectui64v(timestamps[1], GL_QUERY_RESULT, &gpu_end);
+        double gpu_ms = (gpu_end - gpu_start) / 1.0e6;
+
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s_%04d.ppm", options.prefix.c_str(), frame);
+        if (!write_ppm(filename, width, height, pixels)) {
+            fprintf(stderr, "Error writing %s\n", filename);
+        }
+
+        printf("frame %d: cpu %.3f ms, gpu %.3f ms\n", frame, cpu_ms, gpu_ms);
+        total_cpu_ms += cpu_ms;
+        total_gpu_ms += gpu_ms;
+    }
+
+    if (options.frames > 0) {
+        printf("average over %d frames: cpu %.3f ms, gpu %.3f ms\n", options.frames,
+            total_cpu_ms / options.frames, total_gpu_ms / options.frames);
+    }
+
+    glDeleteQueries(2, timestamps);
+}
@@ -0,0 +1,168 @@
+// Includes for OpenGL
+#define GL_GLEXT_PROTOTYPES 1
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "../Eigen/Dense"
+#include "../include/render_queue.h"
+
+// Includes for standard c library
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+//////////////////////////////
+///    HELPER FUNCTIONS    ///
+//////////////////////////////
+
+// Orders draw calls by their sort keys
+static bool key_less(const Draw_Command &a, const Draw_Command &b) {
+    return a.key < b.key;
+}
+
+// Clamps the value to the range of an unsigned field of the given number of bits
+static unsigned long long sort_key_field(long long value, int bits) {
+    long long max_value = (1LL << bits) - 1;
+    return (unsigned long long) min(max(value, 0LL), max_value);
+}
+
+//////////////////////////////
+///       FUNCTIONS        ///
+//////////////////////////////
+
+void Render_Stats::print(const char *label) const {
+    printf("%s: %d draw calls, %d state changes (%d programs, %d lighting, %d vertex arrays, %d materials)\n",
+        label, draw_calls, state_changes(), program_changes, lighting_changes, vao_binds, material_changes);
+}
+
+int Render_Queue::material_id(const Material &material) {
+    vector<float> values(material.ambient, material.ambient + 3);
+    values.insert(values.end(), material.diffuse, material.diffuse + 3);
+    values.insert(values.end(), material.specular, material.specular + 3);
+    values.push_back(material.shininess);
+
+    map<vector<float>, int>::iterator it = material_ids.find(values);
+    if (it != material_ids.end()) {
+        return it->second;
+    }
+
+    int id = material_ids.size();
+    material_ids[values] = id;
+    return id;
+}
+
+void Render_Queue::submit(const Draw_Command &command) {
+    commands.push_back(command);
+}
+
+Render_Stats Render_Queue::flush() {
+    Render_Stats stats;
+
+    // Draws with equal keys keep the order they were submitted in
+    stable_sort(commands.begin(), commands.end(), key_less);
+
+    GLfloat view[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, view);
+    Eigen::Map<Eigen::Matrix4f> view_matrix(view);
+
+    // The state left by whatever was drawn before the queue
+    GLint first_program;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &first_program);
+    GLuint program = first_program;
+    bool first_lighting = glIsEnabled(GL_LIGHTING);
+    bool lighting = first_lighting;
+    GLuint vao = 0;
+    int material = -1;
+    bool bound_vao = false;
+
+    // Model matrix of the last draw, or NULL while the view matrix is loaded
+    const float *model = NULL;
+
+    for (int i = 0; i < commands.size(); i++) {
+        const Draw_Command &command = commands[i];
+
+        if (command.program != program) {
+            glUseProgram(command.program);
+            program = command.program;
+            stats.program_changes++;
+        }
+        if (command.lighting != lighting) {
+            if (command.lighting) {
+                glEnable(GL_LIGHTING);
+            }
+            else {
+                glDisable(GL_LIGHTING);
+            }
+            lighting = command.lighting;
+            stats.lighting_changes++;
+        }
+        if (!bound_vao || command.vao != vao) {
+            glBindVertexArray(command.vao);
+            vao = command.vao;
+            bound_vao = true;
+            stats.vao_binds++;
+        }
+        if (command.material && command.material_id != material) {
+            glMaterialfv(GL_FRONT, GL_AMBIENT, command.material->ambient);
+            glMaterialfv(GL_FRONT, GL_DIFFUSE, command.material->diffuse);
+            glMaterialfv(GL_FRONT, GL_SPECULAR, command.material->specular);
+            glMaterialf(GL_FRONT, GL_SHININESS, command.material->shininess);
+            material = command.material_id;
+            stats.material_changes++;
+        }
+
+        // Load the composed view and model matrix in one go, rather than pushing, multiplying
+        // and popping the matrix stack
+        if (command.model != model) {
+            if (command.model) {
+                Eigen::Matrix4f modelview = view_matrix * Eigen::Map<const Eigen::Matrix4f>(command.model);
+                glLoadMatrixf(modelview.data());
+            }
+            else {
+                glLoadMatrixf(view);
+            }
+            model = command.model;
+        }
+
+        if (command.instances > 1) {
+            glDrawElementsInstanced(command.mode, command.count, GL_UNSIGNED_INT, (GLvoid *) command.offset,
+                command.instances);
+        }
+        else {
+            glDrawElements(command.mode, command.count, GL_UNSIGNED_INT, (GLvoid *) command.offset);
+        }
+        stats.draw_calls++;
+    }
+
+    // Put everything back the way it was before the queue was drawn
+    if (model) {
+        glLoadMatrixf(view);
+    }
+    glBindVertexArray(0);
+    if (program != first_program) {
+        glUseProgram(first_program);
+    }
+    if (lighting != first_lighting) {
+        if (first_lighting) {
+            glEnable(GL_LIGHTING);
+        }
+        else {
+            glDisable(GL_LIGHTING);
+        }
+    }
+
+    commands.clear();
+    return stats;
+}
+
+unsigned long long make_sort_key(int pass, int material_id, float depth, const Perspective &perspective, int mesh) {
+    // Objects behind the near plane (or past the far plane) go in the first (or last) bucket
+    float fraction = (depth - perspective.near) / (perspective.far - perspective.near);
+    long long depth_bucket = (long long) floor(fraction * (1 << SORT_KEY_DEPTH_BITS));
+
+    unsigned long long key = sort_key_field(pass, SORT_KEY_PASS_BITS);
+    key = (key << SORT_KEY_MATERIAL_BITS) | sort_key_field(material_id, SORT_KEY_MATERIAL_BITS);
+    key = (key << SORT_KEY_DEPTH_BITS) | sort_key_field(depth_bucket, SORT_KEY_DEPTH_BITS);
+    key = (key << SORT_KEY_MESH_BITS) | sort_key_field(mesh, SORT_KEY_MESH_BITS);
+    return key;
+}
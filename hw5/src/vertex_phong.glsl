@@ -1,3 +1,5 @@
+#version 430 compatibility
+
 // Variables to be passed into the fragment shader
 varying vec3 normal, vertex;
 
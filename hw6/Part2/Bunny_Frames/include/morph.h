@@ -0,0 +1,62 @@
+#ifndef __MORPH_H__
+#define __MORPH_H__
+
+#include <GL/gl.h>
+#include <vector>
+#include "./frame.h"
+#include "./shader_cache.h"
+
+using namespace std;
+
+/*
+ * This header file defines the Morph_Animation struct and the functions behind --morph
+ * mode, which plays the animation on the GPU. Only the keyframes' vertices and normals are
+ * uploaded, sharing one index buffer, and the vertex shader blends the four control
+ * keyframes of each frame with the same Catmull-Rom spline as find_interpolated_value. No
+ * frame in between the keyframes is ever built on the CPU, so the animation takes memory
+ * for the keyframes alone, and can be drawn at any point in time, not just at whole frames.
+ */
+
+//////////////////////////////
+///        STRUCTS         ///
+//////////////////////////////
+
+// The keyframes of an animation resident on the GPU
+struct Morph_Animation {
+    // Frame ids of the keyframes, in order
+    vector<int> keyframe_ids;
+
+    // Number of vertices of each keyframe, and of indices of the shared triangles
+    int vertex_count, index_count;
+
+    // Buffer object holding the vertices and then the normals of each keyframe in turn, and
+    // the index buffer object of the triangles
+    GLuint vertex_vbo, index_vbo;
+
+    // Vertex array object of each span between two keyframes, which reads the vertices and
+    // normals of the span's four control keyframes as the shader's attributes
+    vector<GLuint> span_vaos;
+
+    // The shader program blending the control keyframes
+    Shader_Program shader;
+
+    // Default constructor
+    Morph_Animation() : keyframe_ids(), vertex_count(0), index_count(0), vertex_vbo(0), index_vbo(0),
+        span_vaos(), shader() {}
+};
+
+//////////////////////////////
+///       FUNCTIONS        ///
+//////////////////////////////
+
+// Computes the normals of the keyframes (which must all have the same faces) with the
+// halfedge data structure, uploads the keyframes and builds the shader program from the
+// given files. Returns false, having printed why, if the shaders don't build.
+bool create_morph_animation(Morph_Animation &morph, const vector<Frame> &keyframes,
+    const string &vert_filename, const string &frag_filename);
+
+// Draws the animation at the given time, in frames (which needn't be a whole number),
+// clamped to the range of the keyframes. The material and lights are the current ones.
+void draw_morph_animation(const Morph_Animation &morph, float time);
+
+#endif // #ifndef __MORPH_H__
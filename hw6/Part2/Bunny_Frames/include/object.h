@@ -48,18 +48,22 @@ class Object {
         // These are generated using the halfedge data structure
         vector<Vertex> vertex_buffer;
         vector<Vertex> normal_buffer;
+
+        // Indices into the vertex and normal buffers of the 3 corners of each triangle. Filled
+        // in by weld_buffers.
+        vector<unsigned int> index_buffer;
         
         // Default constructor that initializes empty lists of vertices and
         // faces and empty vertex and normal buffers.
-        Object() : vertices(), faces(), vertex_buffer(), normal_buffer() {}
+        Object() : vertices(), faces(), vertex_buffer(), normal_buffer(), index_buffer() {}
 
         // Constructor that takes in only a list of vertices and faces that
         // forms the object.
-        Object(vector<Vertex> vs, vector<Face> fs) : vertices(vs), faces(fs), vertex_buffer(), normal_buffer() {}
+        Object(vector<Vertex> vs, vector<Face> fs) : vertices(vs), faces(fs), vertex_buffer(), normal_buffer(), index_buffer() {}
 
         // Copy constructor for an Object class
         Object(const Object& other) : vertices(other.vertices), faces(other.faces), 
-            vertex_buffer(other.vertex_buffer), normal_buffer(other.normal_buffer) {}
+            vertex_buffer(other.vertex_buffer), normal_buffer(other.normal_buffer), index_buffer(other.index_buffer) {}
 
         // Add a vertex normal to the vector of vertex normals
         void add_normal(Vertex vn);
@@ -76,6 +80,19 @@ class Object {
         // Add a vertex to the normal buffer array
         void add_normal_to_buffer(Vertex v);
 
+        // Merge the identical (vertex, normal) pairs in the vertex and normal buffers, which
+        // hold 3 entries per triangle, and fill in the index buffer pointing into them
+        void weld_buffers();
+
+        // Reorder the triangles in the index buffer so they reuse recently drawn vertices
+        // (using Tom Forsyth's linear-speed vertex cache optimization), then reorder the
+        // vertex and normal buffers in the order the triangles first use them
+        void optimize_vertex_cache();
+
+        // Average number of vertices transformed per triangle (the ACMR) when drawing the
+        // index buffer through a FIFO post-transform cache
+        float average_cache_miss_ratio();
+
         // Print text representing the Object object
         void print_object();
 };
@@ -0,0 +1,7 @@
+#version 120
+
+// The color is lit per vertex, so each fragment takes the interpolated color
+void main()
+{
+    gl_FragColor = gl_Color;
+}
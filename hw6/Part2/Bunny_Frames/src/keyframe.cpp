@@ -11,10 +11,13 @@
 #include "../include/frame.h"
 #include "../include/utils.h"
 #include "../include/halfedge.h"
+#include "../include/morph.h"
+#include "../include/offscreen.h"
 
 // Includes for standard C library
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sstream>
 #include <fstream>
 #include <iostream>
@@ -38,6 +41,7 @@ void set_lights();
 void reshape(int width, int height);
 void display(void);
 void key_pressed(unsigned char key, int x, int y);
+void advance_playback(int value);
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -57,6 +61,23 @@ vector<Frame> all_frames;
 // Current frame id to load the corresponding frame
 int curr_frame_id;
 
+// Settings of --headless mode, in which frames are drawn offscreen instead of in a window
+Headless_Options headless;
+
+// Boolean flag to indicate whether the animation is blended on the GPU from the keyframes
+// (--morph mode) instead of drawn from the interpolated frames in all_frames
+bool morph_mode = false;
+Morph_Animation morph;
+
+// Speed the animation plays at when 'p' is pressed in --morph mode, in frames per second
+const float playback_speed = 10.0;
+
+// Boolean flag to indicate whether the animation is playing, the time it has reached (in
+// frames) and the time in milliseconds it was last advanced
+bool is_playing = false;
+float play_time = 0.0;
+int last_tick;
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 ///////////////////////////////////
@@ -161,8 +182,25 @@ void reshape(int width, int height) {
     glutPostRedisplay();
 }
 
-// Draw the frame with the given bunny Object
-void draw_bunny(Object* bunny) {
+// Returns the number of frames in the animation
+int frame_count() {
+    if (morph_mode) {
+        return morph.keyframe_ids.back() + 1;
+    }
+    return all_frames.size();
+}
+
+// Returns whether the frame with the given id is a keyframe
+bool is_keyframe(int frame_id) {
+    if (morph_mode) {
+        return find(morph.keyframe_ids.begin(), morph.keyframe_ids.end(), frame_id) != morph.keyframe_ids.end();
+    }
+    return all_frames[frame_id].is_keyframe;
+}
+
+// Draw the frame with the given bunny Object, or in --morph mode (where bunny is NULL), blend
+// the keyframes at the given time
+void draw_bunny(Object* bunny, float time) {
     // Push a copy of the current Modelview Matrix onto the Stack
     glPushMatrix();
 
@@ -183,14 +221,19 @@ void draw_bunny(Object* bunny) {
     glMaterialfv(GL_FRONT, GL_SPECULAR, spec);
     glMaterialf(GL_FRONT, GL_SHININESS, shininess);
 
-    // Set the pointer to the vertex buffer array of the object being rendered
-    glVertexPointer(3, GL_FLOAT, 0, &bunny->vertex_buffer[0]);
+    if (morph_mode) {
+        draw_morph_animation(morph, time);
+    }
+    else {
+        // Set the pointer to the vertex buffer array of the object being rendered
+        glVertexPointer(3, GL_FLOAT, 0, &bunny->vertex_buffer[0]);
 
-    // Set the pointer to the normal buffer array of the object being rendered
-    glNormalPointer(GL_FLOAT, 0, &bunny->normal_buffer[0]);
+        // Set the pointer to the normal buffer array of the object being rendered
+        glNormalPointer(GL_FLOAT, 0, &bunny->normal_buffer[0]);
 
-    int buffer_size = bunny->vertex_buffer.size();
-    glDrawArrays(GL_TRIANGLES, 0, buffer_size);
+        // Draw the triangles through the index buffer of the object
+        glDrawElements(GL_TRIANGLES, bunny->index_buffer.size(), GL_UNSIGNED_INT, &bunny->index_buffer[0]);
+    }
 
     // Retrieve the Modelview Matrix pretransformation of an object
     glPopMatrix();
@@ -200,7 +243,7 @@ void draw_bunny(Object* bunny) {
 void drawText() {
     // String buffer
     unsigned char buffer[100];
-    if (all_frames[curr_frame_id].is_keyframe) {
+    if (is_keyframe(curr_frame_id)) {
         strcpy((char*) buffer, "KEYFRAME: ");
     }
     else {
@@ -253,16 +296,46 @@ void display(void) {
     set_lights();
 
     // Only draw bunnies if there are more than 0 frames
-    if (all_frames.size() > 0) {
+    if (morph_mode) {
+        // Blend the keyframes at the current time, which is in between frames while playing
+        draw_bunny(NULL, is_playing ? play_time : curr_frame_id);
+    }
+    else if (all_frames.size() > 0) {
         // Draw the bunny object in the current frame
-        draw_bunny(all_frames[curr_frame_id].object);
+        draw_bunny(all_frames[curr_frame_id].object, curr_frame_id);
+    }
+
+    // Display the text showing what frame we are in, and swap the active and off-screen
+    // buffers with one another (there is no window, or GLUT font, in --headless mode)
+    if (!headless.enabled) {
+        drawText();
+        glutSwapBuffers();
+    }
+}
+
+// Draws a frame of --headless mode, stepping through the frames of the animation as if 'n'
+// had been pressed before each one
+void draw_headless_frame(int frame) {
+    if (frame_count() > 0) {
+        curr_frame_id = frame % frame_count();
+    }
+    display();
+}
+
+// Advances the animation playing in --morph mode by the time since it was last advanced,
+// looping back to the start after the last keyframe
+void advance_playback(int value) {
+    if (!is_playing) {
+        return;
     }
 
-    // Display the text showing what frame we are in
-    drawText();
+    int tick = glutGet(GLUT_ELAPSED_TIME);
+    play_time = fmod(play_time + (tick - last_tick) / 1000.0 * playback_speed, morph.keyframe_ids.back());
+    last_tick = tick;
+    curr_frame_id = (int) play_time;
 
-    // Swap the active and off-screen buffers with one another
-    glutSwapBuffers();
+    glutPostRedisplay();
+    glutTimerFunc(16, advance_playback, 0);
 }
 
 // Handle key events when a key is pressed
@@ -276,10 +349,22 @@ void key_pressed(unsigned char key, int x, int y) {
     else if(key == 'n')
     {
         // If there are no frames, then do nothing
-        if (all_frames.size() == 0) {
+        if (frame_count() == 0) {
             return;
         }
-        curr_frame_id = (curr_frame_id + 1) % all_frames.size();
+        is_playing = false;
+        curr_frame_id = (curr_frame_id + 1) % frame_count();
+        glutPostRedisplay();
+    }
+    // Play or pause the animation in --morph mode
+    else if(key == 'p' && morph_mode)
+    {
+        is_playing = !is_playing;
+        if (is_playing) {
+            play_time = curr_frame_id;
+            last_tick = glutGet(GLUT_ELAPSED_TIME);
+            glutTimerFunc(16, advance_playback, 0);
+        }
         glutPostRedisplay();
     }
 }
@@ -456,6 +541,9 @@ Object create_object(const char* filename) {
 
 // Function to fill in the vertex and normal buffers for each object in a  frame
 void fill_buffers() {
+    // Total ACMR of the frames before and after reordering their triangles
+    float acmr_before = 0.0, acmr_after = 0.0;
+
     for (int i = 0; i < all_frames.size(); i++) {
         // Retrieves the current frame and its corresponding object
         Frame curr_frame = all_frames[i];
@@ -502,9 +590,23 @@ void fill_buffers() {
             object->add_normal_to_buffer(v3->normal);
         }
 
+        // Merge the corners of faces sharing a halfedge vertex, so each vertex is only stored
+        // (and shaded) once
+        object->weld_buffers();
+
+        // Reorder the triangles to make better use of the GPU's vertex cache
+        acmr_before += object->average_cache_miss_ratio();
+        object->optimize_vertex_cache();
+        acmr_after += object->average_cache_miss_ratio();
+
         // Delete the mesh data used to calculate our normals
         delete_HE(hevs, hefs);
     }
+
+    if (all_frames.size() > 0) {
+        cout << "Average ACMR per frame: " << acmr_before / all_frames.size() << " -> "
+            << acmr_after / all_frames.size() << "\n";
+    }
 }
 
 //////////////////////////////
@@ -513,8 +615,13 @@ void fill_buffers() {
 
 // Main function where the parsing is done and everything comes together
 int main(int argc, char* argv[]) {
+    headless = parse_headless_options(argc, argv);
+    if (argc == 7 && strcmp(argv[6], "--morph") == 0) {
+        morph_mode = true;
+        argc = 6;
+    }
     if (argc != 6) {
-        printf("Usage: ./keyframe [keyframe1.obj] [keyframe2.obj] [keyframe3.obj] [keyframe4.obj] [keyframe5.obj]\n");
+        printf("Usage: ./keyframe [keyframe1.obj] [keyframe2.obj] [keyframe3.obj] [keyframe4.obj] [keyframe5.obj] [--morph] [--headless [frames] [prefix]]\n");
     }
     else {
         // Clear all objects
@@ -531,33 +638,56 @@ int main(int argc, char* argv[]) {
             keyframes.push_back(bunny_frame);
         }
 
-        // Generate all interpolated frames between every pair of keyframes
-        generate_interpolated_frames(keyframes);
-
-        // Fill the vertex and vertex normal buffers of each frame object
-        fill_buffers();
+        // Generate all interpolated frames between every pair of keyframes, and fill the vertex
+        // and vertex normal buffers of each frame object. In --morph mode the GPU blends the
+        // keyframes instead.
+        if (!morph_mode) {
+            generate_interpolated_frames(keyframes);
+            fill_buffers();
+        }
 
         // Set the current frame id to 0
         curr_frame_id = 0;
         
-        // After preprocessing, we now render the scene
-        glutInit(&argc, argv);
+        if (headless.enabled) {
+            // Draw into an offscreen framebuffer instead of a window
+            if (!create_offscreen_context(width, height)) {
+                cerr << "Error creating offscreen OpenGL context\n";
+                return 1;
+            }
+        }
+        else {
+            // After preprocessing, we now render the scene
+            glutInit(&argc, argv);
 
-        // Initialize OpenGL display with double, RGB and depth buffers
-        glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+            // Initialize OpenGL display with double, RGB and depth buffers
+            glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
 
-        // Initialize window size
-        glutInitWindowSize(width, height);
+            // Initialize window size
+            glutInitWindowSize(width, height);
 
-        // Set top-left corner of window to be (0, 0)
-        glutInitWindowPosition(0, 0);
+            // Set top-left corner of window to be (0, 0)
+            glutInitWindowPosition(0, 0);
 
-        // Create window with name "Shader"
-        glutCreateWindow("Shader");
+            // Create window with name "Shader"
+            glutCreateWindow("Shader");
+        }
 
         // Call our init function
         init();
 
+        // Upload the keyframes and build the shaders blending them
+        if (morph_mode && !create_morph_animation(morph, keyframes, "src/vertex_morph.glsl", "src/fragment_morph.glsl")) {
+            cerr << "Error building the morph shaders\n";
+            return 1;
+        }
+
+        // In --headless mode, draw the frames and exit
+        if (headless.enabled) {
+            render_offscreen(headless, width, height, draw_headless_frame);
+            return 0;
+        }
+
         // Set OpenGL display function to our display function
         glutDisplayFunc(display);
 
@@ -0,0 +1,174 @@
+// Includes for OpenGL
+#define GL_GLEXT_PROTOTYPES 1
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "../include/morph.h"
+#include "../include/halfedge.h"
+
+// Includes for standard c library
+#include <stdio.h>
+#include <algorithm>
+#include <iostream>
+
+// Number of keyframes blended by the Catmull-Rom spline. The position and normal of control
+// keyframe i are read from the attributes position<i> and normal<i>, bound to locations i
+// and CONTROL_KEYFRAMES + i.
+#define CONTROL_KEYFRAMES 4
+
+//////////////////////////////
+///    HELPER FUNCTIONS    ///
+//////////////////////////////
+
+// Appends the vertices of the object and their normals, computed with the halfedge data
+// structure, in the order of the object's vertices. If triangles isn't NULL, the corners of
+// the halfedge faces (which are oriented consistently) are appended to it as indices into
+// those vertices.
+static void keyframe_vertices(const Object &object, vector<Vertex> &vertices, vector<Vertex> &normals,
+        vector<unsigned int> *triangles) {
+    // Retrieves the mesh data for this object
+    Mesh_Data* mesh_data = create_mesh_data(object);
+
+    // Allocate new pointers to the store halfedge vertices and halfedge faces
+    vector<HEV*> *hevs = new vector<HEV*>;
+    vector<HEF*> *hefs = new vector<HEF*>;
+
+    // Build the halfedge data structure representation of this object
+    build_HE(mesh_data, hevs, hefs);
+
+    // Compute the vertex normal of each vertex, ignoring the first vertex since that's NULL,
+    // and number the vertices from 0
+    for (int j = 1; j < hevs->size(); j++) {
+        HEV* hev = hevs->at(j);
+        compute_vertex_normal(hev);
+        hev->index = j - 1;
+
+        vertices.push_back(Vertex(hev->x, hev->y, hev->z));
+        normals.push_back(hev->normal);
+    }
+
+    if (triangles) {
+        for (int j = 0; j < hefs->size(); j++) {
+            HE* he = hefs->at(j)->edge;
+            triangles->push_back(he->vertex->index);
+            triangles->push_back(he->next->vertex->index);
+            triangles->push_back(he->next->next->vertex->index);
+        }
+    }
+
+    // Delete the halfedge data structure used to calculate our normals
+    delete_HE(hevs, hefs);
+}
+
+//////////////////////////////
+///       FUNCTIONS        ///
+//////////////////////////////
+
+bool create_morph_animation(Morph_Animation &morph, const vector<Frame> &keyframes,
+        const string &vert_filename, const string &frag_filename) {
+    int keyframe_count = keyframes.size();
+
+    // The triangles are the same in every keyframe, so they are taken from the first one
+    vector<vector<Vertex> > vertices(keyframe_count), normals(keyframe_count);
+    vector<unsigned int> triangles;
+    for (int k = 0; k < keyframe_count; k++) {
+        keyframe_vertices(*keyframes[k].object, vertices[k], normals[k], (k == 0) ? &triangles : NULL);
+        morph.keyframe_ids.push_back(keyframes[k].frame_id);
+    }
+
+    // Reorder the triangles to make better use of the GPU's vertex cache. Each vertex is
+    // tagged with its index, so the order the vertices are put in can be applied to every
+    // keyframe.
+    Object shared;
+    for (int i = 0; i < vertices[0].size(); i++) {
+        shared.vertex_buffer.push_back(Vertex(i, 0.0, 0.0));
+        shared.normal_buffer.push_back(Vertex(i, 0.0, 0.0));
+    }
+    shared.index_buffer = triangles;
+    float acmr = shared.average_cache_miss_ratio();
+    shared.optimize_vertex_cache();
+    cout << "Keyframe ACMR: " << acmr << " -> " << shared.average_cache_miss_ratio() << "\n";
+
+    morph.vertex_count = shared.vertex_buffer.size();
+    morph.index_count = shared.index_buffer.size();
+
+    // Lay out the vertices and then the normals of each keyframe in turn
+    vector<Vertex> keyframe_data;
+    keyframe_data.reserve(2 * keyframe_count * morph.vertex_count);
+    for (int k = 0; k < keyframe_count; k++) {
+        for (int i = 0; i < morph.vertex_count; i++) {
+            keyframe_data.push_back(vertices[k][(int) shared.vertex_buffer[i].x]);
+        }
+        for (int i = 0; i < morph.vertex_count; i++) {
+            keyframe_data.push_back(normals[k][(int) shared.vertex_buffer[i].x]);
+        }
+    }
+
+    glGenBuffers(1, &morph.vertex_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, morph.vertex_vbo);
+    glBufferData(GL_ARRAY_BUFFER, keyframe_data.size() * sizeof(Vertex), keyframe_data.data(), GL_STATIC_DRAW);
+
+    glGenBuffers(1, &morph.index_vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, morph.index_vbo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, shared.index_buffer.size() * sizeof(GLuint),
+        shared.index_buffer.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    // The control keyframes of the span between keyframes s and s + 1 are keyframes s - 1 to
+    // s + 2, clamped to the first and last keyframes as in generate_interpolated_frames
+    int span_count = max(keyframe_count - 1, 1);
+    for (int s = 0; s < span_count; s++) {
+        GLuint vao;
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+
+        for (int c = 0; c < CONTROL_KEYFRAMES; c++) {
+            int k = min(max(s - 1 + c, 0), keyframe_count - 1);
+            size_t offset = 2 * k * morph.vertex_count * sizeof(Vertex);
+
+            glEnableVertexAttribArray(c);
+            glVertexAttribPointer(c, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid *) offset);
+            glEnableVertexAttribArray(CONTROL_KEYFRAMES + c);
+            glVertexAttribPointer(CONTROL_KEYFRAMES + c, 3, GL_FLOAT, GL_FALSE, 0,
+                (GLvoid *) (offset + morph.vertex_count * sizeof(Vertex)));
+        }
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, morph.index_vbo);
+
+        glBindVertexArray(0);
+        morph.span_vaos.push_back(vao);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Bind the attributes of the control keyframes to the locations the vertex arrays read
+    morph.shader.vert_filename = vert_filename;
+    morph.shader.frag_filename = frag_filename;
+    for (int c = 0; c < CONTROL_KEYFRAMES; c++) {
+        morph.shader.attributes["position" + to_string(c)] = c;
+        morph.shader.attributes["normal" + to_string(c)] = CONTROL_KEYFRAMES + c;
+    }
+    return load_shader_program(morph.shader);
+}
+
+void draw_morph_animation(const Morph_Animation &morph, float time) {
+    // Find the span between two keyframes the time falls in, and how far along it it is
+    int last = morph.keyframe_ids.size() - 1;
+    int span = 0;
+    while (span < last - 1 && time >= morph.keyframe_ids[span + 1]) {
+        span++;
+    }
+
+    float u = 0.0;
+    if (last > 0) {
+        u = (time - morph.keyframe_ids[span]) / (morph.keyframe_ids[span + 1] - morph.keyframe_ids[span]);
+        u = min(max(u, 0.0f), 1.0f);
+    }
+
+    glUseProgram(morph.shader.program);
+    glUniform1f(glGetUniformLocation(morph.shader.program, "u"), u);
+
+    glBindVertexArray(morph.span_vaos[span]);
+    glDrawElements(GL_TRIANGLES, morph.index_count, GL_UNSIGNED_INT, 0);
+    glBindVertexArray(0);
+
+    glUseProgram(0);
+}
@@ -0,0 +1,268 @@
+// Includes for OpenGL
+#define GL_GLEXT_PROTOTYPES 1
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "../include/shader_cache.h"
+
+// Includes for standard c library
+#include <stdio.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+//////////////////////////////
+///    HELPER FUNCTIONS    ///
+//////////////////////////////
+
+// Reads the whole file into contents. Returns false if it can't be opened.
+static bool read_file(const string &filename, string &contents) {
+    ifstream file(filename.c_str());
+    if (!file) {
+        return false;
+    }
+    getline(file, contents, '\0');
+    return true;
+}
+
+// Returns the time the file was last modified, or 0 if it doesn't exist
+static time_t modification_time(const string &filename) {
+    struct stat file_stat;
+    if (stat(filename.c_str(), &file_stat) != 0) {
+        return 0;
+    }
+    return file_stat.st_mtime;
+}
+
+// Mixes the bytes of the string (and a terminating null, so consecutive strings can't run
+// into one another) into a 64-bit FNV-1a hash
+static unsigned long long hash_string(unsigned long long hash, const string &s) {
+    for (int i = 0; i <= s.size(); i++) {
+        hash ^= (unsigned char) s.c_str()[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Returns the file the program is cached in. A program binary can only be loaded by the
+// driver that saved it, so the driver's strings are hashed along with everything that goes
+// into linking the program.
+static string cache_filename(const Shader_Program &shader_program, const string &vert_source,
+        const string &frag_source) {
+    unsigned long long hash = 14695981039346656037ULL;
+    hash = hash_string(hash, (const char*) glGetString(GL_VENDOR));
+    hash = hash_string(hash, (const char*) glGetString(GL_RENDERER));
+    hash = hash_string(hash, (const char*) glGetString(GL_VERSION));
+    hash = hash_string(hash, vert_source);
+    hash = hash_string(hash, frag_source);
+
+    map<string, GLuint>::const_iterator it;
+    for (it = shader_program.attributes.begin(); it != shader_program.attributes.end(); it++) {
+        hash = hash_string(hash, it->first);
+        hash = hash_string(hash, to_string(it->second));
+    }
+
+    char filename[64];
+    snprintf(filename, sizeof(filename), "%s/%016llx.bin", SHADER_CACHE_DIR, hash);
+    return string(filename);
+}
+
+// Compiles a shader of the given type. Returns 0, printing the compiler's log, if the
+// source doesn't compile.
+static GLuint compile_shader(GLenum type, const string &source, const string &filename) {
+    GLuint shader = glCreateShader(type);
+    const char* shader_source = source.c_str();
+    glShaderSource(shader, 1, &shader_source, NULL);
+    glCompileShader(shader);
+
+    GLint is_compiled = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &is_compiled);
+    if (is_compiled == GL_FALSE) {
+        GLint max_length = 0;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &max_length);
+
+        // The max_length includes the NULL character
+        vector<GLchar> error_log(max_length + 1, '\0');
+        glGetShaderInfoLog(shader, max_length, &max_length, &error_log[0]);
+        cerr << "Error compiling " << filename << ":\n" << &error_log[0] << endl;
+
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
+}
+
+// Returns whether the program linked, printing the linker's log if it didn't
+static bool check_link(GLuint program, const Shader_Program &shader_program) {
+    GLint is_linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &is_linked);
+    if (is_linked == GL_FALSE) {
+        GLint max_length = 0;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &max_length);
+
+        vector<GLchar> error_log(max_length + 1, '\0');
+        glGetProgramInfoLog(program, max_length, &max_length, &error_log[0]);
+        cerr << "Error linking " << shader_program.vert_filename << " and "
+            << shader_program.frag_filename << ":\n" << &error_log[0] << endl;
+        return false;
+    }
+    return true;
+}
+
+// Loads the program binary saved in the cache file. Returns 0 if there is none, or if the
+// driver rejects it (after a driver update, for example).
+static GLuint load_cached_program(const string &filename) {
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (!fp) {
+        return 0;
+    }
+
+    // The file holds the binary's format, followed by the binary itself
+    GLenum format;
+    vector<char> binary;
+    bool ok = fread(&format, sizeof(format), 1, fp) == 1;
+    if (ok) {
+        fseek(fp, 0, SEEK_END);
+        long length = ftell(fp) - (long) sizeof(format);
+        fseek(fp, sizeof(format), SEEK_SET);
+        ok = length > 0;
+        if (ok) {
+            binary.resize(length);
+            ok = fread(&binary[0], 1, length, fp) == length;
+        }
+    }
+    fclose(fp);
+    if (!ok) {
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, format, &binary[0], binary.size());
+
+    GLint is_linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &is_linked);
+    if (is_linked == GL_FALSE) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Saves the linked program's binary to the cache file, if the driver can give it back
+static void save_cached_program(GLuint program, const string &filename) {
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (formats == 0 || length == 0) {
+        return;
+    }
+
+    GLenum format;
+    vector<char> binary(length);
+    glGetProgramBinary(program, length, &length, &format, &binary[0]);
+
+    mkdir(SHADER_CACHE_DIR, 0755);
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if (!fp) {
+        return;
+    }
+    bool ok = fwrite(&format, sizeof(format), 1, fp) == 1 && fwrite(&binary[0], 1, length, fp) == length;
+    fclose(fp);
+
+    // Don't leave a partly written binary behind
+    if (!ok) {
+        remove(filename.c_str());
+    }
+}
+
+// Compiles and links the program from the given sources. Returns 0 if it doesn't build.
+static GLuint build_program(const Shader_Program &shader_program, const string &vert_source,
+        const string &frag_source) {
+    GLuint vert_shader = compile_shader(GL_VERTEX_SHADER, vert_source, shader_program.vert_filename);
+    if (!vert_shader) {
+        return 0;
+    }
+    GLuint frag_shader = compile_shader(GL_FRAGMENT_SHADER, frag_source, shader_program.frag_filename);
+    if (!frag_shader) {
+        glDeleteShader(vert_shader);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vert_shader);
+    glAttachShader(program, frag_shader);
+
+    map<string, GLuint>::const_iterator it;
+    for (it = shader_program.attributes.begin(); it != shader_program.attributes.end(); it++) {
+        glBindAttribLocation(program, it->second, it->first.c_str());
+    }
+
+    // Ask for a binary that can be saved to the cache
+    glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(program);
+
+    // The linked program keeps working after its shaders are gone
+    glDetachShader(program, vert_shader);
+    glDetachShader(program, frag_shader);
+    glDeleteShader(vert_shader);
+    glDeleteShader(frag_shader);
+
+    if (!check_link(program, shader_program)) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+//////////////////////////////
+///       FUNCTIONS        ///
+//////////////////////////////
+
+bool load_shader_program(Shader_Program &shader_program) {
+    // Remember which versions of the files were read, even if they don't build, so a
+    // broken edit is only reported once
+    shader_program.vert_time = modification_time(shader_program.vert_filename);
+    shader_program.frag_time = modification_time(shader_program.frag_filename);
+
+    string vert_source, frag_source;
+    if (!read_file(shader_program.vert_filename, vert_source)) {
+        cerr << "Error opening vertex shader program " << shader_program.vert_filename << endl;
+        return false;
+    }
+    if (!read_file(shader_program.frag_filename, frag_source)) {
+        cerr << "Error opening fragment shader program " << shader_program.frag_filename << endl;
+        return false;
+    }
+
+    string cache_file = cache_filename(shader_program, vert_source, frag_source);
+    GLuint program = load_cached_program(cache_file);
+    if (!program) {
+        program = build_program(shader_program, vert_source, frag_source);
+        if (!program) {
+            return false;
+        }
+        save_cached_program(program, cache_file);
+    }
+
+    if (shader_program.program) {
+        glDeleteProgram(shader_program.program);
+    }
+    shader_program.program = program;
+    return true;
+}
+
+bool reload_changed_shaders(Shader_Program &shader_program) {
+    if (modification_time(shader_program.vert_filename) == shader_program.vert_time
+            && modification_time(shader_program.frag_filename) == shader_program.frag_time) {
+        return false;
+    }
+
+    if (!load_shader_program(shader_program)) {
+        return false;
+    }
+    cerr << "Reloaded " << shader_program.vert_filename << " and " << shader_program.frag_filename << endl;
+    return true;
+}
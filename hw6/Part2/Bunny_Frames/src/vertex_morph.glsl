@@ -0,0 +1,46 @@
+#version 120
+
+// How far along the span between the second and third control keyframes the frame is
+uniform float u;
+
+// Positions and normals of the vertex in the four control keyframes
+attribute vec3 position0, position1, position2, position3;
+attribute vec3 normal0, normal1, normal2, normal3;
+
+// Number of lights set up by init_lights
+const int LIGHT_COUNT = 2;
+
+// Blends the control keyframes with the Catmull-Rom spline of find_interpolated_value, and
+// lights the vertex the way the fixed-function pipeline does (Gouraud shading)
+void main()
+{
+    // Weights of the control keyframes, the columns of [1 u u^2 u^3] * B
+    float u2 = u * u;
+    float u3 = u2 * u;
+    vec4 weights = 0.5 * vec4(-u + 2.0 * u2 - u3, 2.0 - 5.0 * u2 + 3.0 * u3,
+        u + 4.0 * u2 - 3.0 * u3, -u2 + u3);
+
+    vec3 position = weights.x * position0 + weights.y * position1 + weights.z * position2 + weights.w * position3;
+    vec3 normal = weights.x * normal0 + weights.y * normal1 + weights.z * normal2 + weights.w * normal3;
+
+    // Move the vertex and its normal into camera space
+    vec4 vertex = gl_ModelViewMatrix * vec4(position, 1.0);
+    vec3 n = normalize(gl_NormalMatrix * normal);
+
+    // Emission and the ambient light of the scene, and then the ambient, diffuse and specular
+    // light of each light source (with the viewer infinitely far away along the z axis)
+    vec4 color = gl_FrontLightModelProduct.sceneColor;
+    for (int i = 0; i < LIGHT_COUNT; i++) {
+        vec3 l = normalize(gl_LightSource[i].position.xyz - vertex.xyz);
+        float diffuse = max(dot(n, l), 0.0);
+        color += gl_FrontLightProduct[i].ambient + gl_FrontLightProduct[i].diffuse * diffuse;
+
+        if (diffuse > 0.0) {
+            vec3 h = normalize(l + vec3(0.0, 0.0, 1.0));
+            color += gl_FrontLightProduct[i].specular * pow(max(dot(n, h), 0.0), gl_FrontMaterial.shininess);
+        }
+    }
+
+    gl_FrontColor = vec4(clamp(color.rgb, 0.0, 1.0), gl_FrontMaterial.diffuse.a);
+    gl_Position = gl_ProjectionMatrix * vertex;
+}
@@ -10,6 +10,7 @@
 #include "../include/vertex.h"
 #include "../include/frame.h"
 #include "../include/utils.h"
+#include "../include/offscreen.h"
 
 // Includes for standard C library
 #include <stdlib.h>
@@ -57,6 +58,9 @@ vector<Frame> all_frames;
 // Current frame id to load the corresponding frame
 int curr_frame_id;
 
+// Settings of --headless mode, in which frames are drawn offscreen instead of in a window
+Headless_Options headless;
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 ///////////////////////////////////
@@ -223,10 +227,21 @@ void display(void) {
     // Draw I-Bar
     drawIBar();
 
-    drawText();
+    // Display the text showing what frame we are in, and swap the active and off-screen
+    // buffers with one another (there is no window, or GLUT font, in --headless mode)
+    if (!headless.enabled) {
+        drawText();
+        glutSwapBuffers();
+    }
+}
 
-    // Swap the active and off-screen buffers with one another
-    glutSwapBuffers();
+// Draws a frame of --headless mode, stepping through the frames of the animation as if 'n'
+// had been pressed before each one
+void draw_headless_frame(int frame) {
+    if (all_frames.size() > 0) {
+        curr_frame_id = frame % all_frames.size();
+    }
+    display();
 }
 
 // Handle key events when a key is pressed
@@ -393,8 +408,9 @@ vector<string> strsplit(string &s, char delim) {
 
 // Main function where the parsing is done and everything comes together
 int main(int argc, char* argv[]) {
+    headless = parse_headless_options(argc, argv);
     if (argc != 2) {
-        printf("Usage: ./keyframe [test_script.script]\n");
+        printf("Usage: ./keyframe [test_script.script] [--headless [frames] [prefix]]\n");
     }
     else {
         // Initialize filestream
@@ -478,24 +494,39 @@ int main(int argc, char* argv[]) {
             // Set the current frame id to 0
             curr_frame_id = 0;
 
-            // After the scene parsing business is done, render the scene
-            glutInit(&argc, argv);
+            if (headless.enabled) {
+                // Draw into an offscreen framebuffer instead of a window
+                if (!create_offscreen_context(width, height)) {
+                    cerr << "Error creating offscreen OpenGL context\n";
+                    return 1;
+                }
+            }
+            else {
+                // After the scene parsing business is done, render the scene
+                glutInit(&argc, argv);
 
-            // Initialize OpenGL display with double, RGB and depth buffers
-            glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+                // Initialize OpenGL display with double, RGB and depth buffers
+                glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
 
-            // Initialize window size
-            glutInitWindowSize(width, height);
+                // Initialize window size
+                glutInitWindowSize(width, height);
 
-            // Set top-left corner of window to be (0, 0)
-            glutInitWindowPosition(0, 0);
+                // Set top-left corner of window to be (0, 0)
+                glutInitWindowPosition(0, 0);
 
-            // Create window with name "Shader"
-            glutCreateWindow("Shader");
+                // Create window with name "Shader"
+                glutCreateWindow("Shader");
+            }
 
             // Call our init function
             init();
 
+            // In --headless mode, draw the frames and exit
+            if (headless.enabled) {
+                render_offscreen(headless, width, height, draw_headless_frame);
+                return 0;
+            }
+
             // Set OpenGL display function to our display function
             glutDisplayFunc(display);
 
@@ -0,0 +1,45 @@
+#include "animation.h"
+
+#include <iostream>
+
+using namespace Eigen;
+
+bool Animation::Apply(Scene &scene, int frame) const {
+    for (auto &track : tracks) {
+        std::shared_ptr<Object> object = scene.GetObject(track.object);
+        Transformation *transform = object ? object->GetTransformation(track.transform) : nullptr;
+
+        if (!transform || track.keys.empty()) {
+            std::cerr << "Animation track for " << track.object << " transform " << track.transform
+                      << " doesn't match the scene\n";
+            return false;
+        }
+
+        // Find the pair of keys around the frame
+        Vector3d value = track.keys.back().value;
+        if (frame <= track.keys.front().frame) {
+            value = track.keys.front().value;
+        } else {
+            for (size_t i = 1; i < track.keys.size(); i++) {
+                const Key &prev = track.keys[i - 1];
+                const Key &next = track.keys[i];
+
+                if (frame <= next.frame) {
+                    double alpha = (double) (frame - prev.frame) / (next.frame - prev.frame);
+                    value = (1 - alpha) * prev.value + alpha * next.value;
+                    break;
+                }
+            }
+        }
+
+        if (Rotate *rotate = dynamic_cast<Rotate *>(transform)) {
+            rotate->SetAxisAngle(rotate->GetAxis(), value(0));
+        } else if (Translate *translate = dynamic_cast<Translate *>(transform)) {
+            translate->SetDelta(value);
+        } else if (Scale *scale = dynamic_cast<Scale *>(transform)) {
+            scale->SetScale(value);
+        }
+    }
+
+    return true;
+}
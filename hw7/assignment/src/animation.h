@@ -0,0 +1,40 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <string>
+#include <vector>
+
+#include <Eigen/Dense>
+
+#include "scene.h"
+
+// Keyframed changes to the transforms of named objects, read from the optional
+// "animation" section of a scene file.
+class Animation {
+public:
+    // Value of a transform at some frame. Translations and scales key their whole
+    // vector, rotations only key their angle (stored in value(0)).
+    struct Key {
+        int frame;
+        Eigen::Vector3d value;
+    };
+
+    // Keys for the transform-th transform of an object, sorted by frame.
+    struct Track {
+        std::string object;
+        int transform;
+        std::vector<Key> keys;
+    };
+
+    int frames;
+    std::vector<Track> tracks;
+
+    Animation(): frames(0) {};
+
+    // Sets every animated transform in the scene to its value at the given frame,
+    // interpolating linearly between keys and holding the first/last key outside them.
+    // Returns false if a track refers to an object or transform that doesn't exist.
+    bool Apply(Scene &scene, int frame) const;
+};
+
+#endif // ANIMATION_H
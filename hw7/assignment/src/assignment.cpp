@@ -1,16 +1,60 @@
 #include "object.h"
 #include "scene.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <random>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 #include "image.h"
+#include "raster.h"
+#include "stats.h"
 
 using namespace Eigen;
 using namespace std;
 
 const int MAX_ITERS = 10000;
-const int XRES = 500;
-const int YRES = 500;
+
+// Primary ray packets cover PACKET_TILE x PACKET_TILE pixel blocks
+const int PACKET_TILE = 2;
+static_assert(PACKET_TILE * PACKET_TILE == PACKET_SIZE, "packet tile must match packet size");
+
+// Once fewer than this many lanes of a packet are still iterating, the
+// remaining lanes are finished with the scalar solver
+const int PACKET_MIN_ACTIVE = 2;
+
+// Newton iterations allowed when refining a hit seeded by the hybrid visibility buffer
+const int HYBRID_NEWTON_ITERS = 8;
+
+// Scale on the bounding sphere that ExitIntersection traces back from, so that it starts
+// safely outside the surface
+const double EXIT_SPHERE_SCALE = 1.01;
+
+// Index of refraction of every refractive material (roughly glass)
+const double REFRACTIVE_INDEX = 1.5;
+
+// Distance off the surface that secondary rays start, so they don't hit it again right away
+const double SECONDARY_OFFSET = 1e-3;
+
+// Held for the whole of Scene::Raytrace. Raytraces started from the renderer run on detached
+// threads, so without it a second one could replace the instances and BVH (in UpdateBVH)
+// while the first is still tracing against them.
+static mutex raytrace_mutex;
+
+// A reflected or refracted ray waiting to be traced, with its weight in its sample's color.
+// Rays travelling through a refractive superquadric hold the index of its instance in
+// inside, and rays in the air hold -1.
+struct SecondaryRay {
+    Ray ray;
+    Vector3f throughput;
+    int inside;
+};
 
 // This function calculates the result of the general inside-outside superquadric function
 // If result < 0, then the point is inside the superquadric object
@@ -53,6 +97,24 @@ bool Superquadric::IOTest(const Vector3d &point) {
     return false;
 }
 
+void Superquadric::IOTest(const PointArray &points, const Matrix4d &inverse, PointMask &inside) const {
+    // Transform every point to body space at once
+    Matrix3f linear = inverse.block<3, 3>(0, 0).cast<float>();
+    PointArray body = points * linear.transpose();
+    body.rowwise() += inverse.block<3, 1>(0, 3).cast<float>().transpose();
+
+    // Same function as InsideOutsideFunc, but with each pow(a, p) written as exp(p * log(a)),
+    // since Eigen vectorizes float exp and log but not pow. log(0) = -inf gives exp(-inf) = 0,
+    // so points on the axes still work.
+    float inv_e = 1.0 / exp0;
+    float inv_n = 1.0 / exp1;
+    ArrayXf xy = (inv_e * body.col(0).array().square().log()).exp() +
+                 (inv_e * body.col(1).array().square().log()).exp();
+    ArrayXf result = (inv_n * body.col(2).array().square().log()).exp() + (exp0 * inv_n * xy.log()).exp();
+
+    inside = inside || result < 1.0f;
+}
+
 bool Assembly::IOTest(const Vector3d &point) {
     // Defines the homogeneous coordinate for the point - w is just 1.0
     Vector4d pt = Vector4d(point(0), point(1), point(2), 1.0);
@@ -151,21 +213,14 @@ Vector3d InsideOutsideGrad(double x, double y, double z, double e, double n) {
     return grad / n;
 }
 
-// Uses the Newton Iterative Solver to find the smallest t value such that g'(t) ~ 0
-double NewtonIterativeSolver(Ray &ray, double e, double n) {
+// Runs up to max_iters Newton iterations on g(t) starting from t_old, stopping early once the
+// stopping condition is met. Returns INFINITY if the solver did not converge onto the surface.
+// The number of iterations taken is written to iterations.
+double NewtonIterate(Ray &ray, double t_old, int max_iters, double e, double n, int &iterations) {
     // Threshold for stopping conditions - used to check when the gradient and our function
     // is close enough to 0 that we can stop
     double epsilon = 1e-3;
 
-    // Solve for the initial guess of t using quadratic equations
-    double t_old = GetInitialGuess(ray);
-
-    // If our guess is negative infinity, then this ray misses the superquadric completely or
-    // our object is behind the camera, return INFINITY
-    if (t_old == INFINITY) {
-        return INFINITY;
-    }
-
     // Compute the point along the ray we're at time t = t_old
     Vector3d coord = ray.At(t_old);
 
@@ -176,14 +231,15 @@ double NewtonIterativeSolver(Ray &ray, double e, double n) {
     double dg =  ray.direction.transpose() * InsideOutsideGrad(coord(0), coord(1), coord(2), e, n);
 
     // If both g(t) and g'(t) are sufficiently small enough, just return t_old
+    iterations = 0;
     if (abs(dg) <= epsilon && abs(g) <= epsilon) {
         return t_old;
     }
 
-    int iter = 0;
     // Else, solve for t_final iteratively until stopping condition, which is when both our gradient
-    // and function is sufficently close to 0 or when MAX_ITERS is reached
-    while (iter < MAX_ITERS) {
+    // and function is sufficently close to 0 or when max_iters is reached
+    int iter = 0;
+    while (iter < max_iters) {
         // If the gradient switches to positive or our g(t) function is small enough,
         // then we stop
         if ((dg > 0 && g > 0) || abs(g) <= epsilon) {
@@ -208,16 +264,42 @@ double NewtonIterativeSolver(Ray &ray, double e, double n) {
         // Increment iteration
         iter++;
     }
+    iterations = iter;
 
     // Might be possible that when we terminate, both g and dg be positive
     if (abs(g) > epsilon) {
         return INFINITY;
     }
 
-    // If we haven't stopped after MAX_ITERS iteration, then just return the current t_old
+    // If we haven't stopped after max_iters iterations, then just return the current t_old
     return t_old;
 }
 
+// Uses the Newton Iterative Solver to find the smallest t value such that g'(t) ~ 0. If the
+// superquadric has a tesselation BVH, its first hit is used as the initial guess.
+double NewtonIterativeSolver(Ray &ray, double e, double n, const TriangleBVH *bvh) {
+    // Solve for the initial guess of t using quadratic equations, or take it from the BVH
+    double t_old = bvh ? bvh->Intersect(ray.origin, ray.direction) : GetInitialGuess(ray);
+
+    // If our guess is negative infinity, then this ray misses the superquadric completely or
+    // our object is behind the camera, return INFINITY
+    if (t_old == INFINITY) {
+        return INFINITY;
+    }
+
+    int iterations;
+    double t_final = NewtonIterate(ray, t_old, MAX_ITERS, e, n, iterations);
+    ThreadStats().RecordSolve(iterations, t_final != INFINITY, iterations >= MAX_ITERS);
+
+    // Newton's method can overshoot on rays that graze the surface. Those hit the tesselation,
+    // so retry them from the bounding sphere to never lose a hit the sphere guess would find.
+    if (bvh && t_final == INFINITY) {
+        return NewtonIterativeSolver(ray, e, n, nullptr);
+    }
+
+    return t_final;
+}
+
 pair<double, Intersection> Superquadric::ClosestIntersection(const Ray &ray) {
     // First, we want to apply the inverse transformation matrix onto our
     // ray to convert from parent-space to body-space
@@ -235,10 +317,11 @@ pair<double, Intersection> Superquadric::ClosestIntersection(const Ray &ray) {
 
     // Call Transformed function to convert parent-space ray into body-space ray
     Ray ray_body = ray.Transformed(inverse_transform);
+    ThreadStats().object_tests++;
 
     // Use the Newton Iterative Solver to find the final t such that the inside-outside function
     // is close to 0
-    double t_final = NewtonIterativeSolver(ray_body, exp0, exp1);
+    double t_final = NewtonIterativeSolver(ray_body, exp0, exp1, guess_bvh.get());
 
     // If our ray misses the object completely OR the object can't be seen by the camera,
     // return a NULL object that indicates that there is no intersection
@@ -354,6 +437,325 @@ pair<double, Intersection> Assembly::ClosestIntersection(const Ray &ray) {
 }
 
 
+/**
+ * Packet Closest Intersection Code
+ */
+
+// Transforms an intersection ray (surface point and normal) from child-space to parent-space
+Ray TransformIntersection(const Ray &loc, const Matrix4d &transform) {
+    // Create homogenous version of coordinate and apply the transform, dividing by the w-component
+    Vector4d h_origin = Vector4d(loc.origin(0), loc.origin(1), loc.origin(2), 1.0);
+    h_origin = transform * h_origin;
+    h_origin = h_origin / h_origin(3);
+
+    // Apply inverse transpose of the 3x3 part of the transform to the surface normal and normalize it
+    Vector3d normal = transform.block<3, 3>(0, 0).inverse().transpose() * loc.direction;
+    normal.normalize();
+
+    Ray result = Ray();
+    result.origin = h_origin.head(3);
+    result.direction = normal;
+
+    return result;
+}
+
+// Vectorized version of GetInitialGuess that intersects every lane with the bounding sphere
+PacketArray GetInitialGuess(const RayPacket &packet) {
+    // Calculate the coefficients of the quadratic equation for each lane
+    PacketArray a = packet.direction.rowwise().squaredNorm().array();
+    PacketArray b = 2.0 * packet.direction.cwiseProduct(packet.origin).rowwise().sum().array();
+    PacketArray c = packet.origin.rowwise().squaredNorm().array() - 3;
+
+    PacketArray delta = b * b - 4 * a * c;
+    PacketArray root = delta.max(0.0).sqrt();
+    PacketArray sign_b = (b > 0).select(PacketArray::Ones(), -PacketArray::Ones());
+
+    PacketArray t1 = sign_b * (-b.abs() - root) / (2.0 * a);
+    PacketArray t2 = sign_b * (2.0 * c) / (-b.abs() - root);
+
+    // Same ordering as the scalar version, so t_minus <= t_plus
+    PacketArray t_minus = (b < 0).select(t2, t1);
+    PacketArray t_plus = (b < 0).select(t1, t2);
+
+    // Prefer t_minus when it is in front of the camera, otherwise fall back to t_plus.
+    // Lanes that miss the sphere or have it behind the camera get INFINITY.
+    PacketArray guess = (t_minus > 0).select(t_minus, t_plus);
+    PacketMask miss = (delta < 0) || (t_minus < 0 && t_plus < 0);
+
+    return miss.select(PacketArray::Constant(INFINITY), guess);
+}
+
+// Initial guesses from a tesselation BVH, one lane at a time
+PacketArray GetInitialGuess(const RayPacket &packet, const TriangleBVH &bvh) {
+    PacketArray guess;
+    for (int lane = 0; lane < PACKET_SIZE; lane++) {
+        guess(lane) = bvh.Intersect(packet.origin.row(lane).transpose(), packet.direction.row(lane).transpose());
+    }
+
+    return guess;
+}
+
+// a^p in every lane, given log(a), for a >= 0. Eigen vectorizes exp for doubles but not pow,
+// so each power is taken as exp(p * log(a)), and the logs are shared between the powers of
+// the same base. a^0 is 1 even where a is 0, as with pow.
+static PacketArray PacketPow(const PacketArray &log_a, double p) {
+    if (p == 0.0) {
+        return PacketArray::Ones();
+    }
+    return (p * log_a).exp();
+}
+
+// Evaluates the inside-outside function g(t) and its derivative g'(t) along every lane of the packet
+void InsideOutsidePacket(const RayPacket &packet, const PacketArray &t, double e, double n,
+                         PacketArray &g, PacketArray &dg) {
+    PacketArray x = packet.origin.col(0).array() + t * packet.direction.col(0).array();
+    PacketArray y = packet.origin.col(1).array() + t * packet.direction.col(1).array();
+    PacketArray z = packet.origin.col(2).array() + t * packet.direction.col(2).array();
+
+    PacketArray log_x = x.square().log();
+    PacketArray log_y = y.square().log();
+    PacketArray log_z = z.square().log();
+
+    PacketArray xy = PacketPow(log_x, 1.0 / e) + PacketPow(log_y, 1.0 / e);
+    PacketArray log_xy = xy.log();
+    g = -1.0 + PacketPow(log_z, 1.0 / n) + PacketPow(log_xy, e / n);
+
+    PacketArray xy_term = PacketPow(log_xy, e / n - 1.0);
+    PacketArray dx = (2.0 * x) * PacketPow(log_x, 1.0 / e - 1.0) * xy_term;
+    PacketArray dy = (2.0 * y) * PacketPow(log_y, 1.0 / e - 1.0) * xy_term;
+    PacketArray dz = (2.0 * z) * PacketPow(log_z, 1.0 / n - 1.0);
+
+    dg = (packet.direction.col(0).array() * dx +
+          packet.direction.col(1).array() * dy +
+          packet.direction.col(2).array() * dz) / n;
+}
+
+// Vectorized Newton solver that iterates every lane of the packet together. Lanes that
+// meet the stopping condition are masked off, and once the packet has diverged down to
+// fewer than PACKET_MIN_ACTIVE lanes, the rest are finished by the scalar solver.
+PacketArray NewtonIterativeSolver(const RayPacket &packet, double e, double n, const TriangleBVH *bvh) {
+    double epsilon = 1e-3;
+
+    PacketArray t = bvh ? GetInitialGuess(packet, *bvh) : GetInitialGuess(packet);
+    PacketArray t_final = PacketArray::Constant(INFINITY);
+    PacketMask active = t < INFINITY;
+    PacketMask seeded = active;
+    Array<int, PACKET_SIZE, 1> iterations = Array<int, PACKET_SIZE, 1>::Zero();
+
+    PacketArray g, dg;
+    InsideOutsidePacket(packet, t, e, n, g, dg);
+
+    int iter = 0;
+    while (iter < MAX_ITERS) {
+        // Same stopping condition as the scalar solver, evaluated for every lane
+        PacketMask done = (dg > 0 && g > 0) || g.abs() <= epsilon;
+
+        // Lanes that stopped on the surface keep their t, the others are misses
+        t_final = (active && done && g.abs() <= epsilon).select(t, t_final);
+        active = done.select(PacketMask::Constant(false), active);
+
+        int count = active.count();
+        if (count == 0) {
+            break;
+        }
+
+        // The packet has diverged, so finish the stragglers one ray at a time
+        if (count < PACKET_MIN_ACTIVE) {
+            for (int lane = 0; lane < PACKET_SIZE; lane++) {
+                if (active(lane)) {
+                    Ray ray = packet.Get(lane);
+                    int lane_iterations;
+                    t_final(lane) = NewtonIterate(ray, t(lane), MAX_ITERS - iter, e, n, lane_iterations);
+                    iterations(lane) += lane_iterations;
+                }
+            }
+            active = PacketMask::Constant(false);
+            break;
+        }
+
+        // Take a Newton step on the lanes that are still active
+        t = active.select(t - g / dg, t);
+        iterations += active.cast<int>();
+        InsideOutsidePacket(packet, t, e, n, g, dg);
+
+        iter++;
+    }
+
+    // Lanes that ran out of iterations are only hits if they ended up on the surface
+    t_final = (active && g.abs() <= epsilon).select(t, t_final);
+
+    // Count each lane as its own solve, and then run the same retry as the scalar solver for
+    // lanes that hit the tesselation but not the surface. Lanes that only repeat another
+    // ray are skipped, since their hits are thrown away.
+    RayStats &stats = ThreadStats();
+    for (int lane = 0; lane < packet.lanes; lane++) {
+        if (!seeded(lane)) {
+            continue;
+        }
+
+        stats.lane = lane;
+        stats.RecordSolve(iterations(lane), t_final(lane) != INFINITY, iterations(lane) >= MAX_ITERS);
+
+        if (bvh && t_final(lane) == INFINITY) {
+            Ray ray = packet.Get(lane);
+            t_final(lane) = NewtonIterativeSolver(ray, e, n, nullptr);
+        }
+    }
+    stats.lane = 0;
+
+    return t_final;
+}
+
+PacketHit Superquadric::ClosestIntersection(const RayPacket &packet) {
+    return Intersect(packet, GetTransform(), GetInverseTransform());
+}
+
+PacketHit Superquadric::Intersect(const RayPacket &packet, const Matrix4d &transform, const Matrix4d &inverse) {
+    PacketHit closest;
+    closest.fill(make_pair(INFINITY, Intersection()));
+
+    // Take every ray in the packet from parent-space to body-space at once
+    RayPacket packet_body = packet.Transformed(inverse);
+    ThreadStats().object_tests += packet.lanes;
+
+    PacketArray t_final = NewtonIterativeSolver(packet_body, exp0, exp1, guess_bvh.get());
+
+    // If every lane missed, there is nothing to transform back
+    if (!(t_final < INFINITY).any()) {
+        return closest;
+    }
+
+    for (int lane = 0; lane < PACKET_SIZE; lane++) {
+        if (t_final(lane) == INFINITY) {
+            continue;
+        }
+
+        // Find the body-space intersection and normal, then take them to parent-space
+        Ray ray_body = packet_body.Get(lane);
+        Ray loc = Ray();
+        loc.origin = ray_body.At(t_final(lane));
+        loc.direction = GetNormal(loc.origin);
+
+        closest[lane] = make_pair(t_final(lane), Intersection(TransformIntersection(loc, transform), this));
+    }
+
+    return closest;
+}
+
+pair<double, Intersection> Superquadric::Intersect(const Ray &ray, const Matrix4d &transform, const Matrix4d &inverse) {
+    Ray ray_body = ray.Transformed(inverse);
+    ThreadStats().object_tests++;
+
+    double t_final = NewtonIterativeSolver(ray_body, exp0, exp1, guess_bvh.get());
+    if (t_final == INFINITY) {
+        return make_pair(INFINITY, Intersection());
+    }
+
+    Ray loc = Ray();
+    loc.origin = ray_body.At(t_final);
+    loc.direction = GetNormal(loc.origin);
+
+    return make_pair(t_final, Intersection(TransformIntersection(loc, transform), this));
+}
+
+pair<double, Intersection> Superquadric::ExitIntersection(const Ray &ray, const Matrix4d &transform,
+                                                          const Matrix4d &inverse) {
+    // Newton's method only finds where rays enter a superquadric, so trace the ray backwards
+    // from where it leaves the bounding sphere. Body-space rays keep the same t.
+    Ray ray_body = ray.Transformed(inverse);
+
+    double a = ray_body.direction.squaredNorm();
+    double b = 2.0 * ray_body.direction.dot(ray_body.origin);
+    double c = ray_body.origin.squaredNorm() - 3 * EXIT_SPHERE_SCALE * EXIT_SPHERE_SCALE;
+    double delta = b * b - 4 * a * c;
+
+    if (delta < 0) {
+        return make_pair(INFINITY, Intersection());
+    }
+
+    double t_far = (-b + sqrt(delta)) / (2.0 * a);
+    if (t_far <= 0) {
+        return make_pair(INFINITY, Intersection());
+    }
+
+    Ray backwards = { ray.origin + t_far * ray.direction, -ray.direction };
+    pair<double, Intersection> hit = Intersect(backwards, transform, inverse);
+
+    if (hit.first == INFINITY || hit.first > t_far) {
+        return make_pair(INFINITY, Intersection());
+    }
+
+    hit.first = t_far - hit.first;
+    return hit;
+}
+
+PacketHit Assembly::ClosestIntersection(const RayPacket &packet) {
+    PacketHit global_closest;
+    global_closest.fill(make_pair(INFINITY, Intersection()));
+
+    // Take every ray in the packet from parent-space to assembly-space at once
+    RayPacket packet_assembly = packet.Transformed(GetInverseTransform());
+
+    bool any_hit = false;
+    for (auto &child : children) {
+        PacketHit child_closest = child->ClosestIntersection(packet_assembly);
+
+        for (int lane = 0; lane < PACKET_SIZE; lane++) {
+            if (child_closest[lane].first < global_closest[lane].first) {
+                global_closest[lane] = child_closest[lane];
+                any_hit = true;
+            }
+        }
+    }
+
+    if (!any_hit) {
+        return global_closest;
+    }
+
+    // Transform the lanes that hit a child from assembly-space back to parent-space
+    Matrix4d final_transform = GetTransform();
+
+    for (int lane = 0; lane < PACKET_SIZE; lane++) {
+        if (global_closest[lane].first == INFINITY) {
+            continue;
+        }
+
+        Intersection &hit = global_closest[lane].second;
+        hit.location = TransformIntersection(hit.location, final_transform);
+    }
+
+    return global_closest;
+}
+
+/**
+ * Hybrid Primary Visibility Code
+ */
+
+pair<double, Intersection> Superquadric::RefineIntersection(const Ray &ray, double t_guess,
+                                                            const Matrix4d &transform, int max_iters) {
+    // Take the ray straight from world-space to body-space; t is unchanged by the transform
+    Ray ray_body = ray.Transformed(transform.inverse());
+
+    int iterations;
+    double t_final = NewtonIterate(ray_body, t_guess, max_iters, exp0, exp1, iterations);
+    ThreadStats().RecordSolve(iterations, t_final != INFINITY, iterations >= MAX_ITERS);
+    if (t_final == INFINITY) {
+        return make_pair(INFINITY, Intersection());
+    }
+
+    Ray loc = Ray();
+    loc.origin = ray_body.At(t_final);
+    loc.direction = GetNormal(loc.origin);
+
+    // Newton's method can still land on the exit point if the guess was too far off. That
+    // one faces away from the ray, so reject it.
+    if (loc.direction.dot(ray_body.direction) >= 0) {
+        return make_pair(INFINITY, Intersection());
+    }
+
+    return make_pair(t_final, Intersection(TransformIntersection(loc, transform), this));
+}
+
 /////////////////////////////////
 ////     PART 2 FUNCTIONS    ////
 /////////////////////////////////
@@ -399,6 +801,7 @@ Vector3f Lighting(Vector3d &p, Vector3d &n, Material &mat, vector<Light> &lights
 
         // Checks to see if our path is obstructed by another Superquadric object
         pair<double, Intersection> closest = scene->ClosestIntersection(path);
+        ThreadStats().shadow_rays++;
 
         // If the object we intersected on the ray sent out from the light is not the same object
         // as our intersecting point, then we know our light path is obstructed. Skip
@@ -439,13 +842,36 @@ Vector3f Lighting(Vector3d &p, Vector3d &n, Material &mat, vector<Light> &lights
     return cp;
 }
 
+// Mirrors the direction d about the unit normal n
+Vector3d Reflect(const Vector3d &d, const Vector3d &n) {
+    return d - 2.0 * d.dot(n) * n;
+}
+
+// Bends the unit direction d through a surface with unit normal n (facing against d), where
+// eta is the ratio of the indices of refraction on either side. Returns false if the ray is
+// totally internally reflected instead.
+bool Refract(const Vector3d &d, const Vector3d &n, double eta, Vector3d &refracted) {
+    double cos_i = -d.dot(n);
+    double k = 1.0 - eta * eta * (1.0 - cos_i * cos_i);
+    if (k < 0) {
+        return false;
+    }
+
+    refracted = eta * d + (eta * cos_i - sqrt(k)) * n;
+    return true;
+}
+
 /**
  * Raytracing Code
  */
 
 void Scene::Raytrace() {
-    // Initialize image of size XRES x YRES
-    Image img = Image(XRES, YRES);
+    lock_guard<mutex> raytrace_lock(raytrace_mutex);
+
+    // Initialize image of size xres x yres
+    const int xres = options.width;
+    const int yres = options.height;
+    Image img = Image(xres, yres);
 
     // Get the camera from the scene
     Camera camera = GetCamera();
@@ -461,7 +887,7 @@ void Scene::Raytrace() {
 
     // Need to retrieve the height and width of the front plane of the frustum
     double h = 2.0 * frust.near * tan((frust.fov * M_PI / 180) / 2.0);
-    double a = (double) XRES / YRES; // Aspect ratio is the x-resolution divided by y-resolution
+    double a = (double) xres / yres; // Aspect ratio is the x-resolution divided by y-resolution
     double w = h * a; // Width is just the height * aspect ratio
 
     // Initialize basis vectors
@@ -469,56 +895,717 @@ void Scene::Raytrace() {
     Vector3d e2(1, 0, 0); // Vector pointing directly to the right relative to the camera
     Vector3d e3(0, 1, 0); // Vector pointing upwards relative to camera
 
-    // For each pixel (i, j) in the image, want to send out rays through each pixel from our camera
-    for (int i = 0; i < XRES; i++) {
-        for (int j = 0; j < YRES; j++) {
-            double x = (i - XRES / 2.0) * w / (double) XRES; // Obtain the x-coordinate of the pixel (i, j)
-            double y = (j - YRES / 2.0) * h / (double) YRES; // Obtain the y-coordinate of the pixel (i, j)
+    // Camera-space to world-space rotation for our primary rays
+    Matrix4d camera_inverse = camera.rotate.GetMatrix().inverse();
+
+    // Builds the ray going from the camera through the continuous pixel coordinate (i, j),
+    // where integer coordinates are the pixel corners
+    auto primary_ray = [&](double i, double j) {
+        double x = (i - xres / 2.0) * w / (double) xres; // Obtain the x-coordinate of the pixel (i, j)
+        double y = (j - yres / 2.0) * h / (double) yres; // Obtain the y-coordinate of the pixel (i, j)
+
+        // Computes the direction of the ray going from the camera to each pixel on the grid
+        Vector3d direction = frust.near * e1 + x * e2 + y * e3;
+
+        // Create the ray to send out from the camera position to each pixel on the grid
+        Ray incoming = {cam_pos, direction};
+
+        // We have to rotate our ray by the inverse camera transform to take ray from world-space to camera-space
+        incoming.Transform(camera_inverse);
+
+        return incoming;
+    };
+
+    // Computes the local color of the closest intersection of a ray from eye
+    auto shade = [&](const pair<double, Intersection> &closest, Vector3d eye) -> Vector3f {
+        // If there is no closest intersection (i.e, the ray misses the screen plane completely),
+        // color it black
+        if (closest.first == INFINITY) {
+            return Vector3f::Zero();
+        }
+
+        // Get the intersection object
+        Superquadric* object = closest.second.obj;
+
+        // Get the intersection ray
+        Ray intersection = closest.second.location;
+
+        // Get the point of intersection
+        Vector3d point = intersection.origin;
+
+        // Get the surface normal at that point
+        Vector3d normal = intersection.direction;
+
+        // Get the material of the intersecting object
+        Material mat = object->GetMaterial();
+
+        // Compute the color of this pixel using the lighting model
+        return Lighting(point, normal, mat, lights, eye, object, this);
+    };
+
+    // Primary hits are kept in the G-buffer while options.gbuffer is set. They are only
+    // reused if the camera, geometry and resolution match the run that traced them.
+    size_t camera_hash = camera.Hash();
+    size_t geometry_hash = GeometryHash();
+    bool reuse = options.gbuffer && gbuffer.camera_hash == camera_hash && gbuffer.geometry_hash == geometry_hash
+                 && gbuffer.xres == xres && gbuffer.yres == yres;
 
-            // Computes the direction of the ray going from the camera to each pixel on the grid
-            Vector3d direction = frust.near * e1 + x * e2 + y * e3;
+    if (!reuse) {
+        gbuffer = GBuffer();
+        if (options.gbuffer) {
+            gbuffer.camera_hash = camera_hash;
+            gbuffer.geometry_hash = geometry_hash;
+            gbuffer.xres = xres;
+            gbuffer.yres = yres;
+            gbuffer.samples.resize(xres * yres);
+        }
+    }
+
+    atomic<long> reused(0);
+
+    // Picks up any transform changes (e.g. from an animation) since the last raytrace
+    UpdateBVH();
+
+    // The headless raytracer never tesselates for OpenGL, so do it here if needed
+    if ((options.hybrid || options.mesh_guess) && vertex_buffer.empty()) {
+        ReloadObjects();
+    }
+
+    // Instance of each superquadric, so rays refracted into one can find where they leave it
+    unordered_map<Superquadric*, int> instance_index;
+    for (size_t k = 0; k < instances.size(); k++) {
+        instance_index.emplace(instances[k].obj, k);
+    }
+
+    // The tesselation BVHs are cheap to build, so rebuild them every time rather than
+    // tracking when the tesselation changes
+    for (auto &instance : instances) {
+        if (options.mesh_guess) {
+            instance.obj->BuildGuessBVH(vertex_buffer);
+        } else {
+            instance.obj->ClearGuessBVH();
+        }
+    }
+
+    // Hybrid primary visibility: rasterize the tesselation into object-ID and depth buffers,
+    // so that most pixel-corner samples only need a few Newton steps on the one object the
+    // raster says they see, seeded with the rasterized depth. The tesselation is scaled up
+    // to enclose each surface, so the seeds start in front of it like GetInitialGuess does.
+    unique_ptr<VisibilityBuffer> visibility;
+    atomic<long> resolved(0);
+
+    if (options.hybrid) {
+        auto raster_start = chrono::steady_clock::now();
+
+        // Primary rays start from the camera position rotated by camera_inverse (see primary_ray),
+        // and rotating back by the camera rotation lines the view direction up with -z
+        Matrix3d cam_rotate = camera.rotate.GetMatrix().block<3, 3>(0, 0);
+        Vector3d cam_origin = camera_inverse.block<3, 3>(0, 0) * cam_pos;
+
+        visibility.reset(new VisibilityBuffer(xres, yres));
+        vector<Vector3i> triangles;
+        bool clipped = false;
+
+        for (size_t k = 0; k < instances.size() && !clipped; k++) {
+            triangles.clear();
+            instances[k].obj->GetTriangles(triangles);
+            double hull_scale = instances[k].obj->GetHullScale();
+
+            for (auto &triangle : triangles) {
+                // Project each vertex to (pixel x, pixel y, t), inverting primary_ray
+                Vector3d screen[3];
+                for (int v = 0; v < 3; v++) {
+                    Vector3d vertex = vertex_buffer[triangle(v)].cast<double>() * hull_scale;
+                    Vector4d world = instances[k].transform * vertex.homogeneous();
+                    Vector3d local = cam_rotate * (world.head(3) - cam_origin);
+                    double t = -local(2) / frust.near;
+                    clipped = clipped || t <= 0;
+
+                    screen[v] = Vector3d(local(0) / t * xres / w + xres / 2.0,
+                                         local(1) / t * yres / h + yres / 2.0, t);
+                }
+
+                if (clipped) {
+                    break;
+                }
+
+                visibility->Rasterize(screen[0], screen[1], screen[2], k);
+            }
+        }
+
+        if (clipped) {
+            cout << "Hybrid visibility disabled: the tesselation crosses the camera plane\n";
+            visibility.reset();
+        } else {
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - raster_start).count();
+            cout << "Rasterized " << instances.size() << " superquadrics in " << seconds << "s\n";
+        }
+    }
+
+    // Finds the hit of a pixel-corner sample from the visibility buffer. Returns false if the
+    // sample needs a full traversal instead, which is the case next to silhouettes and object
+    // boundaries (where the tesselation can't be trusted) and when Newton's method fails.
+    auto hybrid_hit = [&](int pixel, const Ray &ray, pair<double, Intersection> &hit) {
+        int x = pixel % xres;
+        int y = pixel / xres;
+        int id = visibility->Id(x, y);
+
+        if ((x > 0 && visibility->Id(x - 1, y) != id) || (x + 1 < xres && visibility->Id(x + 1, y) != id) ||
+            (y > 0 && visibility->Id(x, y - 1) != id) || (y + 1 < yres && visibility->Id(x, y + 1) != id)) {
+            return false;
+        }
+
+        // Well inside the background
+        if (id < 0) {
+            hit = make_pair(INFINITY, Intersection());
+            return true;
+        }
+
+        const SuperquadricInstance &instance = instances[id];
+        hit = instance.obj->RefineIntersection(ray, visibility->Depth(x, y), instance.transform, HYBRID_NEWTON_ITERS);
+
+        // Every other surface lies behind its own (enclosing) tesselation, so the hit is only
+        // known to be the closest if it is in front of all the other tesselations. Where
+        // objects interpenetrate, the raster can pick the wrong one.
+        return hit.first != INFINITY && hit.first <= visibility->OtherDepth(x, y);
+    };
+
+    // Traces the reflections and refractions of a batch of up to PACKET_SIZE samples, given
+    // the rays and hits of their primary samples, adding what they see to colors and the
+    // Newton iterations spent on them to iterations. Each sample has its own stack of
+    // secondary rays rather than recursing. Every round pops one ray off each non-empty stack,
+    // and the popped rays that are in the air are traced together as a packet, the same way
+    // as primary rays.
+    auto trace_secondary = [&](const Ray *rays, const pair<double, Intersection> *hits, int count,
+                               Vector3f *colors, long *iterations) {
+        RayStats &stats = ThreadStats();
+        vector<SecondaryRay> stacks[PACKET_SIZE];
+        int spawned[PACKET_SIZE] = {};
+
+        // Pushes a ray for sample k, unless the sample is out of budget or the ray is too faint
+        auto push = [&](int k, const Vector3d &origin, const Vector3d &direction, const Vector3f &throughput,
+                        int inside) {
+            if (spawned[k] >= options.ray_budget || throughput.maxCoeff() < options.min_throughput) {
+                return;
+            }
+
+            stacks[k].push_back({ { origin, direction }, throughput, inside });
+            spawned[k]++;
+        };
+
+        // Pushes the reflection and refraction of a ray in the air with the given hit
+        auto spawn = [&](int k, const Vector3d &direction, const pair<double, Intersection> &hit,
+                         const Vector3f &throughput) {
+            if (hit.first == INFINITY) {
+                return;
+            }
 
-            // Create the ray to send out from the camera position to each pixel on the grid
-            Ray incoming = {cam_pos, direction};
+            Superquadric *object = hit.second.obj;
+            const Material &mat = object->GetMaterial();
+            Vector3d point = hit.second.location.origin;
+            Vector3d normal = hit.second.location.direction;
+            Vector3d d = direction.normalized();
 
-            // We have to rotate our ray by the inverse camera transform to take ray from world-space to camera-space
-            incoming.Transform(camera.rotate.GetMatrix().inverse());
+            if (mat.reflected > 0) {
+                push(k, point + SECONDARY_OFFSET * normal, Reflect(d, normal), throughput * mat.reflected, -1);
+            }
 
-            // Finds the closest intersection from each pixel to the screen plane
-            pair<double, Intersection> closest = ClosestIntersection(incoming);
+            Vector3d refracted;
+            auto it = instance_index.find(object);
+            if (mat.refracted > 0 && it != instance_index.end() && Refract(d, normal, 1.0 / REFRACTIVE_INDEX, refracted)) {
+                push(k, point - SECONDARY_OFFSET * normal, refracted, throughput * mat.refracted, it->second);
+            }
+        };
 
-            // If there is no closest intersection (i.e, the ray misses the screen plane completely),
-            // color it black
-            if (closest.first == INFINITY) {
-                img.SetPixel(i, j, Vector3f::Zero());
+        for (int k = 0; k < count; k++) {
+            spawn(k, rays[k].direction, hits[k], Vector3f::Ones());
+        }
+
+        while (true) {
+            SecondaryRay current[PACKET_SIZE];
+            int air[PACKET_SIZE];
+            int num_air = 0;
+            bool any = false;
+
+            for (int k = 0; k < count; k++) {
+                if (stacks[k].empty()) {
+                    continue;
+                }
+
+                current[k] = stacks[k].back();
+                stacks[k].pop_back();
+                any = true;
+                stats.secondary_rays++;
+
+                if (current[k].inside < 0) {
+                    air[num_air++] = k;
+                    continue;
+                }
+
+                // Find where the ray leaves the superquadric it's inside, and bend it back out
+                // (or reflect it back in, past the critical angle). Rays that can't find their
+                // way out are dropped.
+                const SuperquadricInstance &instance = instances[current[k].inside];
+                stats.ResetLanes();
+                auto hit = instance.obj->ExitIntersection(current[k].ray, instance.transform, instance.inverse);
+                iterations[k] += stats.lane_iterations[0];
+                if (hit.first == INFINITY) {
+                    continue;
+                }
+
+                Vector3d point = hit.second.location.origin;
+                Vector3d normal = hit.second.location.direction;
+                Vector3d d = current[k].ray.direction.normalized();
+                Vector3d refracted;
+
+                if (Refract(d, -normal, REFRACTIVE_INDEX, refracted)) {
+                    push(k, point + SECONDARY_OFFSET * normal, refracted, current[k].throughput, -1);
+                } else {
+                    push(k, point - SECONDARY_OFFSET * normal, Reflect(d, -normal), current[k].throughput,
+                         current[k].inside);
+                }
+            }
+
+            if (!any) {
+                break;
+            }
+
+            pair<double, Intersection> air_hits[PACKET_SIZE];
+
+            if (num_air > 1 && options.packets) {
+                // Lanes past num_air just repeat the last ray
+                Ray air_rays[PACKET_SIZE];
+                for (int lane = 0; lane < PACKET_SIZE; lane++) {
+                    air_rays[lane] = current[air[min(lane, num_air - 1)]].ray;
+                }
+
+                stats.ResetLanes();
+                PacketHit closest = ClosestIntersection(RayPacket(air_rays, num_air));
+                copy(closest.begin(), closest.begin() + num_air, air_hits);
+
+                for (int lane = 0; lane < num_air; lane++) {
+                    iterations[air[lane]] += stats.lane_iterations[lane];
+                }
+            } else {
+                for (int lane = 0; lane < num_air; lane++) {
+                    stats.ResetLanes();
+                    air_hits[lane] = ClosestIntersection(current[air[lane]].ray);
+                    iterations[air[lane]] += stats.lane_iterations[0];
+                }
+            }
+
+            for (int lane = 0; lane < num_air; lane++) {
+                int k = air[lane];
+                const SecondaryRay &ray = current[k];
+                if (air_hits[lane].first == INFINITY) {
+                    continue;
+                }
+
+                stats.ResetLanes();
+                colors[k] += ray.throughput.cwiseProduct(shade(air_hits[lane], ray.ray.origin));
+                iterations[k] += stats.lane_iterations[0];
+                spawn(k, ray.ray.direction, air_hits[lane], ray.throughput);
+            }
+        }
+    };
+
+    // Finds the primary hits for a batch of up to PACKET_SIZE samples at continuous pixel
+    // coordinates (sx, sy), where sample k is the indices[k]-th sample of pixel pixels[k].
+    // Hits already in the G-buffer are reused, then pixel-corner samples are resolved from
+    // the visibility buffer if possible, and the rest are traced. New hits are cached, then
+    // every sample is shaded, writing out its color, the object it hit (nullptr on a miss)
+    // and the number of Newton iterations spent on it.
+    auto trace_samples = [&](const int *pixels, const int *indices, const double *sx, const double *sy,
+                             int count, Vector3f *colors, Superquadric **objects, long *iterations) {
+        RayStats &stats = ThreadStats();
+        pair<double, Intersection> hits[PACKET_SIZE];
+        int missing[PACKET_SIZE];
+        int num_missing = 0;
+
+        for (int k = 0; k < count; k++) {
+            iterations[k] = 0;
+            if (options.gbuffer && indices[k] < (int) gbuffer.samples[pixels[k]].size()) {
+                hits[k] = gbuffer.samples[pixels[k]][indices[k]];
+                reused++;
+            } else {
+                missing[num_missing++] = k;
+            }
+        }
+
+        int untraced[PACKET_SIZE];
+        int num_untraced = 0;
+        stats.primary_rays += num_missing;
+
+        for (int lane = 0; lane < num_missing; lane++) {
+            int k = missing[lane];
+            if (!visibility || indices[k] != 0) {
+                untraced[num_untraced++] = k;
                 continue;
             }
 
-            // Get the intersection object
-            Superquadric* object = closest.second.obj;
+            stats.ResetLanes();
+            bool hit = hybrid_hit(pixels[k], primary_ray(sx[k], sy[k]), hits[k]);
+            iterations[k] += stats.lane_iterations[0];
+
+            if (hit) {
+                resolved++;
+            } else {
+                untraced[num_untraced++] = k;
+            }
+        }
+
+        if (num_untraced > 0 && options.packets) {
+            // Lanes past num_untraced just repeat the last sample
+            Ray rays[PACKET_SIZE];
+            for (int lane = 0; lane < PACKET_SIZE; lane++) {
+                int k = untraced[min(lane, num_untraced - 1)];
+                rays[lane] = primary_ray(sx[k], sy[k]);
+            }
+
+            stats.ResetLanes();
+            PacketHit closest = ClosestIntersection(RayPacket(rays, num_untraced));
+
+            for (int lane = 0; lane < num_untraced; lane++) {
+                hits[untraced[lane]] = closest[lane];
+                iterations[untraced[lane]] += stats.lane_iterations[lane];
+            }
+        } else {
+            for (int lane = 0; lane < num_untraced; lane++) {
+                // Finds the closest intersection from each pixel to the screen plane
+                int k = untraced[lane];
+                stats.ResetLanes();
+                hits[k] = ClosestIntersection(primary_ray(sx[k], sy[k]));
+                iterations[k] += stats.lane_iterations[0];
+            }
+        }
+
+        // Edge tiles can repeat a pixel, so only append samples that are next in line
+        for (int lane = 0; lane < num_missing && options.gbuffer; lane++) {
+            int k = missing[lane];
+            if (indices[k] == (int) gbuffer.samples[pixels[k]].size()) {
+                gbuffer.samples[pixels[k]].push_back(hits[k]);
+            }
+        }
+
+        bool secondary = false;
+        for (int k = 0; k < count; k++) {
+            stats.ResetLanes();
+            colors[k] = shade(hits[k], cam_pos);
+            iterations[k] += stats.lane_iterations[0];
+            objects[k] = hits[k].second.obj;
+
+            if (objects[k]) {
+                const Material &mat = objects[k]->GetMaterial();
+                secondary = secondary || mat.reflected > 0 || mat.refracted > 0;
+            }
+        }
+
+        if (secondary && options.ray_budget > 0) {
+            Ray rays[PACKET_SIZE];
+            for (int k = 0; k < count; k++) {
+                rays[k] = primary_ray(sx[k], sy[k]);
+            }
+
+            trace_secondary(rays, hits, count, colors, iterations);
+        }
+    };
+
+    auto start_time = chrono::steady_clock::now();
+
+    // Stops the render early once the time budget (if any) has run out
+    auto out_of_time = [&]() {
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+        return options.time_budget > 0 && elapsed > options.time_budget;
+    };
 
-            // Get the intersection ray
-            Ray intersection = closest.second.location;
-            
-            // Get the point of intersection
-            Vector3d point = intersection.origin;
+    // Hands the image rendered so far to whoever is displaying the preview
+    auto publish = [&]() {
+        if (options.on_progress) {
+            options.on_progress(img);
+        }
+    };
+
+    // Counters of every thread, merged in as each parallel_for finishes
+    RayStats stats;
+    mutex stats_mutex;
+
+    // Runs body(k) for every k in [0, count) on options.threads threads. Indices are handed
+    // out one at a time, so threads that get cheap image columns go on to take more of them.
+    auto parallel_for = [&](int count, const function<void(int)> &body) {
+        atomic<int> next(0);
+        auto worker = [&]() {
+            RayStats &thread_stats = ThreadStats();
+            thread_stats = RayStats();
+
+            for (int k = next++; k < count; k = next++) {
+                body(k);
+            }
 
-            // Get the surface normal at that point
-            Vector3d normal = intersection.direction;
+            lock_guard<mutex> lock(stats_mutex);
+            stats.Merge(thread_stats);
+        };
 
-            // Get the material of the intersecting object
-            Material mat = object->GetMaterial();
+        vector<thread> workers;
+        for (int t = 1; t < options.threads; t++) {
+            workers.emplace_back(worker);
+        }
+        worker();
+
+        for (auto &t : workers) {
+            t.join();
+        }
+    };
+
+    // Object hit by each pixel's first sample, used to find silhouette edges
+    vector<Superquadric*> pixel_objects(xres * yres, nullptr);
+    vector<char> traced(xres * yres, false);
+
+    // Newton iterations spent on each pixel, for the heatmap
+    vector<long> pixel_iterations(options.heatmap.empty() ? 0 : xres * yres, 0);
+    atomic<long> samples(0);
+
+    // First pass: one sample per pixel at the pixel corner. Progressive renders start with
+    // every 4th pixel in each direction (1/16 resolution), then every 2nd (1/4 resolution),
+    // then the rest, filling each traced pixel's stride x stride block so that the coarse
+    // stages already cover the whole image. Samples are traced in PACKET_TILE x PACKET_TILE
+    // tiles so each packet holds coherent rays, skipping pixels done in an earlier stage.
+    // Each thread takes a column of tiles at a time, and the blocks of different columns
+    // never overlap.
+    vector<int> strides = options.progressive ? vector<int> { 4, 2, 1 } : vector<int> { 1 };
+    atomic<bool> stopped(false);
+
+    for (int stride : strides) {
+        int tile_size = PACKET_TILE * stride;
+        int columns = (xres + tile_size - 1) / tile_size;
+
+        parallel_for(columns, [&](int column) {
+            if (stopped) {
+                return;
+            }
 
-            // Compute the color of this pixel using the lighting model
-            Vector3f color = Lighting(point, normal, mat, lights, cam_pos, object, this);
+            int i = column * tile_size;
+            for (int j = 0; j < yres; j += tile_size) {
+                int px[PACKET_SIZE], py[PACKET_SIZE];
+                int pixels[PACKET_SIZE], indices[PACKET_SIZE];
+                double sx[PACKET_SIZE], sy[PACKET_SIZE];
+                Vector3f colors[PACKET_SIZE];
+                Superquadric* objects[PACKET_SIZE];
+                long iterations[PACKET_SIZE];
+
+                int count = 0;
+                for (int lane = 0; lane < PACKET_SIZE; lane++) {
+                    int x = i + (lane % PACKET_TILE) * stride;
+                    int y = j + (lane / PACKET_TILE) * stride;
+                    if (x >= xres || y >= yres || traced[x + xres * y]) {
+                        continue;
+                    }
+
+                    px[count] = x;
+                    py[count] = y;
+                    sx[count] = x;
+                    sy[count] = y;
+                    pixels[count] = x + xres * y;
+                    indices[count] = 0;
+                    count++;
+                }
+
+                if (count == 0) {
+                    continue;
+                }
+
+                trace_samples(pixels, indices, sx, sy, count, colors, objects, iterations);
+                samples += count;
+
+                for (int k = 0; k < count; k++) {
+                    for (int x = px[k]; x < min(px[k] + stride, xres); x++) {
+                        for (int y = py[k]; y < min(py[k] + stride, yres); y++) {
+                            img.SetPixel(x, y, colors[k]);
+                        }
+                    }
+
+                    pixel_objects[pixels[k]] = objects[k];
+                    traced[pixels[k]] = true;
+                    if (!pixel_iterations.empty()) {
+                        pixel_iterations[pixels[k]] = iterations[k];
+                    }
+                }
+            }
+
+            if (out_of_time()) {
+                stopped = true;
+            }
+        });
+
+        publish();
+
+        if (stopped) {
+            break;
+        }
+
+        if (options.progressive) {
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+            cout << "Finished 1/" << stride * stride << " resolution pass after " << seconds << "s\n";
+        }
+    }
+
+    // Second pass: adaptive antialiasing. Pixels whose color differs from a neighbor by more
+    // than aa_threshold, or that see a different object than a neighbor, get extra samples.
+    if (options.aa_max_samples > 1 && !stopped) {
+        vector<bool> refine(xres * yres, false);
+
+        for (int i = 0; i < xres; i++) {
+            for (int j = 0; j < yres; j++) {
+                int idx = i + xres * j;
+                int neighbors[2] = { i + 1 < xres ? idx + 1 : -1, j + 1 < yres ? idx + xres : -1 };
+
+                for (int other : neighbors) {
+                    if (other < 0) {
+                        continue;
+                    }
+
+                    float contrast = (img.pixels[idx] - img.pixels[other]).cwiseAbs().maxCoeff();
+                    if (contrast > options.aa_threshold || pixel_objects[idx] != pixel_objects[other]) {
+                        refine[idx] = true;
+                        refine[other] = true;
+                    }
+                }
+            }
+        }
+
+        // Extra samples are stratified over an n x n grid of sub-pixel cells, visited in a
+        // fixed shuffled order so that any prefix of them stays well spread over the pixel.
+        // The grid is rounded up so there are always enough cells for the maximum samples.
+        int n = max(1, (int) ceil(sqrt(options.aa_max_samples - 1)));
+        vector<int> strata(n * n);
+        for (int k = 0; k < n * n; k++) {
+            strata[k] = k;
+        }
+        minstd_rand shuffle_rng(171);
+        shuffle(strata.begin(), strata.end(), shuffle_rng);
+
+        // Each thread refines one column of pixels at a time
+        parallel_for(xres, [&](int i) {
+            if (stopped) {
+                return;
+            }
+
+            for (int j = 0; j < yres; j++) {
+                if (!refine[i + xres * j]) {
+                    continue;
+                }
+
+                // Jitter is seeded per pixel so that every run places the same samples,
+                // which lets G-buffer hits from earlier runs be reused
+                minstd_rand rng(1 + i + xres * j);
+                uniform_real_distribution<double> jitter(0.0, 1.0);
+
+                // Running luminance statistics, used to stop refining once the pixel has converged
+                Vector3f sum = img.pixels[i + xres * j];
+                float lum = sum.mean();
+                float lum_sum = lum;
+                float lum_sq_sum = lum * lum;
+                int count = 1;
+
+                for (size_t next = 0; next < strata.size() && count < options.aa_max_samples; ) {
+                    int pixels[PACKET_SIZE], indices[PACKET_SIZE];
+                    double sx[PACKET_SIZE], sy[PACKET_SIZE];
+                    Vector3f colors[PACKET_SIZE];
+                    Superquadric* objects[PACKET_SIZE];
+                    long iterations[PACKET_SIZE];
+
+                    int batch = 0;
+                    while (batch < PACKET_SIZE && next < strata.size() && count + batch < options.aa_max_samples) {
+                        int cell = strata[next++];
+                        pixels[batch] = i + xres * j;
+                        indices[batch] = count + batch;
+                        sx[batch] = i + (cell % n + jitter(rng)) / n;
+                        sy[batch] = j + (cell / n + jitter(rng)) / n;
+                        batch++;
+                    }
+
+                    trace_samples(pixels, indices, sx, sy, batch, colors, objects, iterations);
+
+                    for (int k = 0; k < batch; k++) {
+                        sum += colors[k];
+                        if (!pixel_iterations.empty()) {
+                            pixel_iterations[i + xres * j] += iterations[k];
+                        }
+                        lum = colors[k].mean();
+                        lum_sum += lum;
+                        lum_sq_sum += lum * lum;
+                    }
+                    count += batch;
+
+                    // Stop once the standard error of the pixel mean drops well below the threshold
+                    float mean = lum_sum / count;
+                    float variance = max(0.0f, lum_sq_sum / count - mean * mean);
+                    if (sqrt(variance / count) < 0.25 * options.aa_threshold) {
+                        break;
+                    }
+                }
+
+                img.SetPixel(i, j, sum / count);
+                samples += count - 1;
+            }
+
+            if (out_of_time()) {
+                stopped = true;
+            }
+        });
+
+        publish();
+    }
+
+    if (stats.secondary_rays > 0) {
+        cout << "Traced " << stats.secondary_rays << " secondary rays (" << (double) stats.secondary_rays / samples
+             << " per primary ray)\n";
+    }
+
+    if (visibility) {
+        cout << "Resolved " << resolved << " primary rays from the hybrid visibility buffer\n";
+    }
+
+    if (stopped) {
+        cout << "Ran out of the " << options.time_budget << "s time budget, stopping early\n";
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+    cout << "Traced " << samples << (options.packets ? " packet" : " scalar") << " primary rays on "
+         << options.threads << " threads in " << seconds << "s (" << samples / seconds << " rays/s, "
+         << (double) samples / (xres * yres) << " samples per pixel, " << reused << " reused from the G-buffer)\n";
+
+    double scene_rays = max(1L, stats.scene_rays);
+    cout << "Newton's method ran " << stats.newton_solves << " times for "
+         << (double) stats.newton_iterations / max(1L, stats.newton_solves) << " iterations each, failing "
+         << stats.newton_failures << " times (" << stats.newton_max_iters << " out of iterations). Each of "
+         << stats.scene_rays << " rays tested " << stats.object_tests / scene_rays << " superquadrics and visited "
+         << stats.bvh_nodes / scene_rays << " BVH nodes\n";
+
+    if (!options.stats_output.empty()) {
+        if (!stats.WriteJSON(options.stats_output, xres, yres, seconds)) {
+            cerr << "Error: couldn't write " << options.stats_output << std::endl;
+        }
+    }
+
+    // Newton iterations per pixel on a log scale, going from black through red and yellow to
+    // white at the most expensive pixel
+    if (!options.heatmap.empty()) {
+        long most = max(1L, *max_element(pixel_iterations.begin(), pixel_iterations.end()));
+        Image heatmap(xres, yres);
+
+        for (int k = 0; k < xres * yres; k++) {
+            float heat = log1p((double) pixel_iterations[k]) / log1p((double) most);
+            Vector3f color(3 * heat, 3 * heat - 1, 3 * heat - 2);
+            heatmap.pixels[k] = color.cwiseMax(0.0f).cwiseMin(1.0f);
+        }
 
-            // The pixel to the correct color
-            img.SetPixel(i, j, color);
+        if (!heatmap.SaveImage(options.heatmap)) {
+            cerr << "Error: couldn't save " << options.heatmap << std::endl;
         }
     }
 
     // Outputs the image.
-    if (!img.SaveImage("rt.png")) {
+    if (!img.SaveImage(options.output)) {
         cerr << "Error: couldn't save PNG image" << std::endl;
     } else {
         cout << "Done!\n";
@@ -0,0 +1,216 @@
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace Eigen;
+
+// Maximum number of triangles in a TriangleBVH leaf
+const int LEAF_SIZE = 4;
+
+// Maximum number of boxes in a BoxBVH leaf
+const int BOX_LEAF_SIZE = 2;
+
+// Slack on the barycentric tests, so that rays through a shared edge or vertex
+// can't slip between the triangles on either side of it
+const double BARY_EPSILON = 1e-6;
+
+TriangleBVH::TriangleBVH(const std::vector<Vector3d> &verts, const std::vector<Vector3i> &tris) {
+    vertices = verts;
+    triangles = tris;
+
+    if (!triangles.empty()) {
+        nodes.reserve(2 * triangles.size());
+        Build(0, triangles.size());
+    }
+}
+
+int TriangleBVH::Build(int first, int count) {
+    int index = nodes.size();
+    nodes.emplace_back();
+
+    Bounds bounds;
+    for (int i = first; i < first + count; i++) {
+        for (int v = 0; v < 3; v++) {
+            bounds.Extend(vertices[triangles[i](v)]);
+        }
+    }
+
+    nodes[index].bounds = bounds;
+    nodes[index].first = first;
+    nodes[index].count = count;
+
+    if (count <= LEAF_SIZE) {
+        return index;
+    }
+
+    // Split at the median centroid along the longest axis
+    int axis;
+    (bounds.upper - bounds.lower).maxCoeff(&axis);
+
+    auto centroid = [&](const Vector3i &tri) {
+        return vertices[tri(0)](axis) + vertices[tri(1)](axis) + vertices[tri(2)](axis);
+    };
+
+    int half = count / 2;
+    std::nth_element(triangles.begin() + first, triangles.begin() + first + half,
+                     triangles.begin() + first + count,
+                     [&](const Vector3i &a, const Vector3i &b) { return centroid(a) < centroid(b); });
+
+    Build(first, half);
+    int right = Build(first + half, count - half);
+
+    // nodes may have been reallocated by the recursive calls
+    nodes[index].right = right;
+    nodes[index].count = 0;
+
+    return index;
+}
+
+double TriangleBVH::Intersect(const Vector3d &origin, const Vector3d &direction) const {
+    double t_closest = INFINITY;
+    if (nodes.empty()) {
+        return t_closest;
+    }
+
+    Vector3d inv_dir = direction.cwiseInverse();
+
+    int stack[64];
+    int size = 0;
+    stack[size++] = 0;
+
+    while (size > 0) {
+        int index = stack[--size];
+        const BVHNode &node = nodes[index];
+
+        // Skip nodes the ray misses or only reaches past the closest hit so far
+        if (!node.bounds.Hit(origin, inv_dir, t_closest)) {
+            continue;
+        }
+
+        if (node.count == 0) {
+            stack[size++] = node.right;
+            stack[size++] = index + 1;
+            continue;
+        }
+
+        // Moller-Trumbore ray-triangle intersection
+        for (int i = node.first; i < node.first + node.count; i++) {
+            const Vector3d &a = vertices[triangles[i](0)];
+            Vector3d edge1 = vertices[triangles[i](1)] - a;
+            Vector3d edge2 = vertices[triangles[i](2)] - a;
+
+            Vector3d p = direction.cross(edge2);
+            double det = edge1.dot(p);
+            if (det == 0.0) {
+                continue;
+            }
+
+            Vector3d s = origin - a;
+            double u = s.dot(p) / det;
+            if (u < -BARY_EPSILON || u > 1 + BARY_EPSILON) {
+                continue;
+            }
+
+            Vector3d q = s.cross(edge1);
+            double v = direction.dot(q) / det;
+            if (v < -BARY_EPSILON || u + v > 1 + BARY_EPSILON) {
+                continue;
+            }
+
+            double t = edge2.dot(q) / det;
+            if (t > 0 && t < t_closest) {
+                t_closest = t;
+            }
+        }
+    }
+
+    return t_closest;
+}
+
+void BoxBVH::Build(const std::vector<Bounds> &boxes) {
+    order.resize(boxes.size());
+    for (size_t i = 0; i < boxes.size(); i++) {
+        order[i] = i;
+    }
+
+    nodes.clear();
+    if (!boxes.empty()) {
+        nodes.reserve(2 * boxes.size());
+        Build(boxes, 0, boxes.size());
+    }
+}
+
+int BoxBVH::Build(const std::vector<Bounds> &boxes, int first, int count) {
+    int index = nodes.size();
+    nodes.emplace_back();
+
+    Bounds bounds;
+    Bounds centroids;
+    for (int i = first; i < first + count; i++) {
+        bounds.Extend(boxes[order[i]]);
+        centroids.Extend((boxes[order[i]].lower + boxes[order[i]].upper) / 2);
+    }
+
+    nodes[index].bounds = bounds;
+    nodes[index].first = first;
+    nodes[index].count = count;
+
+    if (count <= BOX_LEAF_SIZE) {
+        return index;
+    }
+
+    // Split at the median centroid along the axis the centroids are most spread out on
+    int axis;
+    (centroids.upper - centroids.lower).maxCoeff(&axis);
+
+    int half = count / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+                     [&](int a, int b) {
+                         return boxes[a].lower(axis) + boxes[a].upper(axis) < boxes[b].lower(axis) + boxes[b].upper(axis);
+                     });
+
+    Build(boxes, first, half);
+    int right = Build(boxes, first + half, count - half);
+
+    nodes[index].right = right;
+    nodes[index].count = 0;
+
+    return index;
+}
+
+void BoxBVH::Refit(const std::vector<Bounds> &boxes) {
+    // Children always come after their parent, so walking backwards is bottom-up
+    for (int index = nodes.size() - 1; index >= 0; index--) {
+        BVHNode &node = nodes[index];
+        node.bounds = Bounds();
+
+        if (node.count == 0) {
+            node.bounds.Extend(nodes[index + 1].bounds);
+            node.bounds.Extend(nodes[node.right].bounds);
+        } else {
+            for (int i = node.first; i < node.first + node.count; i++) {
+                node.bounds.Extend(boxes[order[i]]);
+            }
+        }
+    }
+}
+
+double BoxBVH::Cost() const {
+    if (nodes.empty()) {
+        return 0.0;
+    }
+
+    // A ray that hits the root hits each node with probability proportional to its area
+    double root_area = nodes[0].bounds.SurfaceArea();
+    if (root_area == 0.0) {
+        return 0.0;
+    }
+
+    double cost = 0.0;
+    for (auto &node : nodes) {
+        cost += node.bounds.SurfaceArea() / root_area * (node.count == 0 ? 1.0 : node.count);
+    }
+
+    return cost;
+}
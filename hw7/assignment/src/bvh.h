@@ -0,0 +1,191 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <cmath>
+#include <vector>
+
+#include <Eigen/Dense>
+
+// Axis-aligned bounding box.
+struct Bounds {
+    Eigen::Vector3d lower;
+    Eigen::Vector3d upper;
+
+    Bounds(): lower(Eigen::Vector3d::Constant(INFINITY)), upper(Eigen::Vector3d::Constant(-INFINITY)) {};
+
+    void Extend(const Eigen::Vector3d &point) {
+        lower = lower.cwiseMin(point);
+        upper = upper.cwiseMax(point);
+    }
+
+    void Extend(const Bounds &other) {
+        lower = lower.cwiseMin(other.lower);
+        upper = upper.cwiseMax(other.upper);
+    }
+
+    double SurfaceArea() const {
+        Eigen::Vector3d size = (upper - lower).cwiseMax(0.0);
+        return 2.0 * (size(0) * size(1) + size(1) * size(2) + size(2) * size(0));
+    }
+
+    bool Overlaps(const Bounds &other) const {
+        return (lower.array() <= other.upper.array()).all() && (other.lower.array() <= upper.array()).all();
+    }
+
+    // Slab test, returning whether the ray overlaps the box somewhere in [0, t_max].
+    bool Hit(const Eigen::Vector3d &origin, const Eigen::Vector3d &inv_dir, double t_max) const {
+        Eigen::Vector3d t0 = (lower - origin).cwiseProduct(inv_dir);
+        Eigen::Vector3d t1 = (upper - origin).cwiseProduct(inv_dir);
+        double t_enter = t0.cwiseMin(t1).maxCoeff();
+        double t_exit = t0.cwiseMax(t1).minCoeff();
+
+        return t_enter <= t_exit && t_exit >= 0 && t_enter <= t_max;
+    }
+};
+
+// Node of a BVH. Interior nodes have count == 0, with children at index + 1 and
+// right. Leaves hold primitives [first, first + count) of the BVH's ordering.
+struct BVHNode {
+    Bounds bounds;
+    int right;
+    int first;
+    int count;
+};
+
+// Bounding volume hierarchy over a triangle mesh, used to find where a ray first
+// hits the mesh. Nodes split their triangles at the median centroid along the
+// longest axis of their bounds.
+class TriangleBVH {
+private:
+    std::vector<Eigen::Vector3d> vertices;
+    std::vector<Eigen::Vector3i> triangles;
+    std::vector<BVHNode> nodes;
+
+    int Build(int first, int count);
+public:
+    TriangleBVH(const std::vector<Eigen::Vector3d> &verts, const std::vector<Eigen::Vector3i> &tris);
+
+    // Returns the smallest positive t at which the ray hits a triangle, or INFINITY.
+    double Intersect(const Eigen::Vector3d &origin, const Eigen::Vector3d &direction) const;
+};
+
+// Bounding volume hierarchy over boxes, e.g. the world-space bounds of the objects in
+// a scene. It can be refit to new boxes in O(n) without changing its topology, which
+// is much cheaper than a rebuild but gets worse the further the boxes have moved.
+class BoxBVH {
+private:
+    std::vector<int> order;
+    std::vector<BVHNode> nodes;
+
+    int Build(const std::vector<Bounds> &boxes, int first, int count);
+public:
+    // Rebuilds the tree over the given boxes, splitting at the median centroid.
+    void Build(const std::vector<Bounds> &boxes);
+
+    // Updates the bounds of every node bottom-up. boxes must be in the same order as
+    // when the tree was built.
+    void Refit(const std::vector<Bounds> &boxes);
+
+    // Surface area heuristic cost of the tree, relative to the area of its root, with
+    // unit cost for both visiting a node and testing a box.
+    double Cost() const;
+
+    bool Empty() const {
+        return nodes.empty();
+    }
+
+    size_t Size() const {
+        return order.size();
+    }
+
+    // Calls visit(index) for every box that the ray might hit before t_max. The
+    // callback may lower t_max (which is read by reference) as it finds hits. Returns
+    // the number of nodes visited.
+    template <class F>
+    int Traverse(const Eigen::Vector3d &origin, const Eigen::Vector3d &direction, const double &t_max,
+                  F visit) const {
+        if (nodes.empty()) {
+            return 0;
+        }
+
+        Eigen::Vector3d inv_dir = direction.cwiseInverse();
+
+        int stack[64];
+        int size = 0;
+        stack[size++] = 0;
+        int visited = 0;
+
+        while (size > 0) {
+            int index = stack[--size];
+            const BVHNode &node = nodes[index];
+            visited++;
+
+            if (!node.bounds.Hit(origin, inv_dir, t_max)) {
+                continue;
+            }
+
+            if (node.count == 0) {
+                stack[size++] = node.right;
+                stack[size++] = index + 1;
+                continue;
+            }
+
+            for (int i = node.first; i < node.first + node.count; i++) {
+                visit(order[i]);
+            }
+        }
+
+        return visited;
+    }
+
+    // Packet version of Traverse, visiting every box that any lane might hit before
+    // its own t_max.
+    template <int N, class F>
+    int Traverse(const Eigen::Matrix<double, N, 3> &origin, const Eigen::Matrix<double, N, 3> &direction,
+                  const Eigen::Array<double, N, 1> &t_max, F visit) const {
+        if (nodes.empty()) {
+            return 0;
+        }
+
+        Eigen::Array<double, N, 3> inv_dir = direction.array().inverse();
+
+        int stack[64];
+        int size = 0;
+        stack[size++] = 0;
+        int visited = 0;
+
+        while (size > 0) {
+            int index = stack[--size];
+            const BVHNode &node = nodes[index];
+            visited++;
+
+            // Same slab test as Bounds::Hit, for every lane at once
+            Eigen::Array<double, N, 1> t_enter = Eigen::Array<double, N, 1>::Constant(-INFINITY);
+            Eigen::Array<double, N, 1> t_exit = Eigen::Array<double, N, 1>::Constant(INFINITY);
+            for (int axis = 0; axis < 3; axis++) {
+                Eigen::Array<double, N, 1> t0 = (node.bounds.lower(axis) - origin.col(axis).array()) * inv_dir.col(axis);
+                Eigen::Array<double, N, 1> t1 = (node.bounds.upper(axis) - origin.col(axis).array()) * inv_dir.col(axis);
+                t_enter = t_enter.max(t0.min(t1));
+                t_exit = t_exit.min(t0.max(t1));
+            }
+
+            if (!(t_enter <= t_exit && t_exit >= 0 && t_enter <= t_max).any()) {
+                continue;
+            }
+
+            if (node.count == 0) {
+                stack[size++] = node.right;
+                stack[size++] = index + 1;
+                continue;
+            }
+
+            for (int i = node.first; i < node.first + node.count; i++) {
+                visit(order[i]);
+            }
+        }
+
+        return visited;
+    }
+};
+
+#endif // BVH_H
@@ -1,12 +1,22 @@
 #include "camera.h"
 
-#include "glinclude.h"
+#include "util.h"
 
-void Frustum::OpenGLSetMatrix() const {
-    gluPerspective(fov, aspect_ratio, near, far);
-}
+size_t Camera::Hash() const {
+    size_t seed = 0;
+
+    Eigen::Vector3d delta = translate.GetDelta();
+    Eigen::Vector3d axis = rotate.GetAxis();
+    for (int i = 0; i < 3; i++) {
+        HashCombine(seed, delta[i]);
+        HashCombine(seed, axis[i]);
+    }
 
-void Camera::OpenGLSetPosition() const {
-    translate.OpenGLTransform();
-    rotate.OpenGLTransform();
-}
\ No newline at end of file
+    HashCombine(seed, rotate.GetAngle());
+    HashCombine(seed, frustum.aspect_ratio);
+    HashCombine(seed, frustum.fov);
+    HashCombine(seed, frustum.near);
+    HashCombine(seed, frustum.far);
+
+    return seed;
+}
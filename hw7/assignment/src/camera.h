@@ -1,6 +1,8 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <cstddef>
+
 #include "transform.h"
 
 class Frustum {
@@ -20,6 +22,7 @@ public:
     Frustum frustum;
 
     void OpenGLSetPosition() const;
+    size_t Hash() const;
 };
 
 #endif // CAMERA_H
\ No newline at end of file
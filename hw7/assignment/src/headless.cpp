@@ -0,0 +1,13 @@
+#include "transform.h"
+
+// The headless raytracer is built without OpenGL, but the virtual OpenGL hooks
+// of transformations still need definitions for their vtables.
+// There is never a GL context to draw into, so they do nothing. The real
+// implementations are in opengl.cpp.
+
+void Rotate::OpenGLTransform() const {}
+
+void Translate::OpenGLTransform() const {}
+
+void Scale::OpenGLTransform() const {}
+
@@ -1,13 +1,23 @@
 #include "object.h"
+#include "tesselation.h"
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 
-#include "glinclude.h"
-
 using namespace std;
 using namespace Eigen;
 
+// Surface samples per tesselation patch (along u and v) when measuring the hull scale
+const int HULL_SAMPLES = 4;
+
+// Extra scale applied on top of the measured hull scale
+const double HULL_MARGIN = 1.01;
+
+// sin/cos values this small are rounding error at multiples of pi/2, which small exponents
+// would otherwise blow up (1e-8 ^ 0.1 = 0.16), leaving cracks at the seam and poles
+const float TRIG_EPSILON = 1e-6;
+
 inline int sign(float x) {
     return (x > 0) ? 1 : -1;
 }
@@ -15,12 +25,18 @@ inline int sign(float x) {
 /* Calculates the parametric superquadric sine analog */
 inline float pSin(float u, float p) {
     float sin_u = sinf(u);
+    if (fabs(sin_u) < TRIG_EPSILON) {
+        return 0.0;
+    }
     return sign(sin_u) * powf(fabs(sin_u), p);
 }
 
 /* Calculates the parametric superquadric cosine analog */
 inline float pCos(float u, float p) {
     float cos_u = cosf(u);
+    if (fabs(cos_u) < TRIG_EPSILON) {
+        return 0.0;
+    }
     return sign(cos_u) * powf(fabs(cos_u), p);
 }
 
@@ -39,22 +55,40 @@ Material::Material() {
     refracted = 0;
 }
 
-void Material::SetOpenGLMaterial() {
-    glMaterialfv(GL_FRONT, GL_AMBIENT, (float *) &ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, (float *) &diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, (float *) &specular);
-    glMaterialf(GL_FRONT, GL_SHININESS, shininess);
-}
-
 /**
  * Base Object Implementation
  */
 
 
-void Object::OpenGLRender() {
+Matrix4d Object::GetTransform() {
+    Matrix4d transform = Matrix4d::Identity();
+    for (auto it = transforms.begin(); it != transforms.end(); it++) {
+        transform = (*it)->GetMatrix() * transform;
+    }
+
+    return transform;
+}
+
+Matrix4d Object::GetInverseTransform() {
+    Matrix4d inverse_transform = Matrix4d::Identity();
     for (auto it = transforms.rbegin(); it != transforms.rend(); it++) {
-        (*it)->OpenGLTransform();
+        inverse_transform = (*it)->GetMatrix().inverse() * inverse_transform;
     }
+
+    return inverse_transform;
+}
+
+size_t Object::GeometryHash() {
+    size_t seed = 0;
+
+    for (auto &transform : transforms) {
+        Matrix4d matrix = transform->GetMatrix();
+        for (int i = 0; i < matrix.size(); i++) {
+            HashCombine(seed, matrix(i));
+        }
+    }
+
+    return seed;
 }
 
 /**
@@ -69,8 +103,10 @@ Superquadric::Superquadric() {
 Superquadric::Superquadric(double e0, double e1) {
     exp0 = e0;
     exp1 = e1;
-    patch_u = 15;
-    patch_v = 15;
+    patch_u = LOD_PATCHES[BASE_LOD];
+    patch_v = LOD_PATCHES[BASE_LOD];
+    hull_scale = 1.0;
+    shape = nullptr;
 
     mat = Material();
 }
@@ -83,6 +119,24 @@ const Material& Superquadric::GetMaterial() const {
     return mat;
 }
 
+size_t Superquadric::GeometryHash() {
+    // Intersections point back at the superquadric, so its identity matters too
+    size_t seed = Object::GeometryHash();
+    HashCombine(seed, this);
+    HashCombine(seed, exp0);
+    HashCombine(seed, exp1);
+
+    return seed;
+}
+
+void Superquadric::Flatten(const Matrix4d &parent, InstanceList &instances) {
+    SuperquadricInstance instance;
+    instance.obj = this;
+    instance.transform = parent * GetTransform();
+    instance.inverse = instance.transform.inverse();
+    instances.push_back(instance);
+}
+
 Vector3f Superquadric::GetVertex(float u, float v) {
     float cos_v = pCos(v, exp1);
     float sin_v = pSin(v, exp1);
@@ -115,79 +169,158 @@ Vector3d Superquadric::GetNormal(const Vector3d &vertex) {
     return normal;
 }
 
-void Superquadric::Tesselate(std::vector<Eigen::Vector3f> &vertices, std::vector<Eigen::Vector3f> &normals) {
+void Superquadric::Tesselate(TesselationCache &cache, std::vector<Eigen::Vector3f> &vertices,
+                             std::vector<Eigen::Vector3f> &normals) {
+    shape = &cache.Get(*this);
+
+    // The raytracer works on its own copy of the base level
+    const TesselationLevel &base = shape->levels[BASE_LOD];
     buffer_start = vertices.size();
-    
+    vertices.insert(vertices.end(), cache.GetVertices().begin() + base.buffer_start,
+                    cache.GetVertices().begin() + base.buffer_end);
+    normals.insert(normals.end(), cache.GetNormals().begin() + base.buffer_start,
+                   cache.GetNormals().begin() + base.buffer_end);
+    buffer_end = vertices.size();
+
+    // The hull scale only depends on the exponents too
+    if (shape->hull_scale > 0) {
+        hull_scale = shape->hull_scale;
+        return;
+    }
+
     float half_pi = M_PI / 2;
     float du = 2 * M_PI / patch_u, dv = M_PI / patch_v;
 
-    auto add_vert = [&](float u, float v) mutable {
-        Vector3f vertex = GetVertex(u, v);
+    // Superquadrics are star-shaped around the body origin, so cast rays from there
+    // through a finer sampling of the surface. Wherever a sample lies beyond the
+    // tesselation, the tesselation has to be scaled up by at least that ratio.
+    TriangleBVH bvh = MakeBVH(vertices, 1.0);
+    double max_ratio = 1.0;
+
+    for (int i = 0; i <= HULL_SAMPLES * patch_u; i++) {
+        for (int j = 0; j <= HULL_SAMPLES * patch_v; j++) {
+            Vector3d sample = GetVertex(i * du / HULL_SAMPLES - M_PI, j * dv / HULL_SAMPLES - half_pi).cast<double>();
+            double t = bvh.Intersect(Vector3d::Zero(), sample);
+            if (t < INFINITY) {
+                max_ratio = std::max(max_ratio, 1.0 / t);
+            }
+        }
+    }
+
+    // Leave some room for the samples not catching the exact peak and for Newton's
+    // method accepting points slightly outside the surface
+    hull_scale = max_ratio * HULL_MARGIN;
+    shape->hull_scale = hull_scale;
+}
+
+void Superquadric::TesselateLevel(int patches, std::vector<Eigen::Vector3f> &vertices,
+                                  std::vector<Eigen::Vector3f> &normals) {
+    float half_pi = M_PI / 2;
+    float du = 2 * M_PI / patches, dv = M_PI / patches;
+
+    auto add_vert = [&](const Vector3f &vertex) mutable {
         Vector3f normal = GetNormal(vertex.cast<double>()).cast<float>();
         vertices.push_back(vertex);
         normals.push_back(normal);
     };
 
     float u, v;
+    int i, j;
+
+    // The loops count their steps, since how far rounding error carries the angles
+    // past their last step depends on the number of patches. The layout has to match
+    // GetTriangles and OpenGLRender exactly.
+
+    // Every latitude strip goes through the same longitudes, so their parametric sines
+    // and cosines are only computed once.
+    std::vector<float> cos_u, sin_u;
+    for (i = 0, u = -M_PI; i < patches; i++, u += du) {
+        cos_u.push_back(pCos(u, exp0));
+        sin_u.push_back(pSin(u, exp0));
+    }
 
     // Tesselate the latitude ranges except top and bottom.
     // Uses GL_TRIANGLE_STRIPs
-    for (v = dv - half_pi; v < half_pi - dv; v += dv) {
-        for (u = -M_PI; u <= M_PI; u += du) {
-            add_vert(u, v + dv);
-            add_vert(u, v);
+    for (j = 1, v = dv - half_pi; j < patches - 1; j++, v += dv) {
+        float cos_v0 = pCos(v, exp1), sin_v0 = pSin(v, exp1);
+        float cos_v1 = pCos(v + dv, exp1), sin_v1 = pSin(v + dv, exp1);
+
+        for (i = 0; i <= patches; i++) {
+            // The last step closes the strip where it started
+            int k = i % patches;
+            add_vert(Vector3f(cos_v1 * cos_u[k], cos_v1 * sin_u[k], sin_v1));
+            add_vert(Vector3f(cos_v0 * cos_u[k], cos_v0 * sin_u[k], sin_v0));
         }
-        add_vert(-M_PI, v + dv);
-        add_vert(-M_PI, v);
     }
 
     // Tesselate the bottom ring.
     // Uses GL_TRIANGLE_FAN
-    add_vert(M_PI, -half_pi);
+    add_vert(GetVertex(M_PI, -half_pi));
     v = dv - half_pi;
-    for (u = M_PI; u > -M_PI; u -= du) {
-        add_vert(u, v);
+    for (i = 0, u = M_PI; i < patches; i++, u -= du) {
+        add_vert(GetVertex(u, v));
     }
-    add_vert(-M_PI, v);
+    add_vert(GetVertex(-M_PI, v));
 
     // Tesselate the top ring.
     // Uses GL_TRIANGLE_FAN
-    add_vert(-M_PI, half_pi);
+    add_vert(GetVertex(-M_PI, half_pi));
     v *= -1;
-    for (u = -M_PI; u < M_PI; u += du) {
-        add_vert(u, v);
+    for (i = 0, u = -M_PI; i < patches; i++, u += du) {
+        add_vert(GetVertex(u, v));
     }
-    add_vert(M_PI, v);
-
-    buffer_end = vertices.size();
+    add_vert(GetVertex(M_PI, v));
 }
 
-void Superquadric::OpenGLRender() {
-    glPushMatrix();
-
-    // Apply transforms.
-    Object::OpenGLRender();
-
-    // Render the superquadric.
-    size_t offset = 2 * (patch_u + 1);
-    size_t start = buffer_start;
-
-    mat.SetOpenGLMaterial();
+void Superquadric::GetTriangles(std::vector<Eigen::Vector3i> &triangles) const {
+    // Same layout as Tesselate and OpenGLRender: latitude triangle strips
+    // followed by the bottom and top triangle fans.
+    int offset = 2 * (patch_u + 1);
+    int start = buffer_start;
 
     for (int j = 1; j < patch_v - 1; j++) {
-        glDrawArrays(GL_TRIANGLE_STRIP, start, offset);
+        for (int k = start; k + 2 < start + offset; k++) {
+            triangles.emplace_back(k, k + 1, k + 2);
+        }
         start += offset;
     }
 
     offset = patch_u + 2;
-    glDrawArrays(GL_TRIANGLE_FAN, start, offset);
+    for (int fan = 0; fan < 2; fan++) {
+        for (int k = start + 1; k + 1 < start + offset; k++) {
+            triangles.emplace_back(start, k, k + 1);
+        }
+        start += offset;
+    }
+}
 
-    start += offset;
-    glDrawArrays(GL_TRIANGLE_FAN, start, offset);
+double Superquadric::GetHullScale() const {
+    return hull_scale;
+}
 
-    glPopMatrix();
+TriangleBVH Superquadric::MakeBVH(const std::vector<Vector3f> &vertices, double scale) const {
+    // Only keep this superquadric's vertices, so the triangles are re-indexed from 0
+    std::vector<Vector3d> verts;
+    for (size_t i = buffer_start; i < buffer_end; i++) {
+        verts.push_back(vertices[i].cast<double>() * scale);
+    }
+
+    std::vector<Vector3i> triangles;
+    GetTriangles(triangles);
+    for (auto &triangle : triangles) {
+        triangle -= Vector3i::Constant(buffer_start);
+    }
+
+    return TriangleBVH(verts, triangles);
+}
+
+void Superquadric::BuildGuessBVH(const std::vector<Vector3f> &vertices) {
+    guess_bvh = std::make_shared<TriangleBVH>(MakeBVH(vertices, hull_scale));
 }
 
+void Superquadric::ClearGuessBVH() {
+    guess_bvh.reset();
+}
 
 /**
  * Assembly Implementation
@@ -195,20 +328,26 @@ void Superquadric::OpenGLRender() {
 
 Assembly::Assembly() {}
 
-void Assembly::OpenGLRender() {
-    glPushMatrix();
-    Object::OpenGLRender();
-
+size_t Assembly::GeometryHash() {
+    size_t seed = Object::GeometryHash();
     for (auto &child : children) {
-        child->OpenGLRender();
+        HashCombine(seed, child->GeometryHash());
     }
 
-    glPopMatrix();
+    return seed;
+}
+
+void Assembly::Flatten(const Matrix4d &parent, InstanceList &instances) {
+    Matrix4d transform = parent * GetTransform();
+    for (auto &child : children) {
+        child->Flatten(transform, instances);
+    }
 }
 
-void Assembly::Tesselate(std::vector<Eigen::Vector3f> &vertices, std::vector<Eigen::Vector3f> &normals) {
+void Assembly::Tesselate(TesselationCache &cache, std::vector<Eigen::Vector3f> &vertices,
+                         std::vector<Eigen::Vector3f> &normals) {
     for (auto &child : children) {
-        child->Tesselate(vertices, normals);
+        child->Tesselate(cache, vertices, normals);
     }
 }
 
@@ -255,4 +394,31 @@ Intersection::Intersection() {
 Intersection::Intersection(Ray loc, Superquadric *sq) {
     location = loc;
     obj = sq;
-}
\ No newline at end of file
+}
+
+/**
+ * Ray packet implementation
+ */
+
+RayPacket::RayPacket(const Ray *rays, int lanes): lanes(lanes) {
+    for (int lane = 0; lane < PACKET_SIZE; lane++) {
+        origin.row(lane) = rays[lane].origin.transpose();
+        direction.row(lane) = rays[lane].direction.transpose();
+    }
+}
+
+Ray RayPacket::Get(int lane) const {
+    return { origin.row(lane).transpose(), direction.row(lane).transpose() };
+}
+
+RayPacket RayPacket::Transformed(const Matrix4d &transform) const {
+    Matrix3d linear = transform.block<3, 3>(0, 0);
+
+    RayPacket packet;
+    packet.origin = origin * linear.transpose();
+    packet.origin.rowwise() += transform.block<3, 1>(0, 3).transpose();
+    packet.direction = direction * linear.transpose();
+    packet.lanes = lanes;
+
+    return packet;
+}
@@ -1,19 +1,49 @@
 #ifndef OBJECT_H
 #define OBJECT_H
 
+#include <array>
 #include <memory>
 #include <optional>
 #include <unordered_map>
 #include <vector>
 
 #include <Eigen/Dense>
+#include <Eigen/StdVector>
 
+#include "bvh.h"
 #include "transform.h"
 #include "util.h"
 
 // Some forward declarations...
 class Ray;
 class Intersection;
+class RayPacket;
+class Superquadric;
+class TesselatedShape;
+class TesselationCache;
+
+// Number of rays traced together by the packet path.
+const int PACKET_SIZE = 4;
+
+// Per-lane closest intersections returned by the packet path.
+typedef std::array<std::pair<double, Intersection>, PACKET_SIZE> PacketHit;
+
+// A superquadric leaf of the scene graph, with all of its own and its parents'
+// transforms composed into a single body-to-world transform (and its inverse).
+class SuperquadricInstance {
+public:
+    Superquadric *obj;
+    Eigen::Matrix4d transform;
+    Eigen::Matrix4d inverse;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+typedef std::vector<SuperquadricInstance, Eigen::aligned_allocator<SuperquadricInstance>> InstanceList;
+
+// World-space points tested together by the batched IOTest, one per row.
+typedef Eigen::Matrix<float, Eigen::Dynamic, 3> PointArray;
+typedef Eigen::Array<bool, Eigen::Dynamic, 1> PointMask;
 
 class Material {
 public:
@@ -27,7 +57,7 @@ public:
 
     Material();
 
-    void SetOpenGLMaterial();
+    void SetOpenGLMaterial() const;
 };
 
 class Object {
@@ -38,11 +68,26 @@ public:
     Object(const Object&) = delete;
 
     Object(): transforms(std::vector<std::unique_ptr<Transformation>>()) {};
-    virtual void Tesselate(std::vector<Eigen::Vector3f> &vertices, std::vector<Eigen::Vector3f> &normals) = 0;
-    virtual void OpenGLRender();
+    virtual void Tesselate(TesselationCache &cache, std::vector<Eigen::Vector3f> &vertices,
+                           std::vector<Eigen::Vector3f> &normals) = 0;
     
     virtual bool IOTest(const Eigen::Vector3d &point) = 0;
     virtual std::pair<double, Intersection> ClosestIntersection(const Ray &ray) = 0;
+    virtual PacketHit ClosestIntersection(const RayPacket &packet) = 0;
+
+    Eigen::Matrix4d GetTransform();
+    Eigen::Matrix4d GetInverseTransform();
+
+    // Hash of everything that affects where rays hit this object (not its material).
+    virtual size_t GeometryHash();
+
+    // Appends every superquadric under this object, given the transform of its parent.
+    virtual void Flatten(const Eigen::Matrix4d &parent, InstanceList &instances) = 0;
+
+    // The index-th transform of this object, in the order they were added.
+    Transformation *GetTransformation(size_t index) {
+        return index < transforms.size() ? transforms[index].get() : nullptr;
+    }
 
     template <class T>
     void AddTransform(const T &t) {
@@ -58,23 +103,83 @@ private:
     float patch_v;
     Material mat;
 
-    // Stores the location in the OpenGL vertex and normal buffers.
+    // Stores the location of the base level of detail in the buffers passed to Tesselate.
     size_t buffer_start;
     size_t buffer_end;
+
+    // Levels of detail shared with the other superquadrics with the same exponents, drawn
+    // by OpenGLRender. Null until the superquadric has been tesselated.
+    TesselatedShape *shape;
+
+    // Scale that makes the last tesselation enclose the surface (see GetHullScale).
+    double hull_scale;
+
+    // Optional BVH over the tesselation in body space, used to seed Newton's method.
+    std::shared_ptr<TriangleBVH> guess_bvh;
+
+    // BVH over this superquadric's part of the vertex buffer, scaled about the origin.
+    TriangleBVH MakeBVH(const std::vector<Eigen::Vector3f> &vertices, double scale) const;
 public:
     // Disallow copying.
     Superquadric(const Superquadric&) = delete;
 
     Superquadric();
     Superquadric(double e0, double e1);
-    void Tesselate(std::vector<Eigen::Vector3f> &vertices, std::vector<Eigen::Vector3f> &normals);
-    void OpenGLRender();
+    void Tesselate(TesselationCache &cache, std::vector<Eigen::Vector3f> &vertices,
+                   std::vector<Eigen::Vector3f> &normals);
+
+    // Draws the superquadric from the tesselation cache's buffers, given the modelview
+    // matrix it is drawn with (which should already be loaded). lod_scale is how many pixels
+    // a unit length at unit depth covers on screen, and picks the level of detail.
+    void OpenGLRender(const Eigen::Matrix4f &modelview, float lod_scale);
+
+    // Appends a tesselation with the given number of patches along u and v.
+    void TesselateLevel(int patches, std::vector<Eigen::Vector3f> &vertices, std::vector<Eigen::Vector3f> &normals);
+
+    std::pair<double, double> GetExponents() const {
+        return std::make_pair(exp0, exp1);
+    }
 
     void SetMaterial(const Material &material);
     const Material& GetMaterial() const;
 
     bool IOTest(const Eigen::Vector3d &point);
     std::pair<double, Intersection> ClosestIntersection(const Ray &ray);
+    PacketHit ClosestIntersection(const RayPacket &packet);
+    size_t GeometryHash();
+    void Flatten(const Eigen::Matrix4d &parent, InstanceList &instances);
+
+    // Batched IOTest: sets inside(i) for every point that is inside this superquadric,
+    // given its world-to-body transform. Points already marked inside are left alone.
+    void IOTest(const PointArray &points, const Eigen::Matrix4d &inverse, PointMask &inside) const;
+
+    // Closest intersections with this superquadric under a given body-to-world transform
+    // (and its inverse) rather than its own transforms, e.g. for a SuperquadricInstance.
+    std::pair<double, Intersection> Intersect(const Ray &ray, const Eigen::Matrix4d &transform,
+                                              const Eigen::Matrix4d &inverse);
+    PacketHit Intersect(const RayPacket &packet, const Eigen::Matrix4d &transform, const Eigen::Matrix4d &inverse);
+
+    // Where a ray that starts inside this superquadric leaves it, with the outward normal.
+    std::pair<double, Intersection> ExitIntersection(const Ray &ray, const Eigen::Matrix4d &transform,
+                                                     const Eigen::Matrix4d &inverse);
+
+    // Newton's method on just this superquadric, starting from a guess t_guess that
+    // should already be close to the surface. transform is the body-to-world transform.
+    std::pair<double, Intersection> RefineIntersection(const Ray &ray, double t_guess,
+                                                       const Eigen::Matrix4d &transform, int max_iters);
+
+    // Appends the triangles of the last tesselation, as indices into the vertex buffer.
+    void GetTriangles(std::vector<Eigen::Vector3i> &triangles) const;
+
+    // Factor by which the tesselation should be scaled about the body origin to enclose
+    // the surface, instead of being inscribed in it. Measured by Tesselate.
+    double GetHullScale() const;
+
+    // Builds a BVH over the last tesselation (scaled up by GetHullScale) whose first hit
+    // seeds Newton's method in place of the bounding sphere. vertices is the buffer
+    // that was passed to Tesselate.
+    void BuildGuessBVH(const std::vector<Eigen::Vector3f> &vertices);
+    void ClearGuessBVH();
 
     Eigen::Vector3f GetVertex(float u, float v);
     Eigen::Vector3d GetNormal(const Eigen::Vector3d &vertex);
@@ -88,11 +193,14 @@ public:
     Assembly(const Assembly&) = delete;
 
     Assembly();
-    void OpenGLRender();
-    void Tesselate(std::vector<Eigen::Vector3f> &vertices, std::vector<Eigen::Vector3f> &normals);
+    void Tesselate(TesselationCache &cache, std::vector<Eigen::Vector3f> &vertices,
+                   std::vector<Eigen::Vector3f> &normals);
 
     bool IOTest(const Eigen::Vector3d &point);
     std::pair<double, Intersection> ClosestIntersection(const Ray &ray);
+    PacketHit ClosestIntersection(const RayPacket &packet);
+    size_t GeometryHash();
+    void Flatten(const Eigen::Matrix4d &parent, InstanceList &instances);
 
     void AddChild(std::shared_ptr<Object> obj) {
         children.push_back(obj);
@@ -123,5 +231,29 @@ public:
     Intersection(Ray location, Superquadric *obj);
 };
 
+typedef Eigen::Array<double, PACKET_SIZE, 1> PacketArray;
+typedef Eigen::Array<bool, PACKET_SIZE, 1> PacketMask;
+
+// A bundle of PACKET_SIZE rays stored structure-of-arrays style, so column k
+// holds component k of every lane and can be processed with SIMD.
+class RayPacket {
+public:
+    Eigen::Matrix<double, PACKET_SIZE, 3> origin;
+    Eigen::Matrix<double, PACKET_SIZE, 3> direction;
+
+    // Number of lanes holding rays that are actually being traced. Partly filled packets
+    // repeat their last ray in the remaining lanes, which are left out of the RayStats
+    // counters.
+    int lanes;
+
+    RayPacket(): lanes(PACKET_SIZE) {};
+    RayPacket(const Ray *rays, int lanes = PACKET_SIZE);
+
+    Ray Get(int lane) const;
+    RayPacket Transformed(const Eigen::Matrix4d &transform) const;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
 
 #endif // OBJECT_H
\ No newline at end of file
@@ -0,0 +1,128 @@
+#include "offscreen.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "glinclude.h"
+#include "image.h"
+
+HeadlessOptions ParseHeadlessOptions(int &argc, char *argv[]) {
+    HeadlessOptions options;
+
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--headless") {
+            options.enabled = true;
+            if (i + 1 < argc)
+                options.frames = std::atoi(argv[i + 1]);
+            if (i + 2 < argc)
+                options.prefix = argv[i + 2];
+
+            // Everything from --headless on belongs to it.
+            argc = i;
+            break;
+        }
+    }
+
+    return options;
+}
+
+bool CreateOffscreenContext(int width, int height) {
+    // Mesa's surfaceless platform doesn't need a display server at all, so prefer it
+    // over the default display when it is there.
+    EGLDisplay display = EGL_NO_DISPLAY;
+    auto get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display)
+        display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+        return false;
+
+    EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint config_count;
+    if (!eglChooseConfig(display, config_attributes, &config, 1, &config_count) || config_count == 0)
+        return false;
+
+    // Drivers without surfaceless contexts need a surface to make the context current
+    // with, but everything is drawn into the framebuffer object, so 1x1 is enough.
+    EGLint surface_attributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    EGLSurface surface = eglCreatePbufferSurface(display, config, surface_attributes);
+
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context))
+        return false;
+
+    GLuint framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        return false;
+
+    glViewport(0, 0, width, height);
+    return true;
+}
+
+void RenderOffscreen(const HeadlessOptions &options, int width, int height,
+                     const std::function<void(int)> &draw_frame) {
+    // GPU timestamps from before and after each frame.
+    GLuint timestamps[2];
+    glGenQueries(2, timestamps);
+
+    // Image rows start at the bottom, same as OpenGL, so the pixels can be read straight in.
+    Image image(width, height);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    double total_cpu_ms = 0.0, total_gpu_ms = 0.0;
+    for (int frame = 0; frame < options.frames; frame++) {
+        auto start = std::chrono::steady_clock::now();
+        glQueryCounter(timestamps[0], GL_TIMESTAMP);
+        draw_frame(frame);
+        glQueryCounter(timestamps[1], GL_TIMESTAMP);
+        double cpu_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        // Reading the frame back waits for the GPU to finish it.
+        glReadPixels(0, 0, width, height, GL_RGB, GL_FLOAT, image.pixels.data());
+        GLuint64 gpu_start, gpu_end;
+        glGetQueryObjectui64v(timestamps[0], GL_QUERY_RESULT, &gpu_start);
+        glGetQueryObjectui64v(timestamps[1], GL_QUERY_RESULT, &gpu_end);
+        double gpu_ms = (gpu_end - gpu_start) / 1.0e6;
+
+        char path[1024];
+        std::snprintf(path, sizeof(path), "%s_%04d.png", options.prefix.c_str(), frame);
+        if (!image.SaveImage(path))
+            std::cerr << "Error writing " << path << "\n";
+
+        std::printf("frame %d: cpu %.3f ms, gpu %.3f ms\n", frame, cpu_ms, gpu_ms);
+        total_cpu_ms += cpu_ms;
+        total_gpu_ms += gpu_ms;
+    }
+
+    if (options.frames > 0) {
+        std::printf("average over %d frames: cpu %.3f ms, gpu %.3f ms\n", options.frames,
+                    total_cpu_ms / options.frames, total_gpu_ms / options.frames);
+    }
+
+    glDeleteQueries(2, timestamps);
+}
@@ -0,0 +1,34 @@
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <functional>
+#include <string>
+
+// Settings of the renderer's --headless mode, which draws the OpenGL scene into an
+// offscreen framebuffer instead of a GLUT window. Used to benchmark the OpenGL path
+// and to run it on machines without a display.
+struct HeadlessOptions {
+    bool enabled;
+
+    // Number of frames to draw, and the prefix of the PNGs they are written to.
+    int frames;
+    std::string prefix;
+
+    HeadlessOptions(): enabled(false), frames(60), prefix("frame") {};
+};
+
+// Looks for "--headless [frames] [prefix]" after the renderer's usual arguments, and
+// removes it from the command line if it is there.
+HeadlessOptions ParseHeadlessOptions(int &argc, char *argv[]);
+
+// Makes an EGL context that isn't tied to a window current, with a framebuffer object
+// of the given size bound to draw into. Returns false if there is no such context.
+bool CreateOffscreenContext(int width, int height);
+
+// Calls draw_frame for each frame, timing it on the CPU and (with timestamp queries) on
+// the GPU, then reads it back and writes it to <prefix>_<frame>.png. Prints the timings
+// of each frame and their averages.
+void RenderOffscreen(const HeadlessOptions &options, int width, int height,
+                     const std::function<void(int)> &draw_frame);
+
+#endif // OFFSCREEN_H
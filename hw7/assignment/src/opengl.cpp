@@ -0,0 +1,317 @@
+#include "camera.h"
+#include "light.h"
+#include "object.h"
+#include "scene.h"
+#include "tesselation.h"
+#include "transform.h"
+#include "util.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <iostream>
+
+#include "glinclude.h"
+
+// Everything that talks to OpenGL lives in this file, so that the rest of the
+// sources can be built into the headless raytracer without GL or GLUT.
+
+using namespace Eigen;
+
+const float iotest_min = -10.0;
+const float iotest_max = 10.0;
+const float iotest_inc = 0.5;
+
+/**
+ * Transformation OpenGL Implementation
+ */
+
+void Rotate::OpenGLTransform() const {
+    glRotatef(angle, axis_x, axis_y, axis_z);
+}
+
+void Translate::OpenGLTransform() const {
+    glTranslatef(delta_x, delta_y, delta_z);
+}
+
+void Scale::OpenGLTransform() const {
+    glScalef(scale_x, scale_y, scale_z);
+}
+
+/**
+ * Camera OpenGL Implementation
+ */
+
+void Frustum::OpenGLSetMatrix() const {
+    gluPerspective(fov, aspect_ratio, near, far);
+}
+
+void Camera::OpenGLSetPosition() const {
+    translate.OpenGLTransform();
+    rotate.OpenGLTransform();
+}
+
+/**
+ * Light OpenGL Implementation
+ */
+
+void Light::OpenGLInit(int light_id) {
+    glEnable(light_id);
+
+    glLightfv(light_id, GL_AMBIENT, (float *) &color);
+    glLightfv(light_id, GL_DIFFUSE, (float *) &color);
+    glLightfv(light_id, GL_SPECULAR, (float *) &color);
+
+    glLightf(light_id, GL_QUADRATIC_ATTENUATION, attenuation);
+}
+
+void Light::OpenGLRender(int light_id) {
+    Eigen::Vector4f pos = position.cast<float>();
+    glLightfv(light_id, GL_POSITION, pos.data());
+
+    float max_color = std::max(std::max(color.r, color.g), color.b);
+    float lcolor[3] = {
+        color.r / max_color,
+        color.g / max_color,
+        color.b / max_color
+    };
+
+    glPointSize(8.0);
+    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, lcolor);
+    glEnable(GL_POINT_SMOOTH);
+
+    glBegin(GL_POINTS);
+    glVertex4dv(position.data());
+    glEnd();
+}
+
+/**
+ * Arcball OpenGL Implementation
+ */
+
+void Arcball::Apply() {
+    Quaternionf rotation = enabled ? (curr * base).normalized() : base;
+
+    float s = rotation.w();
+    float theta = 2 * acos(s) * 180 / M_PI;
+    Vector3f axis = rotation.coeffs().head<3>() / sqrt(1 - s * s);
+
+    glRotatef(theta, axis.x(), axis.y(), axis.z());
+}
+
+/**
+ * Object OpenGL Implementation
+ */
+
+void Material::SetOpenGLMaterial() const {
+    glMaterialfv(GL_FRONT, GL_AMBIENT, (const float *) &ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, (const float *) &diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, (const float *) &specular);
+    glMaterialf(GL_FRONT, GL_SHININESS, shininess);
+}
+
+// Everything SetOpenGLMaterial sends to OpenGL. Sorting the draw list by it puts
+// superquadrics with equal materials next to one another.
+static std::array<float, 10> MaterialKey(const Material &mat) {
+    return {{ mat.ambient.r, mat.ambient.g, mat.ambient.b, mat.diffuse.r, mat.diffuse.g, mat.diffuse.b,
+              mat.specular.r, mat.specular.g, mat.specular.b, mat.shininess }};
+}
+
+// Radius in pixels of a body-space sphere around the origin under the given modelview
+// matrix, or infinity if the camera is inside it.
+static float ProjectedRadius(float radius, const Matrix4f &modelview, float lod_scale) {
+    // The sphere is only scaled by as much as the longest axis is
+    float scale = modelview.block<3, 3>(0, 0).colwise().norm().maxCoeff();
+    float world_radius = radius * scale;
+    float depth = -modelview(2, 3);
+    if (depth <= world_radius) {
+        return INFINITY;
+    }
+
+    return world_radius * lod_scale / depth;
+}
+
+void Superquadric::OpenGLRender(const Matrix4f &modelview, float lod_scale) {
+    if (!shape) {
+        return;
+    }
+
+    // Render the superquadric, at the level of detail its size on screen calls for.
+    int lod = TesselationCache::SelectLevel(ProjectedRadius(shape->radius, modelview, lod_scale));
+    const TesselationLevel &level = shape->levels[lod];
+
+    glMultiDrawArrays(GL_TRIANGLE_STRIP, level.strip_first.data(), level.strip_count.data(),
+                      level.strip_first.size());
+    glMultiDrawArrays(GL_TRIANGLE_FAN, level.fan_first.data(), level.fan_count.data(), level.fan_first.size());
+}
+
+/**
+ * Scene OpenGL Implementation
+ */
+
+void Scene::ReloadLighting() {
+    for (unsigned int i = 0; i < lights.size(); i++) {
+        int light = GL_LIGHT0 + i;
+
+        lights[i].OpenGLInit(light);
+        lights[i].OpenGLRender(light);
+    }
+}
+
+void Scene::OpenGLSetup() {
+    // Setup lights.
+    glEnable(GL_LIGHTING);
+    ReloadLighting();
+
+    glGenVertexArrays(1, &buffer_array);
+    glBindVertexArray(buffer_array);
+    glGenBuffers(2, buffer_objects);
+
+    // The attribute pointers only have to be set once, the vertex array remembers them
+    for (int i = 0; i < 2; i++) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffer_objects[i]);
+        glVertexAttribPointer(i, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        glEnableVertexAttribArray(i);
+    }
+
+    ReloadObjects();
+}
+
+void Scene::UploadBuffers() {
+    const std::vector<Eigen::Vector3f> *buffers[2] = { &tesselations.GetVertices(), &tesselations.GetNormals() };
+    size_t size = buffers[0]->size();
+    if (size == buffer_uploaded) {
+        return;
+    }
+
+    // When the cache has outgrown the buffers, reallocate them at (at least) twice the size,
+    // so the whole cache only has to be sent again a logarithmic number of times
+    size_t first = buffer_uploaded;
+    size_t capacity = buffer_capacity;
+    if (size > buffer_capacity) {
+        first = 0;
+        capacity = std::max(size, 2 * buffer_capacity);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        const std::vector<Eigen::Vector3f> &buffer = *buffers[i];
+        glBindBuffer(GL_ARRAY_BUFFER, buffer_objects[i]);
+
+        if (capacity != buffer_capacity) {
+            glBufferData(GL_ARRAY_BUFFER, 3 * sizeof(float) * capacity, NULL, GL_STATIC_DRAW);
+        }
+
+        // Fresh storage gets the whole cache, otherwise only the vertices added since the last
+        // upload are sent
+        glBufferSubData(GL_ARRAY_BUFFER, 3 * sizeof(float) * first, 3 * sizeof(float) * (size - first),
+                        buffer.data() + first);
+    }
+
+    buffer_capacity = capacity;
+    buffer_uploaded = size;
+}
+
+void Scene::OpenGLRender() {
+    // Setup lights.
+    for (unsigned int i = 0; i < lights.size(); i++) {
+        int light = GL_LIGHT0 + i;
+
+        lights[i].OpenGLRender(light);
+    }
+
+    glBindVertexArray(buffer_array);
+    UploadBuffers();
+
+    // Only flatten the scene graph again when something has moved
+    size_t hash = GeometryHash();
+    if (hash != draw_list_hash) {
+        draw_list.clear();
+        for (auto &obj : root_objects) {
+            obj->Flatten(Eigen::Matrix4d::Identity(), draw_list);
+        }
+
+        std::stable_sort(draw_list.begin(), draw_list.end(),
+                         [](const SuperquadricInstance &a, const SuperquadricInstance &b) {
+            return MaterialKey(a.obj->GetMaterial()) < MaterialKey(b.obj->GetMaterial());
+        });
+        draw_list_hash = hash;
+    }
+
+    // Pixels covered by a unit length at unit depth, from the projection's vertical focal
+    // length and the viewport's height
+    float projection[16];
+    int viewport[4];
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    float lod_scale = projection[5] * viewport[3] / 2;
+
+    Eigen::Matrix4f view;
+    glGetFloatv(GL_MODELVIEW_MATRIX, view.data());
+    glPushMatrix();
+
+    // Each superquadric's modelview matrix replaces the last one outright, and the
+    // material only changes between runs of superquadrics that share one
+    const Material *material = nullptr;
+    for (auto &instance : draw_list) {
+        Eigen::Matrix4f modelview = view * instance.transform.cast<float>();
+        glLoadMatrixf(modelview.data());
+
+        const Material &mat = instance.obj->GetMaterial();
+        if (!material || MaterialKey(*material) != MaterialKey(mat)) {
+            mat.SetOpenGLMaterial();
+            material = &mat;
+        }
+
+        instance.obj->OpenGLRender(modelview, lod_scale);
+    }
+
+    glPopMatrix();
+}
+
+void Scene::IOTest() {
+    // Only re-test the grid when something has moved
+    size_t hash = GeometryHash();
+    if (iotest_volume.GetResolution() == 0 || hash != iotest_hash) {
+        Bounds bounds;
+        bounds.Extend(Eigen::Vector3d::Constant(iotest_min));
+        bounds.Extend(Eigen::Vector3d::Constant(iotest_max));
+
+        iotest_volume = Voxelize(bounds, std::round((iotest_max - iotest_min) / iotest_inc) + 1);
+        iotest_hash = hash;
+    }
+
+    glPointSize(6.0);
+    glEnable(GL_POINT_SMOOTH);
+
+    float inside_color[3] = { 0.0, 0.6, 1.0 };
+
+    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, inside_color);
+    glBegin(GL_POINTS);
+
+    iotest_volume.ForEach([&](int i, int j, int k) {
+        glVertex3dv(iotest_volume.GetPoint(i, j, k).data());
+    });
+
+    glEnd();
+}
+
+void Scene::DrawIntersectTest() {
+    // Drawn while a raytrace may be running on another thread, so this doesn't use the BVH
+    Ray incoming = Ray { Eigen::Vector3d(0, 0, -5), Eigen::Vector3d(0, 0, 1) };
+    auto closest = SceneGraphIntersection(incoming);
+    Ray intersection = closest.second.location;
+
+    float outside_color[3] = { 1.0, 1.0, 1.0 };
+
+    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, outside_color);
+    glLineWidth(2.0);
+    glBegin(GL_LINES);
+    glVertex3dv(incoming.origin.data());
+    glVertex3dv(incoming.At(1.0).data());
+    glEnd();
+
+    glBegin(GL_LINES);
+    glVertex3dv(intersection.origin.data());
+    glVertex3dv(intersection.At(1.0).data());
+    glEnd();
+}
@@ -3,8 +3,11 @@
 
 #include <yaml-cpp/yaml.h>
 
+#include <algorithm>
+
 #include <Eigen/Dense>
 
+#include "animation.h"
 #include "light.h"
 #include "object.h"
 #include "scene.h"
@@ -155,6 +158,8 @@ struct convert<Material> {
         node["diffuse"] = rhs.diffuse;
         node["specular"] = rhs.specular;
         node["shininess"] = rhs.shininess;
+        node["reflected"] = rhs.reflected;
+        node["refracted"] = rhs.refracted;
 
         return node;
     } 
@@ -169,6 +174,14 @@ struct convert<Material> {
         rhs.specular = node["specular"].as<Color>();
         rhs.shininess = node["shininess"].as<float>();
 
+        // Optional, since most materials are neither mirrors nor transparent
+        if (node["reflected"]) {
+            rhs.reflected = node["reflected"].as<float>();
+        }
+        if (node["refracted"]) {
+            rhs.refracted = node["refracted"].as<float>();
+        }
+
         return true;
     }
 };
@@ -247,6 +260,91 @@ struct convert<Camera> {
     }
 };
 
+template <>
+struct convert<Animation::Key> {
+    static Node encode(const Animation::Key &rhs) {
+        Node node;
+        node["frame"] = rhs.frame;
+        node["value"] = rhs.value;
+
+        return node;
+    }
+
+    static bool decode(const Node &node, Animation::Key &rhs) {
+        if (!node.IsMap()) {
+            return false;
+        }
+
+        rhs.frame = node["frame"].as<int>();
+
+        // Same field names as the transforms being keyed
+        if (node["angle"]) {
+            rhs.value = Eigen::Vector3d(node["angle"].as<double>(), 0, 0);
+        } else if (node["delta"]) {
+            rhs.value = node["delta"].as<Eigen::Vector3d>();
+        } else if (node["scale"]) {
+            rhs.value = node["scale"].as<Eigen::Vector3d>();
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+};
+
+template <>
+struct convert<Animation::Track> {
+    static Node encode(const Animation::Track &rhs) {
+        Node node;
+        node["object"] = rhs.object;
+        node["transform"] = rhs.transform;
+        for (auto &key : rhs.keys) {
+            node["keys"].push_back(key);
+        }
+
+        return node;
+    }
+
+    static bool decode(const Node &node, Animation::Track &rhs) {
+        if (!node.IsMap() || !node["keys"].IsSequence()) {
+            return false;
+        }
+
+        rhs.object = node["object"].as<std::string>();
+        rhs.transform = node["transform"].as<int>();
+        rhs.keys = node["keys"].as<std::vector<Animation::Key>>();
+
+        std::sort(rhs.keys.begin(), rhs.keys.end(),
+                  [](const Animation::Key &a, const Animation::Key &b) { return a.frame < b.frame; });
+
+        return true;
+    }
+};
+
+template <>
+struct convert<Animation> {
+    static Node encode(const Animation &rhs) {
+        Node node;
+        node["frames"] = rhs.frames;
+        for (auto &track : rhs.tracks) {
+            node["tracks"].push_back(track);
+        }
+
+        return node;
+    }
+
+    static bool decode(const Node &node, Animation &rhs) {
+        if (!node.IsMap() || !node["tracks"].IsSequence()) {
+            return false;
+        }
+
+        rhs.frames = node["frames"].as<int>();
+        rhs.tracks = node["tracks"].as<std::vector<Animation::Track>>();
+
+        return true;
+    }
+};
+
 template<>
 struct convert<Scene> {
     static Node encode(const Scene &scene) {
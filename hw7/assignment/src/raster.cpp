@@ -0,0 +1,57 @@
+#include "raster.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace Eigen;
+
+VisibilityBuffer::VisibilityBuffer(int width, int height) {
+    xres = width;
+    yres = height;
+    ids = std::vector<int>(width * height, -1);
+    depths = std::vector<float>(width * height, INFINITY);
+    other_depths = std::vector<float>(width * height, INFINITY);
+}
+
+void VisibilityBuffer::Rasterize(const Vector3d &a, const Vector3d &b, const Vector3d &c, int id) {
+    // Twice the signed area of the triangle, used to normalize the barycentrics
+    double area = (b(0) - a(0)) * (c(1) - a(1)) - (c(0) - a(0)) * (b(1) - a(1));
+    if (area == 0.0) {
+        return;
+    }
+
+    // Clamp the bounding box of the triangle to the image
+    int x_min = std::max(0, (int) ceil(std::min({ a(0), b(0), c(0) })));
+    int x_max = std::min(xres - 1, (int) floor(std::max({ a(0), b(0), c(0) })));
+    int y_min = std::max(0, (int) ceil(std::min({ a(1), b(1), c(1) })));
+    int y_max = std::min(yres - 1, (int) floor(std::max({ a(1), b(1), c(1) })));
+
+    for (int y = y_min; y <= y_max; y++) {
+        for (int x = x_min; x <= x_max; x++) {
+            // Barycentric coordinates of the pixel, which works for either winding
+            double alpha = ((b(0) - x) * (c(1) - y) - (c(0) - x) * (b(1) - y)) / area;
+            double beta = ((c(0) - x) * (a(1) - y) - (a(0) - x) * (c(1) - y)) / area;
+            double gamma = 1.0 - alpha - beta;
+
+            if (alpha < 0 || beta < 0 || gamma < 0) {
+                continue;
+            }
+
+            // 1/t is linear in screen space, t itself isn't
+            double t = 1.0 / (alpha / a(2) + beta / b(2) + gamma / c(2));
+
+            int idx = x + xres * y;
+            if (id == ids[idx]) {
+                depths[idx] = std::min(depths[idx], (float) t);
+            } else if (t < depths[idx]) {
+                // The old closest object is now an "other" one. other_depths might have
+                // come from this object, in which case it's just lower than it has to be.
+                other_depths[idx] = std::min(other_depths[idx], depths[idx]);
+                depths[idx] = t;
+                ids[idx] = id;
+            } else {
+                other_depths[idx] = std::min(other_depths[idx], (float) t);
+            }
+        }
+    }
+}
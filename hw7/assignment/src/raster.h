@@ -0,0 +1,41 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <vector>
+
+#include <Eigen/Dense>
+
+// Object-ID and depth buffers filled by rasterizing triangles on the CPU. Depths
+// are stored as the primary-ray parameter t, so they can seed intersection tests.
+class VisibilityBuffer {
+public:
+    int xres, yres;
+
+    // Index of the closest triangle's object at each pixel, or -1 for background.
+    std::vector<int> ids;
+    std::vector<float> depths;
+
+    // Depth of the closest triangle from any other object at each pixel. This may be
+    // an underestimate, but never an overestimate.
+    std::vector<float> other_depths;
+
+    VisibilityBuffer(int width, int height);
+
+    // Rasterizes a triangle whose vertices are given as (pixel x, pixel y, t). Pixels
+    // are sampled at their integer coordinates, same as the first primary-ray sample.
+    void Rasterize(const Eigen::Vector3d &a, const Eigen::Vector3d &b, const Eigen::Vector3d &c, int id);
+
+    int Id(int x, int y) const {
+        return ids[x + xres * y];
+    }
+
+    float Depth(int x, int y) const {
+        return depths[x + xres * y];
+    }
+
+    float OtherDepth(int x, int y) const {
+        return other_depths[x + xres * y];
+    }
+};
+
+#endif // RASTER_H
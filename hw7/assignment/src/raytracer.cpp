@@ -0,0 +1,167 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "scene.h"
+
+#include "parsing.h"
+
+// Headless raytracer entry point. Unlike renderer.cpp, this doesn't need a display
+// (or link against OpenGL/GLUT), so it can be used for batch renders.
+
+// Raytracer Usage String
+const std::string usage = "Usage: raytracer <scene_file.yaml> [--width <n>] [--height <n>] [--threads <n>] "
+                          "[--spp <n>] [--budget <seconds>] [--out <image.png>] [--hybrid] [--mesh-guess] [--animate] "
+                          "[--ray-budget <n>] [--stats <stats.json>] [--heatmap <image.png>] "
+                          "[--voxelize <resolution>]";
+
+// Output file for one frame of an animation, e.g. rt.png -> rt_0007.png
+std::string FrameOutput(const std::string &output, int frame) {
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%04d", frame);
+
+    size_t dot = output.rfind('.');
+    if (dot == std::string::npos) {
+        return output + suffix;
+    }
+
+    return output.substr(0, dot) + suffix + output.substr(dot);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << usage << "\n";
+        exit(1);
+    }
+
+    RaytraceOptions opts;
+    bool animate = false;
+    int voxelize = 0;
+    bool out_set = false;
+
+    // Parse the flags following the scene file.
+    try {
+        for (int i = 2; i < argc; i++) {
+            std::string flag = argv[i];
+
+            // Flags without a value
+            if (flag == "--hybrid") {
+                opts.hybrid = true;
+                continue;
+            } else if (flag == "--mesh-guess") {
+                opts.mesh_guess = true;
+                continue;
+            } else if (flag == "--animate") {
+                animate = true;
+                continue;
+            }
+
+            if (i + 1 >= argc) {
+                throw std::invalid_argument(flag);
+            }
+            std::string value = argv[++i];
+
+            if (flag == "--width") {
+                opts.width = std::stoi(value);
+            } else if (flag == "--height") {
+                opts.height = std::stoi(value);
+            } else if (flag == "--threads") {
+                opts.threads = std::stoi(value);
+            } else if (flag == "--spp") {
+                opts.aa_max_samples = std::stoi(value);
+            } else if (flag == "--budget") {
+                opts.time_budget = std::stod(value);
+            } else if (flag == "--out") {
+                opts.output = value;
+                out_set = true;
+            } else if (flag == "--ray-budget") {
+                opts.ray_budget = std::stoi(value);
+            } else if (flag == "--stats") {
+                opts.stats_output = value;
+            } else if (flag == "--heatmap") {
+                opts.heatmap = value;
+            } else if (flag == "--voxelize") {
+                voxelize = std::stoi(value);
+            } else {
+                throw std::invalid_argument(flag);
+            }
+        }
+    } catch (std::exception &e) {
+        std::cerr << usage << "\n";
+        exit(1);
+    }
+
+    if (opts.width <= 0 || opts.height <= 0 || opts.threads <= 0 || opts.aa_max_samples <= 0 || opts.ray_budget < 0 ||
+        voxelize < 0) {
+        std::cerr << usage << "\n";
+        exit(1);
+    }
+
+    // Nobody is watching a preview, so skip the coarse progressive stages.
+    opts.progressive = false;
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    YAML::Node scene_file = YAML::LoadFile(argv[1]);
+    Scene scene = scene_file.as<Scene>();
+    scene.SetOptions(opts);
+
+    Animation animation;
+    if (animate) {
+        if (!scene_file["animation"]) {
+            std::cerr << argv[1] << " has no animation\n";
+            exit(1);
+        }
+        animation = scene_file["animation"].as<Animation>();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::cout << "Loaded " << argv[1] << " in " << seconds << "s\n";
+
+    if (voxelize > 0) {
+        std::string output = out_set ? opts.output : "volume.occ";
+        OccupancyVolume volume = scene.Voxelize(scene.GetBounds(), voxelize);
+
+        if (!volume.Export(output)) {
+            std::cerr << "Couldn't write " << output << "\n";
+            exit(1);
+        }
+
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        std::cout << "Wrote " << output << " (" << volume.BrickCount() << " bricks) in " << seconds << "s total\n";
+        return 0;
+    }
+
+    if (!animate) {
+        scene.Raytrace();
+
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        std::cout << "Wrote " << opts.output << " (" << opts.width << "x" << opts.height << ") in "
+                  << seconds << "s total\n";
+        return 0;
+    }
+
+    // Each frame only changes transforms, so Raytrace refits the BVH rather than rebuilding it
+    for (int frame = 0; frame < animation.frames; frame++) {
+        if (!animation.Apply(scene, frame)) {
+            exit(1);
+        }
+
+        RaytraceOptions frame_opts = opts;
+        frame_opts.output = FrameOutput(opts.output, frame);
+        if (!opts.stats_output.empty()) {
+            frame_opts.stats_output = FrameOutput(opts.stats_output, frame);
+        }
+        if (!opts.heatmap.empty()) {
+            frame_opts.heatmap = FrameOutput(opts.heatmap, frame);
+        }
+        scene.SetOptions(frame_opts);
+
+        scene.Raytrace();
+    }
+
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::cout << "Wrote " << animation.frames << " frames (" << opts.width << "x" << opts.height << ") in "
+              << seconds << "s total\n";
+}
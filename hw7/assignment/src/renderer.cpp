@@ -3,36 +3,50 @@
 #include <string>
 #include <thread>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include <Eigen/Dense>
 
 #include "glinclude.h"
+#include "image.h"
 #include "light.h"
 #include "object.h"
+#include "offscreen.h"
 #include "scene.h"
+#include "shader.h"
 #include "transform.h"
 #include "util.h"
 
 #include "parsing.h"
 
 // Renderer Usage String
-const std::string usage = "Usage: renderer <xres> <yres> [scene_file.yaml]";
+const std::string usage = "Usage: renderer <xres> <yres> [scene_file.yaml] [time_budget] [--headless [frames] [prefix]]";
 
 int xres;
 int yres;
 
 Scene scene;
 
-GLenum shader;
+ShaderProgram shader("shaders/vertex.glsl", "shaders/fragment.glsl");
 
 bool wireframe = false;
 bool io_test = false;
 bool intersect_test = false;
 bool scene_cam = false;
 
+// Latest image from the raytracer, which is shown instead of the OpenGL scene
+// while show_preview is on. Written by the raytrace thread.
+Image preview;
+std::mutex preview_mutex;
+bool preview_dirty = false;
+bool show_preview = false;
+
 Arcball arcball;
 
+// Draws frames offscreen instead of in a window, see offscreen.h.
+HeadlessOptions headless;
+
 /**
  * Handles GLUT window reshape event.
  */
@@ -42,9 +56,47 @@ void reshape(int width, int height) {
 
     glViewport(0, 0, width, height);
     arcball.SetRes(width, height);
+
+    // Raytrace at the window resolution so the preview fills the window.
+    RaytraceOptions opts = scene.GetOptions();
+    opts.width = width;
+    opts.height = height;
+    scene.SetOptions(opts);
+
     glutPostRedisplay();
 }
 
+/**
+ * Called by the raytrace thread whenever a progressive stage finishes.
+ */
+void update_preview(const Image &img) {
+    std::lock_guard<std::mutex> lock(preview_mutex);
+    preview = img;
+    preview_dirty = true;
+}
+
+/**
+ * Periodically redraws the window while the raytrace preview is changing, or after
+ * the shaders were rebuilt because their files were edited.
+ */
+void refresh_preview(int value) {
+    {
+        std::lock_guard<std::mutex> lock(preview_mutex);
+        if (show_preview && preview_dirty) {
+            preview_dirty = false;
+            glutPostRedisplay();
+        }
+    }
+
+    // Switch to the rebuilt shaders as soon as their files are edited.
+    if (shader.ReloadIfChanged()) {
+        glUseProgram(shader.Program());
+        glutPostRedisplay();
+    }
+
+    glutTimerFunc(100, refresh_preview, 0);
+}
+
 void init() {
     // Set up backface culling and depth buffering.
     glEnable(GL_DEPTH_TEST);
@@ -61,84 +113,12 @@ void init() {
 }
 
 void shader_setup() {
-    std::string vert_source, frag_source;
-
-    std::ifstream vert_file("shaders/vertex.glsl");
-    if (!vert_file)
-        std::cerr << "Error opening vertex shader program\n";
-
-    std::ifstream frag_file("shaders/fragment.glsl");
-    if (!frag_file)
-        std::cerr << "Error opening fragment shader program\n";
-
-    getline(vert_file, vert_source, '\0');
-    const char *vert_shader_source = vert_source.c_str();
-
-    getline(frag_file, frag_source, '\0');
-    const char *frag_shader_source = frag_source.c_str();
-
-    char buf[1024];
-    GLsizei blah;
-
-    // Initialize shaders
-    GLenum vertex, fragment;
-
-    shader = glCreateProgram();
-
-    vertex = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex, 1, &vert_shader_source, NULL);
-    glCompileShader(vertex);
-
-    GLint isCompiled = 0;
-    glGetShaderiv(vertex, GL_COMPILE_STATUS, &isCompiled);
-    if (isCompiled == GL_FALSE) {
-        GLint maxLength = 0;
-        glGetShaderiv(vertex, GL_INFO_LOG_LENGTH, &maxLength);
-
-        // The maxLength includes the NULL character
-        std::vector<GLchar> errorLog(maxLength);
-        glGetShaderInfoLog(vertex, maxLength, &maxLength, &errorLog[0]);
-
-        // Provide the infolog in whatever manor you deem best.
-        // Exit with failure.
-        for (auto &entry : errorLog)
-            std::cout << entry;
-        glDeleteShader(vertex); // Don't leak the shader.
-        return;
-    }
-
-    fragment = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment, 1, &frag_shader_source, NULL);
-    glCompileShader(fragment);
-
-    glGetShaderiv(fragment, GL_COMPILE_STATUS, &isCompiled);
-    if (isCompiled == GL_FALSE) {
-        GLint maxLength = 0;
-        glGetShaderiv(fragment, GL_INFO_LOG_LENGTH, &maxLength);
-
-        // The maxLength includes the NULL character
-        std::vector<GLchar> errorLog(maxLength);
-        glGetShaderInfoLog(fragment, maxLength, &maxLength, &errorLog[0]);
-
-        // Provide the infolog in whatever manor you deem best.
-        // Exit with failure.
-        for (auto &entry : errorLog)
-            std::cout << entry;
-        glDeleteShader(fragment); // Don't leak the shader.
-        return;
-    }
+    // Put the attributes where Scene::OpenGLSetup points the vertex and normal buffers.
+    shader.BindAttribute(0, "vertex_in");
+    shader.BindAttribute(1, "normal_in");
 
-    glAttachShader(shader, vertex);
-    glAttachShader(shader, fragment);
-
-    glLinkProgram(shader);
-    std::cout << "Enabling fragment program: " << gluErrorString(glGetError())
-         << "\n";
-    glGetProgramInfoLog(shader, 1024, &blah, buf);
-    std::cout << buf;
-
-    std::cout << "Enabling program object\n";
-    glUseProgram(shader);
+    if (shader.Load())
+        glUseProgram(shader.Program());
 }
 
 /**
@@ -147,6 +127,17 @@ void shader_setup() {
 void display() {
     // Reset GL stuff.
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    if (show_preview) {
+        std::lock_guard<std::mutex> lock(preview_mutex);
+
+        // Image rows start at the bottom, same as OpenGL.
+        glWindowPos2i(0, 0);
+        glDrawPixels(preview.xres, preview.yres, GL_RGB, GL_FLOAT, preview.pixels.data());
+        if (!headless.enabled)
+            glutSwapBuffers();
+        return;
+    }
     
     glLoadIdentity();
 
@@ -175,7 +166,18 @@ void display() {
     }
     
     // Swap in the new buffer.
-    glutSwapBuffers();
+    if (!headless.enabled)
+        glutSwapBuffers();
+}
+
+/**
+ * Draws a frame of --headless mode. The arcball spins the scene one full turn about
+ * the y axis over all of the frames.
+ */
+void draw_headless_frame(int frame) {
+    float angle = 2 * M_PI * frame / headless.frames;
+    arcball.SetRotation(Eigen::Quaternionf(Eigen::AngleAxisf(angle, Eigen::Vector3f::UnitY())));
+    display();
 }
 
 /**
@@ -237,6 +239,50 @@ void key_pressed(unsigned char key, int x, int y) {
             glMatrixMode(GL_MODELVIEW);
             break;
         };
+        case 'p': {
+            RaytraceOptions opts = scene.GetOptions();
+            opts.packets = !opts.packets;
+            scene.SetOptions(opts);
+
+            std::cout << "Packet tracing " << (opts.packets ? "enabled" : "disabled") << "\n";
+            break;
+        };
+        case 'g': {
+            RaytraceOptions opts = scene.GetOptions();
+            opts.gbuffer = !opts.gbuffer;
+            scene.SetOptions(opts);
+
+            std::cout << "G-buffer cache " << (opts.gbuffer ? "enabled" : "disabled") << "\n";
+            break;
+        };
+        case 'h': {
+            RaytraceOptions opts = scene.GetOptions();
+            opts.hybrid = !opts.hybrid;
+            scene.SetOptions(opts);
+
+            std::cout << "Hybrid visibility " << (opts.hybrid ? "enabled" : "disabled") << "\n";
+            break;
+        };
+        case 'b': {
+            RaytraceOptions opts = scene.GetOptions();
+            opts.bvh = !opts.bvh;
+            scene.SetOptions(opts);
+
+            std::cout << "Scene BVH " << (opts.bvh ? "enabled" : "disabled") << "\n";
+            break;
+        };
+        case 'n': {
+            RaytraceOptions opts = scene.GetOptions();
+            opts.mesh_guess = !opts.mesh_guess;
+            scene.SetOptions(opts);
+
+            std::cout << "Tesselation-seeded Newton guesses " << (opts.mesh_guess ? "enabled" : "disabled") << "\n";
+            break;
+        };
+        case 'v': {
+            show_preview = !show_preview;
+            break;
+        };
         case 'r': {
             std::thread draw_thread(&Scene::Raytrace, &scene);
             draw_thread.detach();
@@ -250,6 +296,8 @@ void key_pressed(unsigned char key, int x, int y) {
 }
 
 int main(int argc, char *argv[]) {
+    headless = ParseHeadlessOptions(argc, argv);
+
     // Grab the xres and yres from arguments.
     if (argc >= 3) {
         try {
@@ -268,20 +316,28 @@ int main(int argc, char *argv[]) {
 
     arcball = Arcball(xres, yres);
 
-    // Initialize GLUT.
-    glutInit(&argc, argv);
-
-    // Logic for centering window on screen.
-    int screen_width  = glutGet(GLUT_SCREEN_WIDTH);
-    int screen_height = glutGet(GLUT_SCREEN_HEIGHT);
-    int pos_x = (screen_width - xres) / 2;
-    int pos_y = (screen_height - yres) / 2;
-
-    // Set up GLUT window.
-    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
-    glutInitWindowSize(xres, yres);
-    glutInitWindowPosition(pos_x, pos_y);
-    glutCreateWindow("CS 171 Renderer");
+    if (headless.enabled) {
+        // Draw into an offscreen framebuffer instead of a window.
+        if (!CreateOffscreenContext(xres, yres)) {
+            std::cerr << "Error creating offscreen OpenGL context\n";
+            exit(1);
+        }
+    } else {
+        // Initialize GLUT.
+        glutInit(&argc, argv);
+
+        // Logic for centering window on screen.
+        int screen_width  = glutGet(GLUT_SCREEN_WIDTH);
+        int screen_height = glutGet(GLUT_SCREEN_HEIGHT);
+        int pos_x = (screen_width - xres) / 2;
+        int pos_y = (screen_height - yres) / 2;
+
+        // Set up GLUT window.
+        glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+        glutInitWindowSize(xres, yres);
+        glutInitWindowPosition(pos_x, pos_y);
+        glutCreateWindow("CS 171 Renderer");
+    }
 
     YAML::Node ln;
     if (argc > 3) {
@@ -291,15 +347,30 @@ int main(int argc, char *argv[]) {
     }
     scene = ln.as<Scene>();
 
+    RaytraceOptions opts = scene.GetOptions();
+    opts.width = xres;
+    opts.height = yres;
+    opts.on_progress = update_preview;
+    if (argc > 4) {
+        opts.time_budget = std::stod(argv[4]);
+    }
+    scene.SetOptions(opts);
+
     shader_setup();
     init();
 
+    if (headless.enabled) {
+        RenderOffscreen(headless, xres, yres, draw_headless_frame);
+        return 0;
+    }
+
     // Setup GLUT functions.
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
     glutMouseFunc(mouse_pressed);
     glutMotionFunc(mouse_moved);
     glutKeyboardFunc(key_pressed);
+    glutTimerFunc(100, refresh_preview, 0);
 
     // Start drawing.
     glutMainLoop();
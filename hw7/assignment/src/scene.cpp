@@ -1,116 +1,253 @@
 #include "scene.h"
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <thread>
 
-#include "glinclude.h"
+#include "stats.h"
 
-const float iotest_min = -10.0;
-const float iotest_max = 10.0;
-const float iotest_inc = 0.5;
+// Rebuild the BVH once refitting has made it this much more expensive than a fresh build
+const double BVH_REBUILD_RATIO = 1.5;
+
+// Superquadrics fit in [-1, 1]^3 in body space. Newton's method accepts points a little
+// outside the surface, so pad that a little.
+const double BODY_BOUNDS = 1.001;
+
+// World-space bounds of a superquadric instance, from the corners of its body-space box
+static Bounds InstanceBounds(const SuperquadricInstance &instance) {
+    Bounds bounds;
+    for (int corner = 0; corner < 8; corner++) {
+        Eigen::Vector4d point(corner & 1 ? BODY_BOUNDS : -BODY_BOUNDS, corner & 2 ? BODY_BOUNDS : -BODY_BOUNDS,
+                              corner & 4 ? BODY_BOUNDS : -BODY_BOUNDS, 1.0);
+        point = instance.transform * point;
+        bounds.Extend(Eigen::Vector3d(point.head(3) / point(3)));
+    }
+
+    return bounds;
+}
 
 void Scene::ReloadObjects() {
     // Clear buffers then tesselate.
     vertex_buffer.clear();
     normal_buffer.clear();
 
+    // Shapes that were tesselated before come straight from the cache, and any new ones
+    // are uploaded the next time the scene is drawn
     for (auto &obj : root_objects) {
-        obj->Tesselate(vertex_buffer, normal_buffer);
+        obj->Tesselate(tesselations, vertex_buffer, normal_buffer);
     }
 }
 
-void Scene::ReloadLighting() {
-    for (unsigned int i = 0; i < lights.size(); i++) {
-        int light = GL_LIGHT0 + i;
+void Scene::UpdateBVH() {
+    auto start_time = std::chrono::steady_clock::now();
+
+    InstanceList flattened;
+    for (auto &obj : root_objects) {
+        obj->Flatten(Eigen::Matrix4d::Identity(), flattened);
+    }
+
+    // Refitting only works if the tree still has the same leaves
+    bool same_graph = flattened.size() == instances.size();
+    for (size_t i = 0; same_graph && i < instances.size(); i++) {
+        same_graph = flattened[i].obj == instances[i].obj;
+    }
+
+    instances = flattened;
+
+    std::vector<Bounds> boxes;
+    for (auto &instance : instances) {
+        boxes.push_back(InstanceBounds(instance));
+    }
+
+    bool rebuild = !same_graph || bvh.Empty();
+    double cost = 0.0;
+
+    if (!rebuild) {
+        bvh.Refit(boxes);
+        cost = bvh.Cost();
+        rebuild = cost > BVH_REBUILD_RATIO * bvh_build_cost;
+    }
 
-        lights[i].OpenGLInit(light);
-        lights[i].OpenGLRender(light);
+    if (rebuild) {
+        bvh.Build(boxes);
+        bvh_build_cost = cost = bvh.Cost();
     }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::cout << (rebuild ? "Rebuilt" : "Refit") << " the BVH over " << instances.size() << " superquadrics in "
+              << seconds << "s (SAH cost " << cost / bvh_build_cost << "x the last build)\n";
 }
 
-void Scene::OpenGLSetup() {
-    // Setup lights.
-    glEnable(GL_LIGHTING);
-    ReloadLighting();
+Bounds Scene::GetBounds() {
+    InstanceList flattened;
+    for (auto &obj : root_objects) {
+        obj->Flatten(Eigen::Matrix4d::Identity(), flattened);
+    }
 
-    glGenVertexArrays(1, &buffer_array);
-    glBindVertexArray(buffer_array);
-    glGenBuffers(2, buffer_objects);
+    Bounds bounds;
+    for (auto &instance : flattened) {
+        bounds.Extend(InstanceBounds(instance));
+    }
 
-    ReloadObjects();
+    return bounds;
 }
 
-void Scene::OpenGLRender() {
-    // Setup lights.
-    for (unsigned int i = 0; i < lights.size(); i++) {
-        int light = GL_LIGHT0 + i;
+OccupancyVolume Scene::Voxelize(const Bounds &bounds, int resolution) {
+    auto start_time = std::chrono::steady_clock::now();
+    const int brick_size = OccupancyVolume::BRICK_SIZE;
 
-        lights[i].OpenGLRender(light);
+    // Flattened separately from the raytracing instances, so this doesn't touch the BVH
+    InstanceList flattened;
+    for (auto &obj : root_objects) {
+        obj->Flatten(Eigen::Matrix4d::Identity(), flattened);
     }
 
-    glBindBuffer(GL_ARRAY_BUFFER, buffer_objects[0]);
-    glBufferData(GL_ARRAY_BUFFER, 3 * sizeof(float) * vertex_buffer.size(), vertex_buffer.data(), GL_STATIC_DRAW);
+    std::vector<Bounds> boxes;
+    std::vector<int> all;
+    for (size_t i = 0; i < flattened.size(); i++) {
+        boxes.push_back(InstanceBounds(flattened[i]));
+        all.push_back(i);
+    }
 
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(0);
+    double spacing = resolution > 1 ? (bounds.upper - bounds.lower).maxCoeff() / (resolution - 1) : 0.0;
+    OccupancyVolume volume(resolution, bounds.lower, spacing);
 
-    glBindBuffer(GL_ARRAY_BUFFER, buffer_objects[1]);
-    glBufferData(GL_ARRAY_BUFFER, 3 * sizeof(float) * normal_buffer.size(), normal_buffer.data(), GL_STATIC_DRAW);
+    // Bricks that overlap at least one superquadric, with the superquadrics they overlap
+    std::vector<std::pair<Eigen::Vector3i, std::vector<int>>> bricks;
 
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, 0);
-    glEnableVertexAttribArray(1);
+    int brick_count = (resolution + brick_size - 1) / brick_size;
+    int root_size = 1;
+    while (root_size < brick_count) {
+        root_size *= 2;
+    }
 
-    for (auto &obj : root_objects) {
-        obj->OpenGLRender();
+    // Octree over the bricks, where each cell only passes on the superquadrics that overlap it
+    std::function<void(const Eigen::Vector3i &, int, const std::vector<int> &)> subdivide =
+        [&](const Eigen::Vector3i &corner, int size, const std::vector<int> &candidates) {
+            Eigen::Vector3i first = corner * brick_size;
+            Eigen::Vector3i last = ((corner.array() + size) * brick_size).min(resolution) - 1;
+
+            Bounds cell;
+            cell.Extend(volume.GetPoint(first(0), first(1), first(2)));
+            cell.Extend(volume.GetPoint(last(0), last(1), last(2)));
+
+            std::vector<int> overlapping;
+            for (int index : candidates) {
+                if (cell.Overlaps(boxes[index])) {
+                    overlapping.push_back(index);
+                }
+            }
+
+            if (overlapping.empty()) {
+                return;
+            }
+
+            if (size == 1) {
+                bricks.emplace_back(corner, overlapping);
+                return;
+            }
+
+            int half = size / 2;
+            for (int child = 0; child < 8; child++) {
+                Eigen::Vector3i child_corner = corner + half * Eigen::Vector3i(child & 1, child >> 1 & 1, child >> 2 & 1);
+                if ((child_corner.array() < brick_count).all()) {
+                    subdivide(child_corner, half, overlapping);
+                }
+            }
+        };
+
+    if (resolution > 0 && !all.empty()) {
+        subdivide(Eigen::Vector3i::Zero(), root_size, all);
     }
-}
 
-void Scene::IOTest() {
-    glPointSize(6.0);
-    glEnable(GL_POINT_SMOOTH);
+    // Test the points of each brick against its superquadrics, a brick at a time per thread
+    std::vector<OccupancyVolume::Brick> bits(bricks.size());
+    std::atomic<int> next(0);
+
+    auto worker = [&]() {
+        PointArray points(brick_size * brick_size * brick_size, 3);
+        PointMask inside(points.rows());
 
-    float inside_color[3] = { 0.0, 0.6, 1.0 };
+        for (int k = next++; k < (int) bricks.size(); k = next++) {
+            Eigen::Vector3i first = bricks[k].first * brick_size;
+
+            for (int z = 0; z < brick_size; z++) {
+                for (int y = 0; y < brick_size; y++) {
+                    for (int x = 0; x < brick_size; x++) {
+                        Eigen::Vector3d point = volume.GetPoint(first(0) + x, first(1) + y, first(2) + z);
+                        points.row(x + brick_size * (y + brick_size * z)) = point.cast<float>().transpose();
+                    }
+                }
+            }
 
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, inside_color);
-    glBegin(GL_POINTS);
+            inside.setConstant(false);
+            for (int index : bricks[k].second) {
+                flattened[index].obj->IOTest(points, flattened[index].inverse, inside);
+            }
 
-    for (float x = iotest_min; x <= iotest_max; x += iotest_inc) {
-        for (float y = iotest_min; y <= iotest_max; y += iotest_inc) {
-            for (float z = iotest_min; z <= iotest_max; z += iotest_inc) {
-                Eigen::Vector3d point = {x, y, z};
-                for (auto &obj : root_objects) {
-                    bool inside = obj->IOTest(point);
-                    if (inside) {
-                        glVertex3dv(point.data());
+            // Points past the end of the grid in the last bricks along each axis don't count
+            bits[k].fill(0);
+            for (int z = 0; z < brick_size && first(2) + z < resolution; z++) {
+                for (int y = 0; y < brick_size && first(1) + y < resolution; y++) {
+                    for (int x = 0; x < brick_size && first(0) + x < resolution; x++) {
+                        if (inside(x + brick_size * (y + brick_size * z))) {
+                            bits[k][z] |= 1ull << (x + brick_size * y);
+                        }
                     }
                 }
             }
         }
+    };
+
+    std::vector<std::thread> workers;
+    for (int t = 1; t < options.threads; t++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    for (size_t k = 0; k < bricks.size(); k++) {
+        volume.SetBrick(bricks[k].first, bits[k]);
     }
 
-    glEnd();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::cout << "Voxelized " << flattened.size() << " superquadrics at " << resolution << "^3 in " << seconds
+              << "s (" << volume.Count() << " points inside, " << bricks.size() << " of "
+              << (size_t) brick_count * brick_count * brick_count << " bricks tested)\n";
+
+    return volume;
 }
 
-void Scene::DrawIntersectTest() {
-    Ray incoming = Ray { Eigen::Vector3d(0, 0, -5), Eigen::Vector3d(0, 0, 1) };
-    auto closest = ClosestIntersection(incoming);
-    Ray intersection = closest.second.location;
+std::pair<float, Intersection> Scene::ClosestIntersection(const Ray &incoming) const {
+    std::pair<float, Intersection> closest = std::make_pair(INFINITY, Intersection());
+    RayStats &stats = ThreadStats();
+    stats.scene_rays++;
+
+    if (options.bvh && !bvh.Empty()) {
+        double t_max = INFINITY;
 
-    float outside_color[3] = { 1.0, 1.0, 1.0 };
+        stats.bvh_nodes += bvh.Traverse(incoming.origin, incoming.direction, t_max, [&](int index) {
+            const SuperquadricInstance &instance = instances[index];
+            auto temp = instance.obj->Intersect(incoming, instance.transform, instance.inverse);
 
-    glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE, outside_color);
-    glLineWidth(2.0);
-    glBegin(GL_LINES);
-    glVertex3dv(incoming.origin.data());
-    glVertex3dv(incoming.At(1.0).data());
-    glEnd();
+            if (temp.first < t_max) {
+                t_max = temp.first;
+                closest = temp;
+            }
+        });
+
+        return closest;
+    }
 
-    glBegin(GL_LINES);
-    glVertex3dv(intersection.origin.data());
-    glVertex3dv(intersection.At(1.0).data());
-    glEnd();
+    return SceneGraphIntersection(incoming);
 }
 
-std::pair<float, Intersection> Scene::ClosestIntersection(const Ray &incoming) const {
+std::pair<float, Intersection> Scene::SceneGraphIntersection(const Ray &incoming) const {
     std::pair<float, Intersection> closest = std::make_pair(INFINITY, Intersection());
 
     for (auto &obj : root_objects) {
@@ -122,4 +259,51 @@ std::pair<float, Intersection> Scene::ClosestIntersection(const Ray &incoming) c
     }
 
     return closest;
-}
\ No newline at end of file
+}
+
+PacketHit Scene::ClosestIntersection(const RayPacket &incoming) const {
+    PacketHit closest;
+    closest.fill(std::make_pair(INFINITY, Intersection()));
+    RayStats &stats = ThreadStats();
+    stats.scene_rays += incoming.lanes;
+
+    if (options.bvh && !bvh.Empty()) {
+        PacketArray t_max = PacketArray::Constant(INFINITY);
+
+        stats.bvh_nodes += incoming.lanes * bvh.Traverse(incoming.origin, incoming.direction, t_max, [&](int index) {
+            const SuperquadricInstance &instance = instances[index];
+            PacketHit temp = instance.obj->Intersect(incoming, instance.transform, instance.inverse);
+
+            for (int lane = 0; lane < PACKET_SIZE; lane++) {
+                if (temp[lane].first < t_max(lane)) {
+                    t_max(lane) = temp[lane].first;
+                    closest[lane] = temp[lane];
+                }
+            }
+        });
+
+        return closest;
+    }
+
+    for (auto &obj : root_objects) {
+        PacketHit temp = obj->ClosestIntersection(incoming);
+
+        for (int lane = 0; lane < PACKET_SIZE; lane++) {
+            if (temp[lane].first < closest[lane].first) {
+                closest[lane] = temp[lane];
+            }
+        }
+    }
+
+    return closest;
+}
+
+size_t Scene::GeometryHash() const {
+    size_t seed = 0;
+
+    for (auto &obj : root_objects) {
+        HashCombine(seed, obj->GeometryHash());
+    }
+
+    return seed;
+}
@@ -1,16 +1,103 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include <algorithm>
 #include <fstream>
+#include <functional>
 #include <map>
 #include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include <Eigen/Dense>
 
+#include "bvh.h"
 #include "camera.h"
+#include "image.h"
 #include "light.h"
 #include "object.h"
+#include "tesselation.h"
+#include "voxel.h"
+
+// Settings that control how Scene::Raytrace renders the image.
+class RaytraceOptions {
+public:
+    // Resolution of the raytraced image, and where it is saved.
+    int width;
+    int height;
+    std::string output;
+
+    // Number of threads tracing the image.
+    int threads;
+
+    // Trace primary rays in SIMD packets rather than one at a time.
+    bool packets;
+
+    // Adaptive antialiasing: pixels whose color differs from a neighbor by more than
+    // aa_threshold (or that see a different object) are refined with up to
+    // aa_max_samples stratified samples. A maximum of 1 disables antialiasing.
+    float aa_threshold;
+    int aa_max_samples;
+
+    // Hybrid primary visibility: rasterize the tesselation on the CPU and use its
+    // depth to seed a few Newton steps on the single object each pixel sees, only
+    // doing a full traversal near silhouettes or when that fails.
+    bool hybrid;
+
+    // Seed Newton's method with the first hit on a BVH over each superquadric's
+    // tesselation instead of its bounding sphere, which starts much closer to thin or
+    // boxy surfaces. Rays that miss the tesselation skip Newton's method entirely.
+    bool mesh_guess;
+
+    // Find the objects a ray might hit with a BVH over the world-space bounds of every
+    // superquadric, instead of testing each object in the scene graph in turn.
+    bool bvh;
+
+    // Secondary rays for reflective and refractive materials, traced from an explicit stack
+    // per sample. A sample spawns at most ray_budget of them in total, and a ray is only
+    // spawned if its weight in the sample's color is at least min_throughput.
+    int ray_budget;
+    float min_throughput;
+
+    // Keep the primary-ray hits of each raytrace in a G-buffer, and reuse them on the
+    // next raytrace if the camera and geometry haven't changed (e.g. when relighting).
+    bool gbuffer;
+
+    // Progressive rendering: trace a 1/16 and then a 1/4 resolution preview before the
+    // full resolution pass and antialiasing, calling on_progress with the image after
+    // each stage. Rendering stops wherever it is once time_budget seconds have passed
+    // (0 means no limit), and whatever was finished is saved.
+    bool progressive;
+    double time_budget;
+    std::function<void(const Image &)> on_progress;
+
+    // Optional outputs: a JSON summary of the ray and Newton's method counters, and an image
+    // of the Newton iterations spent on each pixel. Empty paths skip them.
+    std::string stats_output;
+    std::string heatmap;
+
+    RaytraceOptions(): width(500), height(500), output("rt.png"),
+                       threads(std::max(1u, std::thread::hardware_concurrency())),
+                       packets(true), aa_threshold(0.1), aa_max_samples(16), hybrid(false),
+                       mesh_guess(false), bvh(true), ray_budget(16), min_throughput(0.01), gbuffer(false),
+                       progressive(true), time_budget(0) {};
+};
+
+// Primary-ray hits saved by Scene::Raytrace, along with hashes of the camera and
+// geometry they were traced against.
+class GBuffer {
+public:
+    size_t camera_hash;
+    size_t geometry_hash;
+    int xres;
+    int yres;
+
+    // Every primary sample traced through each pixel, in sample order.
+    std::vector<std::vector<std::pair<double, Intersection>>> samples;
+
+    GBuffer(): camera_hash(0), geometry_hash(0), xres(0), yres(0) {};
+};
 
 class Scene {
 private:
@@ -21,11 +108,43 @@ private:
     std::map<std::string, std::shared_ptr<Object>> objects;
 
     Camera camera;
+    RaytraceOptions options;
+    GBuffer gbuffer;
+
+    // Every superquadric in the scene graph with its world transform, and a BVH over
+    // their bounds. Both are kept up to date by UpdateBVH, and only Raytrace (one at a time)
+    // uses or replaces them.
+    InstanceList instances;
+    BoxBVH bvh;
+    double bvh_build_cost;
 
+    // Points drawn by IOTest, and the geometry hash they were computed for.
+    OccupancyVolume iotest_volume;
+    size_t iotest_hash;
+
+    // Every level of detail of every shape in the scene. vertex_buffer and normal_buffer
+    // only hold the base level of each superquadric, for the raytracer.
+    TesselationCache tesselations;
+
+    // Vertex array and the buffer objects holding the tesselation cache's vertices and
+    // normals. The cache only ever grows, so only the vertices that were added since the
+    // last upload are sent to the GPU. The capacity is how many vertices the buffer
+    // objects currently have room for, which doubles whenever the cache outgrows it.
     unsigned int buffer_array;
     unsigned int buffer_objects[2];
+    size_t buffer_uploaded;
+    size_t buffer_capacity;
+
+    // Sends any new vertices in the tesselation cache to the buffer objects.
+    void UploadBuffers();
+
+    // Every superquadric drawn by OpenGLRender with its world transform, sorted by material,
+    // and the geometry hash it was flattened for.
+    InstanceList draw_list;
+    size_t draw_list_hash;
 public:
-    Scene() = default;
+    Scene(): bvh_build_cost(0), iotest_hash(0), buffer_array(0), buffer_objects{0, 0}, buffer_uploaded(0),
+             buffer_capacity(0), draw_list_hash(0) {};
     Scene(std::ifstream &scene_file);
 
     void ReloadObjects();
@@ -36,7 +155,26 @@ public:
     void DrawIntersectTest();
     void Raytrace();
 
+    // Re-flattens the scene graph after its transforms have changed and refits the BVH to
+    // the new bounds. The BVH is only rebuilt if the scene graph itself changed, or if the
+    // refit tree has become too much worse than it was when it was last built.
+    void UpdateBVH();
+
+    // World-space bounds of every superquadric in the scene.
+    Bounds GetBounds();
+
+    // Inside-outside tests a resolution^3 grid of points spanning bounds (along its longest
+    // axis). Octree cells are only tested against the superquadrics whose bounds they
+    // overlap, and cells that overlap none are skipped entirely.
+    OccupancyVolume Voxelize(const Bounds &bounds, int resolution);
+
     std::pair<float, Intersection> ClosestIntersection(const Ray &incoming) const;
+    PacketHit ClosestIntersection(const RayPacket &incoming) const;
+
+    // Closest hit found by testing each object in the scene graph in turn. Never touches the
+    // instances or the BVH, so it is safe to call while a raytrace is rebuilding them.
+    std::pair<float, Intersection> SceneGraphIntersection(const Ray &incoming) const;
+    size_t GeometryHash() const;
 
     void SetCamera(const Camera &cam) {
         camera = cam;
@@ -46,6 +184,14 @@ public:
         return camera;
     }
 
+    void SetOptions(const RaytraceOptions &opts) {
+        options = opts;
+    }
+
+    const RaytraceOptions& GetOptions() const {
+        return options;
+    }
+
     const std::vector<Light> GetLights() const {
         return lights;
     }
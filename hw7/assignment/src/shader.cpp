@@ -0,0 +1,214 @@
+#include "shader.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#include <sys/stat.h>
+
+// Reads the whole file into contents. Returns false if it can't be opened.
+static bool ReadFile(const std::string &path, std::string &contents) {
+    std::ifstream file(path);
+    if (!file)
+        return false;
+
+    getline(file, contents, '\0');
+    return true;
+}
+
+// Time the file was last modified, or 0 if it doesn't exist.
+static time_t ModificationTime(const std::string &path) {
+    struct stat file_stat;
+    if (stat(path.c_str(), &file_stat) != 0)
+        return 0;
+
+    return file_stat.st_mtime;
+}
+
+// Mixes the bytes of s, and a terminating null so consecutive strings can't run into one
+// another, into a 64-bit FNV-1a hash. Unlike std::hash, it is the same on every run.
+static uint64_t HashString(uint64_t hash, const std::string &s) {
+    for (size_t i = 0; i <= s.size(); i++) {
+        hash ^= (unsigned char) s.c_str()[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Compiles a shader, or returns 0 and prints the compiler's log if it doesn't compile.
+static GLuint CompileShader(GLenum type, const std::string &source, const std::string &path) {
+    GLuint shader = glCreateShader(type);
+    const char *shader_source = source.c_str();
+    glShaderSource(shader, 1, &shader_source, NULL);
+    glCompileShader(shader);
+
+    GLint compiled = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (compiled == GL_FALSE) {
+        GLint length = 0;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+
+        std::vector<GLchar> log(length + 1, '\0');
+        glGetShaderInfoLog(shader, length, &length, log.data());
+        std::cerr << "Error compiling " << path << ":\n" << log.data() << "\n";
+
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    return shader;
+}
+
+// Loads a program binary saved by SaveCachedProgram. Returns 0 if there is none, or if the
+// driver rejects it.
+static GLuint LoadCachedProgram(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return 0;
+
+    // The file holds the binary's format, followed by the binary itself.
+    GLenum format;
+    if (!file.read((char *) &format, sizeof(format)))
+        return 0;
+    std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (binary.empty())
+        return 0;
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, format, binary.data(), binary.size());
+
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if (linked == GL_FALSE) {
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Saves the linked program's binary, if the driver can give one back.
+static void SaveCachedProgram(GLuint program, const std::string &path) {
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (formats == 0 || length == 0)
+        return;
+
+    GLenum format;
+    std::vector<char> binary(length);
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+
+    mkdir(SHADER_CACHE_DIR.c_str(), 0755);
+    std::ofstream file(path, std::ios::binary);
+    file.write((const char *) &format, sizeof(format));
+    file.write(binary.data(), length);
+    file.close();
+
+    // Don't leave a partly written binary behind.
+    if (!file)
+        std::remove(path.c_str());
+}
+
+ShaderProgram::ShaderProgram(const std::string &vert_path, const std::string &frag_path):
+    program(0), vert_path(vert_path), frag_path(frag_path), vert_time(0), frag_time(0) {}
+
+void ShaderProgram::BindAttribute(GLuint location, const std::string &name) {
+    attributes[name] = location;
+}
+
+bool ShaderProgram::Load() {
+    // Remember which versions of the files were read even if they don't build, so a broken
+    // edit is only reported once.
+    vert_time = ModificationTime(vert_path);
+    frag_time = ModificationTime(frag_path);
+
+    std::string vert_source, frag_source;
+    if (!ReadFile(vert_path, vert_source)) {
+        std::cerr << "Error opening vertex shader program " << vert_path << "\n";
+        return false;
+    }
+    if (!ReadFile(frag_path, frag_source)) {
+        std::cerr << "Error opening fragment shader program " << frag_path << "\n";
+        return false;
+    }
+
+    // A binary only loads on the driver that saved it, so the driver goes into the key
+    // along with everything that goes into linking.
+    uint64_t hash = 14695981039346656037ULL;
+    hash = HashString(hash, (const char *) glGetString(GL_VENDOR));
+    hash = HashString(hash, (const char *) glGetString(GL_RENDERER));
+    hash = HashString(hash, (const char *) glGetString(GL_VERSION));
+    hash = HashString(hash, vert_source);
+    hash = HashString(hash, frag_source);
+    for (auto &attribute : attributes) {
+        hash = HashString(hash, attribute.first);
+        hash = HashString(hash, std::to_string(attribute.second));
+    }
+
+    char cache_name[32];
+    std::snprintf(cache_name, sizeof(cache_name), "/%016llx.bin", (unsigned long long) hash);
+    std::string cache_path = SHADER_CACHE_DIR + cache_name;
+
+    GLuint linked_program = LoadCachedProgram(cache_path);
+    if (!linked_program) {
+        GLuint vertex = CompileShader(GL_VERTEX_SHADER, vert_source, vert_path);
+        if (!vertex)
+            return false;
+        GLuint fragment = CompileShader(GL_FRAGMENT_SHADER, frag_source, frag_path);
+        if (!fragment) {
+            glDeleteShader(vertex);
+            return false;
+        }
+
+        linked_program = glCreateProgram();
+        glAttachShader(linked_program, vertex);
+        glAttachShader(linked_program, fragment);
+        for (auto &attribute : attributes)
+            glBindAttribLocation(linked_program, attribute.second, attribute.first.c_str());
+
+        glProgramParameteri(linked_program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        glLinkProgram(linked_program);
+
+        // The linked program keeps working without its shaders.
+        glDetachShader(linked_program, vertex);
+        glDetachShader(linked_program, fragment);
+        glDeleteShader(vertex);
+        glDeleteShader(fragment);
+
+        GLint linked = GL_FALSE;
+        glGetProgramiv(linked_program, GL_LINK_STATUS, &linked);
+        if (linked == GL_FALSE) {
+            GLint length = 0;
+            glGetProgramiv(linked_program, GL_INFO_LOG_LENGTH, &length);
+
+            std::vector<GLchar> log(length + 1, '\0');
+            glGetProgramInfoLog(linked_program, length, &length, log.data());
+            std::cerr << "Error linking " << vert_path << " and " << frag_path << ":\n" << log.data() << "\n";
+
+            glDeleteProgram(linked_program);
+            return false;
+        }
+
+        SaveCachedProgram(linked_program, cache_path);
+    }
+
+    if (program)
+        glDeleteProgram(program);
+    program = linked_program;
+    return true;
+}
+
+bool ShaderProgram::ReloadIfChanged() {
+    if (ModificationTime(vert_path) == vert_time && ModificationTime(frag_path) == frag_time)
+        return false;
+
+    if (!Load())
+        return false;
+
+    std::cout << "Reloaded " << vert_path << " and " << frag_path << "\n";
+    return true;
+}
@@ -0,0 +1,42 @@
+#ifndef SHADER_H
+#define SHADER_H
+
+#include <ctime>
+#include <map>
+#include <string>
+
+#include "glinclude.h"
+
+// Directory, relative to where the renderer is run, that linked programs are cached in.
+const std::string SHADER_CACHE_DIR = "shader_cache";
+
+// A GLSL program made of a vertex and a fragment shader read from files. Linked programs
+// are saved with glGetProgramBinary, keyed by a hash of their sources and the driver, so
+// later runs load them with glProgramBinary instead of compiling and linking. The program
+// can also be rebuilt whenever its files are edited, without restarting.
+class ShaderProgram {
+private:
+    GLuint program;
+    std::string vert_path, frag_path;
+    std::map<std::string, GLuint> attributes;
+
+    // Modification times of the files when the program was last built.
+    time_t vert_time, frag_time;
+public:
+    ShaderProgram(): program(0), vert_time(0), frag_time(0) {};
+    ShaderProgram(const std::string &vert_path, const std::string &frag_path);
+
+    // Binds a vertex attribute to a location when the program is linked.
+    void BindAttribute(GLuint location, const std::string &name);
+
+    // Builds the program, from the cache when possible, replacing the one built before.
+    // Returns false, printing why and keeping the old program, if it doesn't build.
+    bool Load();
+    // Builds the program again if either file changed since it was last built. Returns
+    // true if a new program replaced the old one.
+    bool ReloadIfChanged();
+
+    GLuint Program() const { return program; }
+};
+
+#endif // SHADER_H
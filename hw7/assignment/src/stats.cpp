@@ -0,0 +1,96 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <fstream>
+
+RayStats::RayStats() {
+    primary_rays = 0;
+    shadow_rays = 0;
+    secondary_rays = 0;
+    scene_rays = 0;
+    object_tests = 0;
+    bvh_nodes = 0;
+    newton_solves = 0;
+    newton_iterations = 0;
+    newton_failures = 0;
+    newton_max_iters = 0;
+    lane = 0;
+
+    for (int b = 0; b < NEWTON_BUCKETS; b++) {
+        newton_histogram[b] = 0;
+    }
+    ResetLanes();
+}
+
+void RayStats::RecordSolve(int iterations, bool converged, bool max_iters) {
+    int bucket = 0;
+    while (bucket + 1 < NEWTON_BUCKETS && iterations >= (1 << bucket)) {
+        bucket++;
+    }
+
+    newton_solves++;
+    newton_iterations += iterations;
+    newton_failures += !converged;
+    newton_max_iters += max_iters;
+    newton_histogram[bucket]++;
+    lane_iterations[lane] += iterations;
+}
+
+void RayStats::ResetLanes() {
+    for (int l = 0; l < PACKET_SIZE; l++) {
+        lane_iterations[l] = 0;
+    }
+}
+
+void RayStats::Merge(const RayStats &other) {
+    primary_rays += other.primary_rays;
+    shadow_rays += other.shadow_rays;
+    secondary_rays += other.secondary_rays;
+    scene_rays += other.scene_rays;
+    object_tests += other.object_tests;
+    bvh_nodes += other.bvh_nodes;
+    newton_solves += other.newton_solves;
+    newton_iterations += other.newton_iterations;
+    newton_failures += other.newton_failures;
+    newton_max_iters += other.newton_max_iters;
+
+    for (int b = 0; b < NEWTON_BUCKETS; b++) {
+        newton_histogram[b] += other.newton_histogram[b];
+    }
+}
+
+bool RayStats::WriteJSON(const std::string &path, int width, int height, double seconds) const {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+
+    double rays = std::max(1L, scene_rays);
+
+    out << "{\n";
+    out << "  \"width\": " << width << ",\n";
+    out << "  \"height\": " << height << ",\n";
+    out << "  \"seconds\": " << seconds << ",\n";
+    out << "  \"rays\": { \"primary\": " << primary_rays << ", \"shadow\": " << shadow_rays
+        << ", \"secondary\": " << secondary_rays << ", \"scene\": " << scene_rays << " },\n";
+    out << "  \"object_tests_per_ray\": " << object_tests / rays << ",\n";
+    out << "  \"bvh_nodes_per_ray\": " << bvh_nodes / rays << ",\n";
+    out << "  \"newton\": {\n";
+    out << "    \"solves\": " << newton_solves << ",\n";
+    out << "    \"iterations\": " << newton_iterations << ",\n";
+    out << "    \"failures\": " << newton_failures << ",\n";
+    out << "    \"max_iters\": " << newton_max_iters << ",\n";
+    out << "    \"histogram\": [\n";
+
+    for (int b = 0; b < NEWTON_BUCKETS; b++) {
+        long min_iters = b == 0 ? 0 : 1L << (b - 1);
+        out << "      { \"min_iterations\": " << min_iters << ", \"count\": " << newton_histogram[b] << " }"
+            << (b + 1 < NEWTON_BUCKETS ? ",\n" : "\n");
+    }
+
+    out << "    ]\n";
+    out << "  }\n";
+    out << "}\n";
+
+    return bool(out);
+}
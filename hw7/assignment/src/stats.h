@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <string>
+
+#include "object.h"
+
+// Buckets of the Newton iteration histogram. Bucket 0 counts solves that took no
+// iterations, and bucket b > 0 counts solves that took [2^(b - 1), 2^b) iterations.
+const int NEWTON_BUCKETS = 16;
+
+// Counters for what the raytracer spent its time on. Each thread counts into its own
+// RayStats (see ThreadStats), which are merged once the threads are done.
+class RayStats {
+public:
+    // Rays by what they were traced for.
+    long primary_rays;
+    long shadow_rays;
+    long secondary_rays;
+
+    // Rays traced through Scene::ClosestIntersection, and the superquadrics and scene BVH
+    // nodes they were tested against. Packets count once per lane that holds a ray of its own.
+    long scene_rays;
+    long object_tests;
+    long bvh_nodes;
+
+    // Runs of Newton's method from a finite initial guess, how many of them failed to reach
+    // the surface and how many gave up after the maximum number of iterations.
+    long newton_solves;
+    long newton_iterations;
+    long newton_failures;
+    long newton_max_iters;
+    long newton_histogram[NEWTON_BUCKETS];
+
+    // Newton iterations per packet lane since the last ResetLanes, used to attribute the
+    // work to pixels. Solves are counted towards lane, which is 0 outside the packet solver.
+    long lane_iterations[PACKET_SIZE];
+    int lane;
+
+    RayStats();
+
+    void RecordSolve(int iterations, bool converged, bool max_iters);
+    void ResetLanes();
+    void Merge(const RayStats &other);
+
+    // Writes the counters as JSON, along with the size of the image and the render time.
+    bool WriteJSON(const std::string &path, int width, int height, double seconds) const;
+};
+
+// The calling thread's counters. Inline, since it is called for every ray and solve.
+inline RayStats &ThreadStats() {
+    thread_local RayStats stats;
+    return stats;
+}
+
+#endif // STATS_H
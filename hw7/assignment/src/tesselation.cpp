@@ -0,0 +1,58 @@
+#include "tesselation.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "object.h"
+
+// Longest a patch edge along the silhouette should be on screen, in pixels
+const float LOD_EDGE_PIXELS = 10.0;
+
+TesselatedShape &TesselationCache::Get(Superquadric &obj) {
+    auto found = shapes.find(obj.GetExponents());
+    if (found != shapes.end()) {
+        return found->second;
+    }
+
+    TesselatedShape &shape = shapes[obj.GetExponents()];
+    for (int i = 0; i < LOD_LEVELS; i++) {
+        TesselationLevel &level = shape.levels[i];
+        level.patches = LOD_PATCHES[i];
+        level.buffer_start = vertices.size();
+        obj.TesselateLevel(level.patches, vertices, normals);
+        level.buffer_end = vertices.size();
+
+        int start = level.buffer_start;
+        for (int j = 1; j < level.patches - 1; j++) {
+            level.strip_first.push_back(start);
+            level.strip_count.push_back(2 * (level.patches + 1));
+            start += 2 * (level.patches + 1);
+        }
+        for (int fan = 0; fan < 2; fan++) {
+            level.fan_first[fan] = start;
+            level.fan_count[fan] = level.patches + 2;
+            start += level.patches + 2;
+        }
+    }
+
+    // The finest level is the closest to the surface
+    const TesselationLevel &finest = shape.levels.back();
+    shape.radius = 0;
+    for (size_t i = finest.buffer_start; i < finest.buffer_end; i++) {
+        shape.radius = std::max(shape.radius, vertices[i].norm());
+    }
+    shape.hull_scale = 0;
+
+    return shape;
+}
+
+int TesselationCache::SelectLevel(float pixel_radius) {
+    float patches = 2 * M_PI * pixel_radius / LOD_EDGE_PIXELS;
+    for (int i = 0; i + 1 < LOD_LEVELS; i++) {
+        if (LOD_PATCHES[i] >= patches) {
+            return i;
+        }
+    }
+
+    return LOD_LEVELS - 1;
+}
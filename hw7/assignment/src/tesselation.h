@@ -0,0 +1,79 @@
+#ifndef TESSELATION_H
+#define TESSELATION_H
+
+#include <array>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Dense>
+
+class Superquadric;
+
+// Patches along u and v at each level of detail, from coarsest to finest.
+const int LOD_LEVELS = 5;
+const std::array<int, LOD_LEVELS> LOD_PATCHES = {{ 4, 8, 15, 30, 60 }};
+
+// Level used by the raytracer (the hull scale, guess BVHs and hybrid raster), which is also
+// what every superquadric was drawn with before there were levels of detail.
+const int BASE_LOD = 2;
+
+// A superquadric's tesselation at one level of detail, as a range of the cache's buffers.
+// Like every tesselation, it's laid out as latitude triangle strips followed by the bottom
+// and top triangle fans.
+class TesselationLevel {
+public:
+    int patches;
+    size_t buffer_start;
+    size_t buffer_end;
+
+    // First vertex and number of vertices of each strip, and of the two fans, laid out
+    // for glMultiDrawArrays.
+    std::vector<int> strip_first;
+    std::vector<int> strip_count;
+    std::array<int, 2> fan_first;
+    std::array<int, 2> fan_count;
+};
+
+// Every level of detail of the superquadrics with one pair of exponents.
+class TesselatedShape {
+public:
+    std::array<TesselationLevel, LOD_LEVELS> levels;
+
+    // Radius of the bounding sphere around the body origin.
+    float radius;
+
+    // Hull scale of the base level (see Superquadric::GetHullScale), or 0 until it has been
+    // measured.
+    double hull_scale;
+};
+
+// Tesselations of superquadrics in body space, shared by all superquadrics with the same
+// exponents. The first superquadric with a new pair of exponents tesselates it at every
+// level of detail, and the vertices are appended to the cache's buffers, which are never
+// cleared. Nothing has to be redone or sent to the GPU again when the scene is reloaded
+// with the same shapes.
+class TesselationCache {
+private:
+    std::map<std::pair<double, double>, TesselatedShape> shapes;
+    std::vector<Eigen::Vector3f> vertices;
+    std::vector<Eigen::Vector3f> normals;
+public:
+    // Tesselations of the superquadric's exponents. The shape stays where it is as the
+    // cache grows.
+    TesselatedShape &Get(Superquadric &obj);
+
+    // Finest level worth drawing for a superquadric whose bounding sphere has the given
+    // radius in pixels on screen.
+    static int SelectLevel(float pixel_radius);
+
+    const std::vector<Eigen::Vector3f> &GetVertices() const {
+        return vertices;
+    }
+
+    const std::vector<Eigen::Vector3f> &GetNormals() const {
+        return normals;
+    }
+};
+
+#endif // TESSELATION_H
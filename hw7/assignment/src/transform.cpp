@@ -2,8 +2,6 @@
 
 #include <iostream>
 
-#include "glinclude.h"
-
 using namespace Eigen;
 
 /**
@@ -17,10 +15,6 @@ Rotate::Rotate(double axis_x, double axis_y, double axis_z, double angle) {
     this->axis_z = axis_z / norm;
 }
 
-void Rotate::OpenGLTransform() const {
-    glRotatef(angle, axis_x, axis_y, axis_z);
-}
-
 Matrix4d Rotate::GetMatrix() {
     double theta = angle * M_PI / 180;
     double cos1m = 1 - cos(theta);
@@ -69,10 +63,6 @@ void Rotate::SetAxisAngle(Eigen::Vector3d axis, double theta) {
  */
 
 
-void Translate::OpenGLTransform() const {
-    glTranslatef(delta_x, delta_y, delta_z);
-}
-
 Matrix4d Translate::GetMatrix() {
     Matrix4d translation;
     translation << 1, 0, 0, delta_x,
@@ -99,10 +89,6 @@ void Translate::SetDelta(Eigen::Vector3d delta) {
  */
 
 
-void Scale::OpenGLTransform() const {
-    glScalef(scale_x, scale_y, scale_z);
-}
-
 Matrix4d Scale::GetMatrix() {
     Matrix4d scaling;
     scaling << scale_x, 0, 0, 0,
@@ -2,8 +2,6 @@
 
 #include <iostream>
 
-#include "glinclude.h"
-
 using namespace Eigen;
 
 /**
@@ -62,12 +60,10 @@ void Arcball::End() {
     curr = Quaternionf::Identity();
 }
 
-void Arcball::Apply() {
-    Quaternionf rotation = enabled ? (curr * base).normalized() : base;
-
-    float s = rotation.w();
-    float theta = 2 * acos(s) * 180 / M_PI;
-    Vector3f axis = rotation.coeffs().head<3>() / sqrt(1 - s * s);
+void Arcball::SetRotation(const Quaternionf &rotation) {
+    enabled = false;
 
-    glRotatef(theta, axis.x(), axis.y(), axis.z());
+    base = rotation.normalized();
+    curr = Quaternionf::Identity();
 }
+
@@ -1,6 +1,8 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <functional>
+
 #include <Eigen/Dense>
 
 class Color {
@@ -15,6 +17,12 @@ public:
     Eigen::Vector3f ToVector() const;
 };
 
+// Mixes the hash of value into seed (same scheme as boost::hash_combine).
+template <class T>
+inline void HashCombine(size_t &seed, const T &value) {
+    seed ^= std::hash<T>()(value) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
 class Arcball {
 private:
     bool enabled;
@@ -29,6 +37,8 @@ public:
     void Start(int x, int y);
     void Move(int x, int y);
     void End();
+    // Replaces the rotation built up so far, e.g. to spin the scene without the mouse.
+    void SetRotation(const Eigen::Quaternionf &rotation);
     void Apply();
 };
 
@@ -0,0 +1,86 @@
+#include "voxel.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+using namespace Eigen;
+
+OccupancyVolume::OccupancyVolume(int res, const Vector3d &orig, double space) {
+    resolution = res;
+    origin = orig;
+    spacing = space;
+}
+
+uint64_t OccupancyVolume::BrickKey(const Vector3i &brick) {
+    // 21 bits per axis is plenty for any volume that fits in memory
+    return (uint64_t) brick(0) | (uint64_t) brick(1) << 21 | (uint64_t) brick(2) << 42;
+}
+
+bool OccupancyVolume::Get(int i, int j, int k) const {
+    if (i < 0 || j < 0 || k < 0 || i >= resolution || j >= resolution || k >= resolution) {
+        return false;
+    }
+
+    auto it = bricks.find(BrickKey(Vector3i(i, j, k) / BRICK_SIZE));
+    if (it == bricks.end()) {
+        return false;
+    }
+
+    int bit = i % BRICK_SIZE + BRICK_SIZE * (j % BRICK_SIZE);
+    return it->second[k % BRICK_SIZE] >> bit & 1;
+}
+
+void OccupancyVolume::SetBrick(const Vector3i &brick, const Brick &bits) {
+    bool empty = std::all_of(bits.begin(), bits.end(), [](uint64_t word) { return word == 0; });
+
+    if (empty) {
+        bricks.erase(BrickKey(brick));
+    } else {
+        bricks[BrickKey(brick)] = bits;
+    }
+}
+
+size_t OccupancyVolume::Count() const {
+    size_t count = 0;
+    for (auto &entry : bricks) {
+        for (uint64_t word : entry.second) {
+            count += __builtin_popcountll(word);
+        }
+    }
+
+    return count;
+}
+
+bool OccupancyVolume::Export(const std::string &path) const {
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) {
+        return false;
+    }
+
+    // Sort the bricks so the same volume always gives the same file
+    std::vector<uint64_t> keys;
+    for (auto &entry : bricks) {
+        keys.push_back(entry.first);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    int32_t header[2] = { resolution, (int32_t) keys.size() };
+    double placement[4] = { origin(0), origin(1), origin(2), spacing };
+
+    fwrite("OCCV", 1, 4, fp);
+    fwrite(&header[0], sizeof(int32_t), 1, fp);
+    fwrite(placement, sizeof(double), 4, fp);
+    fwrite(&header[1], sizeof(int32_t), 1, fp);
+
+    for (uint64_t key : keys) {
+        int32_t coords[3] = { (int32_t) (key & 0x1fffff), (int32_t) (key >> 21 & 0x1fffff), (int32_t) (key >> 42) };
+        fwrite(coords, sizeof(int32_t), 3, fp);
+        fwrite(bricks.at(key).data(), sizeof(uint64_t), BRICK_SIZE, fp);
+    }
+
+    bool ok = !ferror(fp);
+    fclose(fp);
+
+    return ok;
+}
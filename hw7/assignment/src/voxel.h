@@ -0,0 +1,76 @@
+#ifndef VOXEL_H
+#define VOXEL_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include <Eigen/Dense>
+
+// Sparse occupancy grid of resolution^3 sample points, origin + spacing * (i, j, k).
+// Only the BRICK_SIZE^3 bricks with at least one occupied point are stored.
+class OccupancyVolume {
+public:
+    static const int BRICK_SIZE = 8;
+
+    // Occupancy bits of one brick. Word z holds slice z, with bit x + BRICK_SIZE * y
+    // set if that point is occupied.
+    typedef std::array<uint64_t, BRICK_SIZE> Brick;
+private:
+    int resolution;
+    Eigen::Vector3d origin;
+    double spacing;
+
+    // Occupied bricks, keyed by their packed brick coordinates (see BrickKey)
+    std::unordered_map<uint64_t, Brick> bricks;
+
+    static uint64_t BrickKey(const Eigen::Vector3i &brick);
+public:
+    OccupancyVolume(): resolution(0), origin(Eigen::Vector3d::Zero()), spacing(0) {};
+    OccupancyVolume(int resolution, const Eigen::Vector3d &origin, double spacing);
+
+    int GetResolution() const {
+        return resolution;
+    }
+
+    // World-space location of sample point (i, j, k).
+    Eigen::Vector3d GetPoint(int i, int j, int k) const {
+        return origin + spacing * Eigen::Vector3d(i, j, k);
+    }
+
+    bool Get(int i, int j, int k) const;
+
+    // Sets the occupancy of every point in a brick (given in brick coordinates). Empty
+    // bricks aren't stored.
+    void SetBrick(const Eigen::Vector3i &brick, const Brick &bits);
+
+    // Number of occupied points and stored bricks.
+    size_t Count() const;
+    size_t BrickCount() const {
+        return bricks.size();
+    }
+
+    // Calls visit(i, j, k) for every occupied point, in no particular order.
+    template <class F>
+    void ForEach(F visit) const {
+        for (auto &entry : bricks) {
+            Eigen::Vector3i base = BRICK_SIZE * Eigen::Vector3i(entry.first & 0x1fffff, (entry.first >> 21) & 0x1fffff,
+                                                                entry.first >> 42);
+            for (int z = 0; z < BRICK_SIZE; z++) {
+                for (int bit = 0; bit < BRICK_SIZE * BRICK_SIZE; bit++) {
+                    if (entry.second[z] >> bit & 1) {
+                        visit(base(0) + bit % BRICK_SIZE, base(1) + bit / BRICK_SIZE, base(2) + z);
+                    }
+                }
+            }
+        }
+    }
+
+    // Writes the volume to a little-endian binary file: the magic "OCCV", the resolution
+    // (int32), origin (3 doubles) and spacing (double), the number of bricks (int32), then
+    // for each brick its brick coordinates (3 int32s) and its Brick words (8 uint64s).
+    bool Export(const std::string &path) const;
+};
+
+#endif // VOXEL_H